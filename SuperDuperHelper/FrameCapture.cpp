@@ -0,0 +1,65 @@
+#include "FrameCapture.h"
+
+#include <chrono>
+
+void FrameCapture::Start(UINT pollUs)
+{
+	if (IsRunning())
+		return;
+	for (auto& frame : frames)
+	{
+		if (frame.pixels.empty())
+			frame.pixels.resize(GameLink::FRAMEBUFFER_MAX_LENGTH);
+	}
+	// Forget the previous session's frame: GetLatestFrame() returns nullptr until this one captures
+	hasFrame = false;
+	shared.fetch_and(INDEX_MASK, std::memory_order_relaxed);
+	poll_us = pollUs;
+	quit = false;
+	thread = std::thread(&FrameCapture::Run, this);
+}
+
+void FrameCapture::Stop()
+{
+	if (!IsRunning())
+		return;
+	quit = true;
+	thread.join();
+}
+
+const FrameCapture::sFrame* FrameCapture::GetLatestFrame(bool* isNew)
+{
+	bool bNew = false;
+	if (shared.load(std::memory_order_relaxed) & NEW_FRAME)
+	{
+		// Swap our buffer with the completed one
+		front = shared.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+		hasFrame = true;
+		bNew = true;
+	}
+	if (isNew)
+		*isNew = bNew;
+	return hasFrame ? &frames[front] : nullptr;
+}
+
+void FrameCapture::Run()
+{
+	bool hasSeq = false;
+	UINT16 lastSeq = 0;
+	while (!quit)
+	{
+		if (!hasSeq || GameLink::GetFrameSequence() != lastSeq)
+		{
+			sFrame& frame = frames[back];
+			if (GameLink::CopyFrameBuffer(&frame.info, frame.pixels.data(), (UINT32)frame.pixels.size()))
+			{
+				lastSeq = frame.info.seq;
+				hasSeq = true;
+				// Publish it, and take whichever buffer the renderer isn't holding
+				back = shared.exchange(back | NEW_FRAME, std::memory_order_acq_rel) & INDEX_MASK;
+				captured.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(poll_us));
+	}
+}
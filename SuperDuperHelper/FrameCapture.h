@@ -0,0 +1,57 @@
+#pragma once
+
+#include "GameLink.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief FrameCapture
+ * Copies each new AppleWin frame from GameLink on a background thread, so neither the
+ * emulator nor the GameLink mutex can stall the UI, and capture doesn't depend on the UI frame rate.
+ * Frames go through a triple buffer: the capture thread fills one buffer, the renderer reads another,
+ * and the third holds the newest completed frame. Neither side ever waits for the other.
+*/
+class FrameCapture
+{
+public:
+	struct sFrame
+	{
+		GameLink::sFramebufferInfo info;	// info.frameBuffer points to pixels
+		std::vector<UINT8> pixels;
+	};
+
+	~FrameCapture() { Stop(); }
+
+	// Starts the capture thread, which checks frame.seq every poll_us microseconds.
+	// GameLink must be active, and stay so until Stop(). Frames from before a restart are dropped.
+	void Start(UINT poll_us = 500);
+	// Stops and joins the capture thread. Call it before GameLink::Destroy().
+	void Stop();
+	bool IsRunning() const { return thread.joinable(); }
+
+	// Returns the newest completed frame, or nullptr if none was captured yet. Never blocks.
+	// The frame stays valid and unchanged until the next call. isNew tells whether it's a different
+	// frame than the one the previous call returned.
+	const sFrame* GetLatestFrame(bool* isNew = nullptr);
+
+	UINT64 GetCapturedCount() const { return captured.load(std::memory_order_relaxed); }
+
+private:
+	void Run();
+
+	// shared holds the index of the middle buffer, and NEW_FRAME when the capture thread put a frame there
+	enum : UINT8 { INDEX_MASK = 0x03, NEW_FRAME = 0x04 };
+
+	sFrame frames[3];
+	UINT8 back = 0;		// capture thread only
+	UINT8 front = 2;	// renderer only
+	bool hasFrame = false;	// renderer only
+	std::atomic<UINT8> shared = 1;
+
+	std::thread thread;
+	std::atomic<bool> quit = false;
+	std::atomic<UINT64> captured = 0;
+	UINT poll_us = 500;
+};
@@ -1,178 +1,195 @@
 #include "GameLink.h"
-
+#include "GameLinkProtocol.h"
+#include "GameLinkTransport.h"
+#include "SDHRCommand.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
 #include <vector>
 
-//------------------------------------------------------------------------------
-// Local Definitions
-//------------------------------------------------------------------------------
-
-#define SYSTEM_NAME		"AppleWin"
-#define PROTOCOL_VER		4
-#define GAMELINK_MUTEX_NAME		"DWD_GAMELINK_MUTEX_R4"
-#define GAMELINK_MMAP_NAME		"DWD_GAMELINK_MMAP_R4"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX() std::this_thread::yield()
+#endif
 
 using namespace GameLink;
 
 //------------------------------------------------------------------------------
-// Shared Memory Structure
+// Local Data
 //------------------------------------------------------------------------------
 
-#pragma pack( push, 1 )
-
-	//
-	// sSharedMMapFrame_R1
-	//
-	// Server -> Client Frame. 32-bit RGBA up to MAX_WIDTH x MAX_HEIGHT
-	//
-struct sSharedMMapFrame_R1
-{
-	UINT16 seq;
-	UINT16 width;
-	UINT16 height;
+static Transport* g_transport;
 
-	UINT8 image_fmt; // 0 = no frame; 1 = 32-bit 0xAARRGGBB
-	UINT8 reserved0;
+static bool g_TrackOnly;
 
-	UINT16 par_x; // pixel aspect ratio
-	UINT16 par_y;
+static sSharedMemoryMap_R4* g_p_shared_memory;
 
-	enum { MAX_WIDTH = 1280 };
-	enum { MAX_HEIGHT = 1024 };
+static UINT8* ramPointer;
 
-	enum { MAX_PAYLOAD = (int)MAX_WIDTH * (int)MAX_HEIGHT * 4 };
-	UINT8 buffer[MAX_PAYLOAD];
-};
+static sSharedMMapCmdRing_R5* g_p_cmd_ring;	// set when the host serves a command ring
 
-//
-// sSharedMMapInput_R2
-//
-// Client -> Server Input Data
-//
+static sWaitPolicy g_waitPolicy;
+// The policy's spin_count for the frame capture thread, SetWaitPolicy() is called from the UI's
+static std::atomic<UINT> g_frameSpinCount{ sWaitPolicy().spin_count };
 
-struct sSharedMMapInput_R2
+// Lock-free frame reads tried before falling back to the mutex
+constexpr UINT FRAME_READ_ATTEMPTS = 4;
+static_assert(FRAMEBUFFER_MAX_LENGTH == sSharedMMapFrame_R1::MAX_PAYLOAD, "FRAMEBUFFER_MAX_LENGTH is out of date");
+static sStats g_stats;
+// The sStats counted on the frame capture and input threads, while GetStats() is called from the UI's
+struct sThreadCounters
 {
-	float mouse_dx;
-	float mouse_dy;
-	UINT8 ready;
-	UINT8 mouse_btn;
-	UINT keyb_state[8];
-
-	enum { READY_NO = 0 };					// Input not ready
-	enum { READY_GC = 1 };					// Input from GC
-	enum { READY_OTHER = 17 };				// Input from other app
+	std::atomic<UINT64> frame_reads;
+	std::atomic<UINT64> frame_retries;
+	std::atomic<UINT64> frame_lock_fallbacks;
+	std::atomic<UINT64> input_updates;
+	std::atomic<UINT64> keyb_words;
+	std::atomic<UINT64> mouse_updates;
 };
+static sThreadCounters g_threadCounters;
+// Messages handed to the host since Init(), for GetMessagesTaken() on other threads
+static std::atomic<UINT64> g_messagesSent;
 
-//
-// sSharedMMapPeek_R2
-//
-// Memory reading interface, an obsolete way of requesting RAM address values.
-// This is unnecessary now for reading RAM as the RAM is completely mapped at the end of the SHM
-// However we can use this interface to request processor registers!
-struct sSharedMMapPeek_R2
-{
-	enum { PEEK_SPECIAL_PC_H = UINT_MAX - 1 };	// Set this address to request program counter high byte
-	enum { PEEK_SPECIAL_PC_L = UINT_MAX - 2 };	// Set this address to request program counter low byte
-	enum { PEEK_LIMIT = 16 * 1024 };
-
-	UINT addr_count;
-	UINT addr[PEEK_LIMIT];
-	UINT8 data[PEEK_LIMIT];
-};
-
-//
-// sSharedMMapBuffer_R1
-//
-// General buffer (64Kb)
-//
-struct sSharedMMapBuffer_R1
-{
-	enum { BUFFER_SIZE = (64 * 1024) };
-
-	UINT16 payload;
-	UINT8 data[BUFFER_SIZE];
-};
+// Input is sent every UI frame: rather than stall it, wait for the next one
+constexpr UINT INPUT_LOCK_TIMEOUT_MS = 2;
 
-//
-// sSharedMMapAudio_R1
-//
-// Audio control interface.
-//
-struct sSharedMMapAudio_R1
+// Peek table: slots 0 and 1 are always the PC, peek sets get contiguous runs of the others
+constexpr UINT PEEK_RESERVED_SLOTS = 2;
+struct sPeekSet
 {
-	UINT8 master_vol_l;
-	UINT8 master_vol_r;
-};
-
-//
-// sSharedMemoryMap_R4
-//
-// Memory Map (top-level object)
-//
-
-constexpr int FLAG_WANT_KEYB = 1 << 0;
-constexpr int FLAG_WANT_MOUSE = 1 << 1;
-constexpr int FLAG_NO_FRAME = 1 << 2;
-constexpr int FLAG_PAUSED = 1 << 3;
-constexpr int SYSTEM_MAXLEN = 64;
-constexpr int PROGRAM_MAXLEN = 260;
-
-struct sSharedMemoryMap_R4
-{
-	UINT8 version; // = PROTOCOL_VER
-	UINT8 flags;
-	char system[SYSTEM_MAXLEN] = {}; // System name.
-	char program[PROGRAM_MAXLEN] = {}; // Program name. Zero terminated.
-	UINT program_hash[4] = { 0,0,0,0 }; // Program code hash (256-bits)
-
-	sSharedMMapFrame_R1 frame;
-	sSharedMMapInput_R2 input;
-	sSharedMMapPeek_R2 peek;
-	sSharedMMapBuffer_R1 buf_tohost;
-	sSharedMMapBuffer_R1 buf_recv; // a message to us.
-	sSharedMMapAudio_R1 audio;
-
-	// added for protocol v4
-	UINT ram_size;
-
-	// added a simpler, other input channel that isn't clobbered by gridcarto
-	sSharedMMapInput_R2 input_other;
+	int id;
+	UINT first;		// slot
+	UINT count;
+	UINT16 seq;		// frame.seq when registered
 };
-
-#pragma pack( pop )
+static std::vector<sPeekSet> g_peekSets;	// sorted by first slot
+static int g_nextPeekSetId = 1;
 
 //------------------------------------------------------------------------------
-// Local Data
+// Local methods
 //------------------------------------------------------------------------------
 
-static HANDLE g_mutex_handle;
-static HANDLE g_mmap_handle;
+static void SleepMs(UINT ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
 
-static bool g_TrackOnly;
+// Spins, then blocks until isReady() says the host made room for us.
+// Returns false if it still hasn't after the policy's timeout.
+template <typename F>
+static bool WaitForHost(F isReady)
+{
+	for (UINT i = 0; i < g_waitPolicy.spin_count; ++i)
+	{
+		if (isReady())
+			return true;
+		CPU_RELAX();
+	}
 
-static sSharedMemoryMap_R4* g_p_shared_memory;
+	const auto tStart = std::chrono::steady_clock::now();
+	const auto timeout = std::chrono::milliseconds(g_waitPolicy.timeout_ms);
+	while (!isReady())
+	{
+		if (std::chrono::steady_clock::now() - tStart >= timeout)
+			return false;
+		// The event wakes us the moment the host drains. Without it we can only poll.
+		if (g_transport->HasDrainedEvent())
+			g_transport->WaitDrainedEvent(g_waitPolicy.block_slice_ms);
+		else
+			SleepMs(g_waitPolicy.block_slice_ms);
+	}
+	return true;
+}
 
-constexpr int MEMORY_MAP_CORE_SIZE = sizeof(sSharedMemoryMap_R4);
-static UINT8* ramPointer;
+static bool WaitForHostDrain()
+{
+	volatile UINT16* payload = &g_p_shared_memory->buf_tohost.payload;
+	return WaitForHost([payload]() { return *payload == 0; });
+}
 
-//------------------------------------------------------------------------------
-// Mutex methods
-//------------------------------------------------------------------------------
+// Returns the host's command ring if it advertises a valid one, and tells the host we're using it
+static sSharedMMapCmdRing_R5* AttachCmdRing()
+{
+	if ((g_p_shared_memory->flags & FLAG_CMD_RING) == 0)
+		return nullptr;
+	const size_t offset = GetCmdRingOffset(g_p_shared_memory->ram_size);
+	const size_t mapSize = g_transport->GetMapSize();
+	if (mapSize < offset + sizeof(sSharedMMapCmdRing_R5))
+		return nullptr;
+	auto ring = reinterpret_cast<sSharedMMapCmdRing_R5*>(g_transport->GetMapPointer() + offset);
+	UINT32 count = ring->slot_count;
+	if (ring->version != CMD_RING_VERSION || count == 0 || (count & (count - 1)) != 0
+		|| mapSize < offset + GetCmdRingSize(count))
+	{
+		g_transport->DebugOutput("WARNING: Host advertises a command ring we can't use, falling back to buf_tohost\n");
+		return nullptr;
+	}
+	ring->client_version = CMD_RING_VERSION;
+	return ring;
+}
 
-bool GetMutex()
+// Largest message BeginMessage() can hold
+static UINT32 MessageCapacity()
 {
-	g_mutex_handle = OpenMutexA(SYNCHRONIZE, FALSE, GAMELINK_MUTEX_NAME);
-	if (g_mutex_handle == 0)
-		return false;
-	return true;
+	if (g_p_cmd_ring)
+		return sizeof(sSharedMMapRingSlot_R5::data);
+	return UINT16_MAX;	// buf_tohost.payload is a UINT16
+}
+
+// Reserves the buffer for the next message to the host.
+// With the command ring it's the next free slot, otherwise it's buf_tohost with the mutex held.
+// Returns nullptr if the host didn't make room in time. Every non-null return needs an EndMessage().
+static UINT8* BeginMessage()
+{
+	if (g_p_cmd_ring)
+	{
+		sSharedMMapCmdRing_R5* ring = g_p_cmd_ring;
+		const UINT32 head = ring->head.load(std::memory_order_relaxed);
+		if (!WaitForHost([ring, head]() { return (head - ring->tail.load(std::memory_order_acquire)) < ring->slot_count; }))
+			return nullptr;
+		return ring->Slot(head).data;
+	}
+
+	if (!WaitForHostDrain())
+		return nullptr;
+	switch (g_transport->Lock(3000))
+	{
+	case LockResult::ACQUIRED:
+		return g_p_shared_memory->buf_tohost.data;
+	case LockResult::ABANDONED:
+		g_transport->Unlock();
+		[[fallthrough]];
+	case LockResult::TIMEOUT:
+		[[fallthrough]];
+	case LockResult::FAILED:
+		[[fallthrough]];
+	default:
+		return nullptr;
+	}
 }
 
-void CloseMutex()
+// Hands the message written since BeginMessage() to the host
+static void EndMessage(UINT32 length)
 {
-	if (g_mutex_handle != 0)
+	++g_stats.messages;
+	g_stats.message_bytes += length;
+	if (g_p_cmd_ring)
 	{
-		CloseHandle(g_mutex_handle);
-		g_mutex_handle = NULL;
+		const UINT32 head = g_p_cmd_ring->head.load(std::memory_order_relaxed);
+		g_p_cmd_ring->Slot(head).payload = length;
+		g_p_cmd_ring->head.store(head + 1, std::memory_order_release);
+		g_messagesSent.fetch_add(1, std::memory_order_release);
+		return;
 	}
+	g_p_shared_memory->buf_tohost.payload = (UINT16)length;
+	g_transport->Unlock();
+	g_messagesSent.fetch_add(1, std::memory_order_release);
 }
 
 //------------------------------------------------------------------------------
@@ -184,15 +201,13 @@ int GameLink::Init()
 	if (g_p_shared_memory)
 		return 1;
 
-	g_mmap_handle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, GAMELINK_MMAP_NAME);
-	if (g_mmap_handle)
+	if (g_transport == nullptr)
+		g_transport = CreateTransport();
+
+	g_messagesSent = 0;
+	if (g_transport->OpenMap())
 	{
-//		UINT8 *shm = reinterpret_cast<UINT8*>(
-//			MapViewOfFile(g_mmap_handle, FILE_MAP_ALL_ACCESS, 0, 0, 0)
-//			);
-		g_p_shared_memory = reinterpret_cast<sSharedMemoryMap_R4*>(
-			MapViewOfFile(g_mmap_handle, FILE_MAP_ALL_ACCESS, 0, 0, 0)
-			);
+		g_p_shared_memory = reinterpret_cast<sSharedMemoryMap_R4*>(g_transport->GetMapPointer());
 
 		if (g_p_shared_memory)
 		{
@@ -202,17 +217,21 @@ int GameLink::Init()
 			g_p_shared_memory->peek.addr[1] = (UINT)sSharedMMapPeek_R2::PEEK_SPECIAL_PC_L;
 			// The ram is right after the end of the shared memory pointer here
 			ramPointer = reinterpret_cast<UINT8*>(g_p_shared_memory + 1);
-			if (GetMutex()) {
+			if (g_transport->OpenMutex()) {
+				// Optional, hosts that don't have it get polled
+				g_transport->OpenDrainedEvent();
+				// Protocol extension, older hosts only have buf_tohost
+				g_p_cmd_ring = AttachCmdRing();
 				// All is good, tell the emulator to go native video, we'll take care of the flipping in hardware!
 				SendCommand(std::string(":videonative"));
 				return 1;
 			}
-			OutputDebugStringW(L"WARNING: Found shared memory but couldn't get mutex!\n");
+			g_transport->DebugOutput("WARNING: Found shared memory but couldn't get mutex!\n");
 		}
 		// tidy up file mapping.
-		CloseHandle(g_mmap_handle);
-		g_mmap_handle = NULL;
+		g_transport->Close();
 		g_p_shared_memory = NULL;
+		ramPointer = NULL;
 	}
 	// Failure
 	return 0;
@@ -220,8 +239,14 @@ int GameLink::Init()
 
 void GameLink::Destroy()
 {
-	CloseMutex();
+	if (g_p_cmd_ring)
+		g_p_cmd_ring->client_version = 0;
+	g_p_cmd_ring = NULL;
+	g_peekSets.clear();
+	if (g_transport)
+		g_transport->Close();
 	g_p_shared_memory = NULL;
+	ramPointer = NULL;
 }
 
 std::string GameLink::GetEmulatedProgramName()
@@ -253,6 +278,128 @@ UINT8 GameLink::GetPeekAt(UINT position)
 	return 0;
 }
 
+bool GameLink::GetProgramCounter(UINT16* pc)
+{
+	if (!g_p_shared_memory)
+		return false;
+	// The host writes the two bytes one after the other: read again if the high byte moved meanwhile
+	volatile UINT8* data = g_p_shared_memory->peek.data;
+	UINT8 high = data[0];
+	UINT8 low = data[1];
+	for (int i = 0; i < 4 && data[0] != high; ++i)
+	{
+		high = data[0];
+		low = data[1];
+	}
+	*pc = (UINT16)((high << 8) | low);
+	return true;
+}
+
+// Writes the peek table with the mutex held. Returns false if the mutex couldn't be had.
+template <typename F>
+static bool WritePeekTable(F write)
+{
+	switch (g_transport->Lock(3000))
+	{
+	case LockResult::ACQUIRED:
+		write(g_p_shared_memory->peek);
+		g_transport->Unlock();
+		return true;
+	case LockResult::ABANDONED:
+		g_transport->Unlock();
+		[[fallthrough]];
+	case LockResult::TIMEOUT:
+		[[fallthrough]];
+	case LockResult::FAILED:
+		[[fallthrough]];
+	default:
+		break;
+	}
+	return false;
+}
+
+static const sPeekSet* FindPeekSet(int id)
+{
+	for (auto const& set : g_peekSets)
+	{
+		if (set.id == id)
+			return &set;
+	}
+	return nullptr;
+}
+
+int GameLink::RegisterPeekSet(std::span<const UINT> addresses)
+{
+	if (!g_p_shared_memory || addresses.empty())
+		return -1;
+
+	// First fit between the sets already there
+	const UINT count = (UINT)addresses.size();
+	UINT first = PEEK_RESERVED_SLOTS;
+	auto it = g_peekSets.begin();
+	for (; it != g_peekSets.end(); ++it)
+	{
+		if (it->first - first >= count)
+			break;
+		first = it->first + it->count;
+	}
+	if (first + count > sSharedMMapPeek_R2::PEEK_LIMIT)
+		return -1;
+
+	bool written = WritePeekTable([&](sSharedMMapPeek_R2& peek) {
+		std::copy(addresses.begin(), addresses.end(), peek.addr + first);
+		peek.addr_count = std::max(peek.addr_count, first + count);
+	});
+	if (!written)
+		return -1;
+	sPeekSet set = { g_nextPeekSetId++, first, count, GetFrameSequence() };
+	g_peekSets.insert(it, set);
+	return set.id;
+}
+
+bool GameLink::UnregisterPeekSet(int id)
+{
+	const sPeekSet* p_set = FindPeekSet(id);
+	if (!p_set || !g_p_shared_memory)
+		return false;
+	const sPeekSet set = *p_set;
+	// Shrink the table to the last set left. A hole in the middle peeks $0000 until it's reused.
+	UINT end = PEEK_RESERVED_SLOTS;
+	for (auto const& other : g_peekSets)
+	{
+		if (other.id != id)
+			end = std::max(end, other.first + other.count);
+	}
+	bool written = WritePeekTable([&](sSharedMMapPeek_R2& peek) {
+		std::fill(peek.addr + set.first, peek.addr + set.first + set.count, 0);
+		peek.addr_count = end;
+	});
+	if (!written)
+		return false;	// the host still peeks those slots, keep them
+	g_peekSets.erase(g_peekSets.begin() + (p_set - g_peekSets.data()));
+	return true;
+}
+
+bool GameLink::ReadPeekSet(int id, std::span<UINT8> values)
+{
+	const sPeekSet* set = FindPeekSet(id);
+	if (!set || !g_p_shared_memory || values.size() < set->count)
+		return false;
+	memcpy(values.data(), (const void*)(g_p_shared_memory->peek.data + set->first), set->count);
+	return true;
+}
+
+bool GameLink::IsPeekSetReady(int id)
+{
+	const sPeekSet* set = FindPeekSet(id);
+	return set && g_p_shared_memory && GetFrameSequence() != set->seq;
+}
+
+UINT GameLink::GetPeekSlotsUsed()
+{
+	return g_p_shared_memory ? g_p_shared_memory->peek.addr_count : 0;
+}
+
 bool GameLink::IsActive()
 {
 	return (g_p_shared_memory != NULL);
@@ -264,37 +411,81 @@ bool GameLink::IsTrackingOnly()
 	return (flags & FLAG_NO_FRAME);
 }
 
-void GameLink::SendCommand(std::string command)
+bool GameLink::IsMouseWanted()
 {
-	int wait_counter = 0;
-	while (g_p_shared_memory->buf_tohost.payload != 0) {
-		Sleep(10);
-		++wait_counter;
-		if (wait_counter == 300) {
-			return;
-		}
-	}
-	DWORD dwWaitResult = WaitForSingleObject(g_mutex_handle, 3000);
-	switch (dwWaitResult)
-	{
-	case WAIT_OBJECT_0:
+	return (g_p_shared_memory && (g_p_shared_memory->flags & FLAG_WANT_MOUSE));
+}
+
+bool GameLink::IsDrainEventDriven()
+{
+	return (g_transport && g_transport->HasDrainedEvent());
+}
+
+UINT GameLink::GetCommandRingSlots()
+{
+	return g_p_cmd_ring ? g_p_cmd_ring->slot_count : 0;
+}
+
+UINT64 GameLink::GetMessagesSent()
+{
+	return g_messagesSent.load(std::memory_order_acquire);
+}
+
+UINT64 GameLink::GetMessagesTaken()
+{
+	// Read what was sent before what's pending, so a message sent meanwhile can only make
+	// the count lower, never count a message as taken before it is
+	const UINT64 sent = g_messagesSent.load(std::memory_order_acquire);
+	if (!g_p_shared_memory)
+		return sent;
+	UINT32 pending;
+	if (g_p_cmd_ring)
 	{
-		UINT16 sz = (UINT16)command.size() + 1;
-		g_p_shared_memory->buf_tohost.payload = sz;
-		snprintf((char*)g_p_shared_memory->buf_tohost.data, sz, "%s", command.c_str());
-		ReleaseMutex(g_mutex_handle);
-		break;
+		const UINT32 tail = g_p_cmd_ring->tail.load(std::memory_order_acquire);
+		pending = g_p_cmd_ring->head.load(std::memory_order_acquire) - tail;
 	}
-	case WAIT_ABANDONED:
-		ReleaseMutex(g_mutex_handle);
-		[[fallthrough]];
-	case WAIT_TIMEOUT:
-		[[fallthrough]];
-	case WAIT_FAILED:
-		[[fallthrough]];
-	default:
-		break;
+	else
+	{
+		// buf_tohost holds one message at a time
+		volatile UINT16* payload = &g_p_shared_memory->buf_tohost.payload;
+		pending = (*payload != 0) ? 1 : 0;
 	}
+	return sent - std::min<UINT64>(pending, sent);
+}
+
+sStats GameLink::GetStats()
+{
+	sStats stats = g_stats;
+	stats.frame_reads = g_threadCounters.frame_reads;
+	stats.frame_retries = g_threadCounters.frame_retries;
+	stats.frame_lock_fallbacks = g_threadCounters.frame_lock_fallbacks;
+	stats.input_updates = g_threadCounters.input_updates;
+	stats.keyb_words = g_threadCounters.keyb_words;
+	stats.mouse_updates = g_threadCounters.mouse_updates;
+	return stats;
+}
+
+void GameLink::SetWaitPolicy(const sWaitPolicy& policy)
+{
+	g_waitPolicy = policy;
+	g_frameSpinCount.store(policy.spin_count, std::memory_order_relaxed);
+}
+
+sWaitPolicy GameLink::GetWaitPolicy()
+{
+	return g_waitPolicy;
+}
+
+void GameLink::SendCommand(std::string command)
+{
+	UINT32 sz = (UINT32)command.size() + 1;
+	if (sz > MessageCapacity())
+		return;
+	UINT8* ptrdata = BeginMessage();
+	if (ptrdata == nullptr)
+		return;
+	snprintf((char*)ptrdata, sz, "%s", command.c_str());
+	EndMessage(sz);
 }
 
 void GameLink::Pause()
@@ -327,93 +518,82 @@ void GameLink::SDHR_reset()
 	SendCommand(std::string(":sdhr_reset"));
 }
 
-//void GameLink::SDHR_write(uint8_t* buf, UINT16 buflength)
-//{
-//	const std::string gamelinkCmd = ":sdhr_write";
-//	UINT16 sz = buflength + gamelinkCmd.length() + 1 + 3;	// 3 is for the final SDHR_CMD_READY command
-//	if (sz < buflength)	// overflow
-//	{
-//		OutputDebugStringW(L"ERROR: Write buffer is too large, can't prepend the Gamelink command tag!\n");
-//		return;
-//	}
-//
-//	DWORD dwWaitResult = WaitForSingleObject(g_mutex_handle, 3000);
-//	switch (dwWaitResult)
-//	{
-//	case WAIT_OBJECT_0:
-//	{
-//		auto ptrdata = (char*)g_p_shared_memory->buf_tohost.data;
-//		memcpy(ptrdata, gamelinkCmd.c_str(), gamelinkCmd.length());
-//		ptrdata += gamelinkCmd.length();
-//		memcpy(ptrdata, buf, buflength);
-//		ptrdata += buflength;
-//		// final SDHR_CMD_READY command -- size 0x0000, followed by the ID
-//		ptrdata[0] = 0;
-//		ptrdata[1] = 0;
-//		ptrdata[2] = (uint8_t)SDHR_CMD::READY;
-//		g_p_shared_memory->buf_tohost.payload = sz;
-//		bReadyToProcess = true;
-//		ReleaseMutex(g_mutex_handle);
-//		break;
-//	}
-//	case WAIT_ABANDONED:
-//		ReleaseMutex(g_mutex_handle);
-//		[[fallthrough]];
-//	case WAIT_TIMEOUT:
-//		[[fallthrough]];
-//	case WAIT_FAILED:
-//		[[fallthrough]];
-//	default:
-//		break;
-//	}
-//}
-
-void GameLink::SDHR_write(const std::vector<uint8_t>& v_data)
-{
-	int wait_counter = 0;
-	while (g_p_shared_memory->buf_tohost.payload != 0) {
-		Sleep(10);
-		++wait_counter;
-		if (wait_counter == 300) {
-			return;
-		}
-	}
-	const std::string gamelinkCmd = ":sdhr_write";
-	UINT16 sz = v_data.size() + gamelinkCmd.length() + 1 + 3;	// 3 is for the final SDHR_CMD_READY command
-	if (sz < v_data.size())	// overflow
+// State of the zero-copy batch between SDHR_begin_batch() and SDHR_end_batch()
+static UINT8* g_p_batch;		// start of the message, the tag is there
+static UINT32 g_batchTagLength;
+static bool g_batchIsLast;
+static bool g_batchPublish;
+
+UINT8* GameLink::SDHR_begin_batch(bool isLast, UINT32* capacity)
+{
+	if (g_p_batch != nullptr)
 	{
-		OutputDebugStringW(L"ERROR: Write vector buffer is too large, can't prepend the Gamelink command tag!\n");
-		return;
+		g_transport->DebugOutput("ERROR: SDHR_begin_batch() called twice without SDHR_end_batch()!\n");
+		return nullptr;
 	}
+	const bool publish = isLast && (g_p_shared_memory->flags & FLAG_SDHR_PUBLISH);
+	const std::string gamelinkCmd = publish ? ":sdhr_publish" : ":sdhr_write";
+	UINT8* ptrdata = BeginMessage();
+	if (ptrdata == nullptr)
+		return nullptr;
+	memcpy(ptrdata, gamelinkCmd.c_str(), gamelinkCmd.length());
+	g_p_batch = ptrdata;
+	g_batchTagLength = (UINT32)gamelinkCmd.length();
+	g_batchIsLast = isLast;
+	g_batchPublish = publish;
+	// Leave room for the tag's null and the READY command
+	*capacity = MessageCapacity() - g_batchTagLength - 1 - (isLast ? 3 : 0);
+	return ptrdata + g_batchTagLength;
+}
 
-	DWORD dwWaitResult = WaitForSingleObject(g_mutex_handle, 3000);
-	switch (dwWaitResult)
-	{
-	case WAIT_OBJECT_0:
+void GameLink::SDHR_end_batch(UINT32 length)
+{
+	if (g_p_batch == nullptr)
+		return;
+	UINT32 sz = length + g_batchTagLength + 1;
+	if (g_batchIsLast)
 	{
-		auto ptrdata = (char*)g_p_shared_memory->buf_tohost.data;
-		memcpy(ptrdata, gamelinkCmd.c_str(), gamelinkCmd.length());
-		ptrdata += gamelinkCmd.length();
-		std::copy(v_data.begin(), v_data.end(), ptrdata);
-		ptrdata += v_data.size();
 		// final SDHR_CMD_READY command -- size 0x0000, followed by the ID
+		UINT8* ptrdata = g_p_batch + g_batchTagLength + length;
 		ptrdata[0] = 0;
 		ptrdata[1] = 0;
 		ptrdata[2] = (uint8_t)SDHR_CMD::READY;
-		g_p_shared_memory->buf_tohost.payload = sz;
-		ReleaseMutex(g_mutex_handle);
-		break;
+		sz += 3;
 	}
-	case WAIT_ABANDONED:
-		ReleaseMutex(g_mutex_handle);
-		[[fallthrough]];
-	case WAIT_TIMEOUT:
-		[[fallthrough]];
-	case WAIT_FAILED:
-		[[fallthrough]];
-	default:
-		break;
+	g_p_batch = nullptr;
+	EndMessage(sz);
+
+	if (!g_batchIsLast)
+	{
+		++g_stats.sdhr_fragments;
+		return;
 	}
+	++g_stats.sdhr_publishes;
+	if (g_batchPublish)
+		++g_stats.handshakes_saved;
+	else
+		SendCommand(std::string(":sdhr_process"));
+}
+
+UINT32 GameLink::GetSDHRBatchCapacity()
+{
+	// Leave room for the longest tag, its null and the READY command
+	return MessageCapacity() - (UINT32)(sizeof(":sdhr_publish") + 3);
+}
+
+// SDHRCommandBatcher's way to AppleWin
+class GameLinkBatchSink : public SDHRBatchSink
+{
+public:
+	UINT32 GetBatchCapacity() override { return GameLink::GetSDHRBatchCapacity(); }
+	uint8_t* BeginBatch(bool isLast, UINT32* capacity) override { return GameLink::SDHR_begin_batch(isLast, capacity); }
+	void EndBatch(UINT32 length) override { GameLink::SDHR_end_batch(length); }
+};
+static GameLinkBatchSink g_batchSink;
+
+SDHRBatchSink* GameLink::GetSDHRBatchSink()
+{
+	return &g_batchSink;
 }
 
 void GameLink::SetSoundVolume(UINT8 main, UINT8 mockingboard)
@@ -426,20 +606,19 @@ void GameLink::SetSoundVolume(UINT8 main, UINT8 mockingboard)
 		mockingboard = 0;
 	if (mockingboard > 100)
 		mockingboard = 100;
-	DWORD dwWaitResult = WaitForSingleObject(g_mutex_handle, 3000);
-	switch (dwWaitResult)
+	switch (g_transport->Lock(3000))
 	{
-	case WAIT_OBJECT_0:
+	case LockResult::ACQUIRED:
 		g_p_shared_memory->audio.master_vol_l = main;
 		g_p_shared_memory->audio.master_vol_r = mockingboard;
-		ReleaseMutex(g_mutex_handle);
+		g_transport->Unlock();
 		break;
-	case WAIT_ABANDONED:
-		ReleaseMutex(g_mutex_handle);
+	case LockResult::ABANDONED:
+		g_transport->Unlock();
 		[[fallthrough]];
-	case WAIT_TIMEOUT:
+	case LockResult::TIMEOUT:
 		[[fallthrough]];
-	case WAIT_FAILED:
+	case LockResult::FAILED:
 		[[fallthrough]];
 	default:
 		break;
@@ -449,20 +628,19 @@ void GameLink::SetSoundVolume(UINT8 main, UINT8 mockingboard)
 
 int GameLink::GetSoundVolumeMain()
 {
-	DWORD dwWaitResult = WaitForSingleObject(g_mutex_handle, 3000);
 	int ret = 0;
-	switch (dwWaitResult)
+	switch (g_transport->Lock(3000))
 	{
-	case WAIT_OBJECT_0:
+	case LockResult::ACQUIRED:
 		ret = g_p_shared_memory->audio.master_vol_l;
-		ReleaseMutex(g_mutex_handle);
+		g_transport->Unlock();
 		break;
-	case WAIT_ABANDONED:
-		ReleaseMutex(g_mutex_handle);
+	case LockResult::ABANDONED:
+		g_transport->Unlock();
 		[[fallthrough]];
-	case WAIT_TIMEOUT:
+	case LockResult::TIMEOUT:
 		[[fallthrough]];
-	case WAIT_FAILED:
+	case LockResult::FAILED:
 		[[fallthrough]];
 	default:
 		break;
@@ -472,20 +650,19 @@ int GameLink::GetSoundVolumeMain()
 
 int GameLink::GetSoundVolumeMockingboard()
 {
-	DWORD dwWaitResult = WaitForSingleObject(g_mutex_handle, 3000);
 	int ret = 0;
-	switch (dwWaitResult)
+	switch (g_transport->Lock(3000))
 	{
-	case WAIT_OBJECT_0:
+	case LockResult::ACQUIRED:
 		ret = g_p_shared_memory->audio.master_vol_r;
-		ReleaseMutex(g_mutex_handle);
+		g_transport->Unlock();
 		break;
-	case WAIT_ABANDONED:
-		ReleaseMutex(g_mutex_handle);
+	case LockResult::ABANDONED:
+		g_transport->Unlock();
 		[[fallthrough]];
-	case WAIT_TIMEOUT:
+	case LockResult::TIMEOUT:
 		[[fallthrough]];
-	case WAIT_FAILED:
+	case LockResult::FAILED:
 		[[fallthrough]];
 	default:
 		break;
@@ -495,10 +672,9 @@ int GameLink::GetSoundVolumeMockingboard()
 
 void GameLink::SendKeystroke(UINT scancode, bool isPressed)
 {
-	DWORD dwWaitResult = WaitForSingleObject(g_mutex_handle, 3000);
-	switch (dwWaitResult)
+	switch (g_transport->Lock(3000))
 	{
-	case WAIT_OBJECT_0:
+	case LockResult::ACQUIRED:
 	{
 		UINT scanbyte = (scancode / 32);
 		UINT scanbit = (1 << (scancode % 32));
@@ -507,63 +683,220 @@ void GameLink::SendKeystroke(UINT scancode, bool isPressed)
 			g_p_shared_memory->input_other.keyb_state[scanbyte] |= scanbit;
 		else
 			g_p_shared_memory->input_other.keyb_state[scanbyte] &= (~scanbit);
-		ReleaseMutex(g_mutex_handle);
+		g_transport->Unlock();
 		break;
 	}
-	case WAIT_ABANDONED:
-		ReleaseMutex(g_mutex_handle);
+	case LockResult::ABANDONED:
+		g_transport->Unlock();
 		[[fallthrough]];
-	case WAIT_TIMEOUT:
+	case LockResult::TIMEOUT:
 		[[fallthrough]];
-	case WAIT_FAILED:
+	case LockResult::FAILED:
 		[[fallthrough]];
 	default:
 		break;
 	}
 }
 
-sFramebufferInfo GameLink::GetFrameBufferInfo()
+bool GameLink::SendInput(const sInputState& state, UINT8 changed_words, bool sendMouse)
 {
-	sFramebufferInfo fbI = sFramebufferInfo();
-	DWORD dwWaitResult = WaitForSingleObject(g_mutex_handle, 1000);
-	switch (dwWaitResult)
+	if (!g_p_shared_memory)
+		return false;
+	bool sent = false;
+	switch (g_transport->Lock(INPUT_LOCK_TIMEOUT_MS))
 	{
-	case WAIT_ABANDONED:
-		OutputDebugStringW(L"Abandoned\n");
-		ReleaseMutex(g_mutex_handle);
-		break;
-	case WAIT_FAILED:
-		OutputDebugStringW(L"Failed\n");
+	case LockResult::ACQUIRED:
+	{
+		sSharedMMapInput_R2& input = g_p_shared_memory->input_other;
+		input.ready = sSharedMMapInput_R2::READY_OTHER;
+		for (UINT i = 0; i < 8; ++i)
+		{
+			if (changed_words & (1 << i))
+			{
+				input.keyb_state[i] = state.keyb_state[i];
+				++g_threadCounters.keyb_words;
+			}
+		}
+		if (sendMouse)
+		{
+			// The host zeroes the motion once it has used it
+			input.mouse_dx += state.mouse_dx;
+			input.mouse_dy += state.mouse_dy;
+			input.mouse_btn = state.mouse_btn;
+			++g_threadCounters.mouse_updates;
+		}
+		g_transport->Unlock();
+		++g_threadCounters.input_updates;
+		sent = true;
 		break;
-	case WAIT_TIMEOUT:
-		OutputDebugStringW(L"Timeout in getting mutex for frame buffer info. Still grabbing the read-only data anyway\n");
+	}
+	case LockResult::ABANDONED:
+		g_transport->Unlock();
+		[[fallthrough]];
+	case LockResult::TIMEOUT:
+		[[fallthrough]];
+	case LockResult::FAILED:
 		[[fallthrough]];
 	default:
-		sSharedMMapFrame_R1* f = &g_p_shared_memory->frame;
-		fbI.frameBuffer = f->buffer;
-		fbI.width = f->width;
-		fbI.height = f->height;
-		fbI.imageFormat = f->image_fmt;
-		if (fbI.imageFormat == 0)
+		break;
+	}
+	return sent;
+}
+
+// Fills everything but frameBuffer and seq from the frame header.
+// Returns false if the header makes no sense, which happens when it's read while the host writes it.
+static bool ReadFrameHeader(const sSharedMMapFrame_R1* f, sFramebufferInfo& fbI)
+{
+	fbI.width = f->width;
+	fbI.height = f->height;
+	fbI.imageFormat = f->image_fmt;
+	if (fbI.imageFormat == 0)
+	{
+		fbI.bufferLength = 0;
+	}
+	else
+	{
+		fbI.bufferLength = fbI.width * fbI.height * sizeof(UINT32);
+	}
+	fbI.parX = f->par_x;
+	fbI.parY = f->par_y;
+	fbI.wantsMouse = (g_p_shared_memory->flags & FLAG_WANT_MOUSE);
+	return (fbI.bufferLength <= sSharedMMapFrame_R1::MAX_PAYLOAD);
+}
+
+// Reads frame.seq, waiting out a write in progress when the host flags it.
+// Returns false if the host is still writing after the spin.
+static bool ReadFrameSequenceBegin(UINT16* seq)
+{
+	volatile UINT16* p_seq = &g_p_shared_memory->frame.seq;
+	const bool seqlock = (g_p_shared_memory->flags & FLAG_FRAME_SEQLOCK);
+	const UINT spinCount = g_frameSpinCount.load(std::memory_order_relaxed);
+	for (UINT i = 0; i <= spinCount; ++i)
+	{
+		*seq = *p_seq;
+		if (!seqlock || (*seq & 1) == 0)
 		{
-			fbI.bufferLength = 0;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return true;
 		}
-		else
+		CPU_RELAX();
+	}
+	return false;
+}
+
+// True if no frame was written since ReadFrameSequenceBegin() returned seq
+static bool ReadFrameSequenceEnd(UINT16 seq)
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return (*(volatile UINT16*)&g_p_shared_memory->frame.seq == seq);
+}
+
+sFramebufferInfo GameLink::GetFrameBufferInfo()
+{
+	// Lock-free: a header torn by a concurrent frame is simply read again
+	sFramebufferInfo fbI = sFramebufferInfo();
+	sSharedMMapFrame_R1* f = &g_p_shared_memory->frame;
+	for (UINT attempt = 0; attempt < FRAME_READ_ATTEMPTS; ++attempt)
+	{
+		UINT16 seq;
+		if (!ReadFrameSequenceBegin(&seq))
+			continue;
+		bool valid = ReadFrameHeader(f, fbI);
+		if (ReadFrameSequenceEnd(seq) && valid)
 		{
-			fbI.bufferLength = fbI.width * fbI.height * sizeof(UINT32);
+			fbI.seq = seq;
+			break;
 		}
-		fbI.parX = f->par_x;
-		fbI.parY = f->par_y;
-		fbI.wantsMouse = (g_p_shared_memory->flags & FLAG_WANT_MOUSE);
-		ReleaseMutex(g_mutex_handle);
-		break;
+		fbI = sFramebufferInfo();
 	}
+	fbI.frameBuffer = f->buffer;
 	return fbI;
 }
 
+bool GameLink::CopyFrameBuffer(sFramebufferInfo* info, UINT8* buffer, UINT32 bufferSize)
+{
+	if (g_p_shared_memory == nullptr)
+		return false;
+	sSharedMMapFrame_R1* f = &g_p_shared_memory->frame;
+	sFramebufferInfo fbI = sFramebufferInfo();
+
+	// Seqlock read: copy, then make sure the host didn't write a frame meanwhile.
+	// Hosts without FLAG_FRAME_SEQLOCK only bump seq once the frame is done, so a frame
+	// still being written when the copy ends can't be detected. It'll be a single torn frame at worst.
+	for (UINT attempt = 0; attempt < FRAME_READ_ATTEMPTS; ++attempt)
+	{
+		UINT16 seq;
+		if (!ReadFrameSequenceBegin(&seq))
+			continue;
+		if (ReadFrameHeader(f, fbI) && fbI.bufferLength <= bufferSize)
+		{
+			memcpy(buffer, f->buffer, fbI.bufferLength);
+			if (ReadFrameSequenceEnd(seq))
+			{
+				fbI.frameBuffer = buffer;
+				fbI.seq = seq;
+				*info = fbI;
+				++g_threadCounters.frame_reads;
+				return true;
+			}
+		}
+		else if (ReadFrameSequenceEnd(seq))
+		{
+			// Consistent header, but the caller's buffer is too small
+			g_transport->DebugOutput("ERROR: Frame buffer too small for the frame!\n");
+			return false;
+		}
+		++g_threadCounters.frame_retries;
+	}
+
+	// The host keeps writing frames faster than we can copy them
+	bool ret = false;
+	LockResult lockResult = g_transport->Lock(1000);
+	switch (lockResult)
+	{
+	case LockResult::ACQUIRED:
+		if (ReadFrameHeader(f, fbI) && fbI.bufferLength <= bufferSize)
+		{
+			memcpy(buffer, f->buffer, fbI.bufferLength);
+			fbI.frameBuffer = buffer;
+			fbI.seq = f->seq;
+			*info = fbI;
+			++g_threadCounters.frame_reads;
+			++g_threadCounters.frame_lock_fallbacks;
+			ret = true;
+		}
+		g_transport->Unlock();
+		break;
+	case LockResult::ABANDONED:
+		g_transport->DebugOutput("Abandoned\n");
+		g_transport->Unlock();
+		break;
+	case LockResult::TIMEOUT:
+		g_transport->DebugOutput("Timeout in getting mutex for frame buffer copy\n");
+		[[fallthrough]];
+	case LockResult::FAILED:
+		[[fallthrough]];
+	default:
+		break;
+	}
+	return ret;
+}
+
 UINT16 GameLink::GetFrameSequence()
 {
 	return g_p_shared_memory->frame.seq;
 }
 
+bool GameLink::IsFrameBeingWritten()
+{
+	return (g_p_shared_memory->flags & FLAG_FRAME_SEQLOCK) && (GetFrameSequence() & 1);
+}
+
+UINT16 GameLink::GetFrameDistance(UINT16 from_seq, UINT16 to_seq)
+{
+	// Seqlock hosts bump seq twice per frame
+	const UINT16 distance = to_seq - from_seq;
+	return (g_p_shared_memory->flags & FLAG_FRAME_SEQLOCK) ? distance / 2 : distance;
+}
+
 
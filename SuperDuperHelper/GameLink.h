@@ -1,5 +1,6 @@
 #pragma once
 
+#ifdef _WIN32
 #include <winsdkver.h>
 #define _WIN32_WINNT 0x0A00
 #include <sdkddkver.h>
@@ -11,9 +12,21 @@
 #define WIN32_LEAN_AND_MEAN
 #endif
 #include <Windows.h>
+#else
+#include <climits>
+#include <cstdint>
 
+// Windows integer types used throughout the GameLink protocol
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+#endif
+
+#include <span>
 #include <string>
-#include <vector>
 
 /**
  * @brief SDHR Command structures
@@ -38,6 +51,8 @@ enum class SDHR_CMD {
 	UPDATE_WINDOW_SET_UPLOAD = 16,
 };
 
+class SDHRBatchSink;	// SDHRCommand.h
+
 //------------------------------------------------------------------------------
 // Namespace Declaration
 //------------------------------------------------------------------------------
@@ -59,6 +74,53 @@ namespace GameLink
 		UINT32 bufferLength;
 		bool wantsMouse;
 		UINT8* frameBuffer;
+		UINT16 seq;		// frame.seq the frame was read at
+	};
+
+	// Largest frame, in bytes (sSharedMMapFrame_R1::MAX_PAYLOAD)
+	constexpr UINT32 FRAMEBUFFER_MAX_LENGTH = 1280 * 1024 * 4;
+
+	/**
+	 * @brief How we wait for the host to empty buf_tohost before writing to it
+	 * First poll the payload spin_count times, then block on the host's drained event
+	 * (or sleep if the host doesn't have one) for up to block_slice_ms before polling again.
+	 * Give up after timeout_ms.
+	*/
+	struct sWaitPolicy
+	{
+		UINT spin_count = 4000;
+		UINT block_slice_ms = 10;
+		UINT timeout_ms = 3000;
+	};
+
+	/**
+	 * @brief Running totals of the client -> host traffic
+	 * Sample them over time to get rates.
+	*/
+	struct sStats
+	{
+		UINT64 messages = 0;			// messages handed to the host, each is one handshake
+		UINT64 message_bytes = 0;
+		UINT64 sdhr_publishes = 0;
+		UINT64 handshakes_saved = 0;	// ":sdhr_process" messages merged into their ":sdhr_write"
+		UINT64 sdhr_fragments = 0;		// extra messages needed for batches larger than one message
+		UINT64 frame_reads = 0;			// frames copied by CopyFrameBuffer()
+		UINT64 frame_retries = 0;		// copies redone because the host wrote the frame meanwhile
+		UINT64 frame_lock_fallbacks = 0;	// frames that had to be copied with the mutex held
+		UINT64 input_updates = 0;		// input_other writes, one lock each
+		UINT64 keyb_words = 0;			// keyb_state words written by them
+		UINT64 mouse_updates = 0;		// of them, those that moved the mouse or changed its buttons
+	};
+
+	/**
+	 * @brief Input for the host's input_other, as InputAccumulator sends it
+	*/
+	struct sInputState
+	{
+		UINT keyb_state[8];
+		float mouse_dx;		// since the last update
+		float mouse_dy;
+		UINT8 mouse_btn;	// bit 0 left/button 0, bit 1 right/button 1
 	};
 
 	//--------------------------------------------------------------------------
@@ -72,8 +134,38 @@ namespace GameLink
 	extern int GetMemorySize();
 	extern UINT8* GetMemoryBasePointer();
 	extern UINT8 GetPeekAt(UINT position);
+	// Program counter of the emulated 6502, from the two peek slots Init() requests.
+	// Returns false if GameLink isn't active.
+	extern bool GetProgramCounter(UINT16* pc);
+
+	// Peek sets: addresses (RAM, or sSharedMMapPeek_R2::PEEK_SPECIAL_* for processor registers) the
+	// host copies into the peek table, which then read in one call. The slots of the table are handed
+	// out internally. Call these from one thread only.
+	// Returns the set's id, or -1 if there's no room left or the mutex can't be had.
+	extern int RegisterPeekSet(std::span<const UINT> addresses);
+	// Returns false if there's no such set, or if the mutex can't be had: the set is then still
+	// registered, try again later.
+	extern bool UnregisterPeekSet(int id);
+	// Copies the set's values into the start of values, in registration order.
+	// Returns false if there's no such set or values is too small for it.
+	extern bool ReadPeekSet(int id, std::span<UINT8> values);
+	// True once the host has refreshed the table since the set was registered (frame.seq moved)
+	extern bool IsPeekSetReady(int id);
+	extern UINT GetPeekSlotsUsed();
 	extern bool IsActive();
 	extern bool IsTrackingOnly();
+	// The host's FLAG_WANT_MOUSE, also in sFramebufferInfo::wantsMouse. May be called from any thread.
+	extern bool IsMouseWanted();
+	extern bool IsDrainEventDriven();
+	extern UINT GetCommandRingSlots();	// 0 when the host only has the single buf_tohost
+
+	extern void SetWaitPolicy(const sWaitPolicy& policy);
+	extern sWaitPolicy GetWaitPolicy();
+	extern sStats GetStats();
+	// Messages handed to the host since Init(), and how many of those it has taken out of
+	// buf_tohost or the command ring (it takes them in order). Both may be called from any thread.
+	extern UINT64 GetMessagesSent();
+	extern UINT64 GetMessagesTaken();
 
 	extern void SendCommand(std::string command);
 	extern void Pause();
@@ -82,16 +174,38 @@ namespace GameLink
 	extern void SDHR_on();
 	extern void SDHR_off();
 	extern void SDHR_reset();
-	//extern void SDHR_write(uint8_t* buf, UINT16 buflength);
-	extern void SDHR_write(const std::vector<uint8_t>& v_data);
+	extern UINT32 GetSDHRBatchCapacity();
+	// Sends one fragment of a batch: reserves the next message buffer, writes the tag, and returns where the
+	// encoded commands go and how many bytes fit there (nullptr if the host is stuck). Write them in place,
+	// then hand them over with SDHR_end_batch(). Nothing else may be sent in between.
+	// All fragments but the last are plain writes without the READY terminator, so the host sees a single
+	// batch once the last one is published. With a command ring the fragments are in flight together.
+	extern UINT8* SDHR_begin_batch(bool isLast, UINT32* capacity);
+	extern void SDHR_end_batch(UINT32 length);
+	// The above for SDHRCommandBatcher::SetSink()
+	extern SDHRBatchSink* GetSDHRBatchSink();
 
 	extern void SetSoundVolume(UINT8 main, UINT8 mockingboard);
 	extern int GetSoundVolumeMain();
 	extern int GetSoundVolumeMockingboard();
 
+	// Takes the mutex for that one key. InputAccumulator batches keys instead.
 	extern void SendKeystroke(UINT scancode, bool isPressed);
+	// Writes the keyb_state words flagged in changed_words (bit i for keyb_state[i]) and, with sendMouse,
+	// adds the mouse motion to what the host hasn't consumed yet and sets the buttons, all under one lock.
+	// Only waits briefly for the mutex: returns false if it's busy, for the caller to try again later.
+	extern bool SendInput(const sInputState& input, UINT8 changed_words, bool sendMouse);
 
+	// Header of the current frame. frameBuffer points to the shared memory, which the host may be writing.
 	extern sFramebufferInfo GetFrameBufferInfo();
-	extern inline UINT16 GetFrameSequence();
+	// Copies a consistent frame into buffer (bufferSize bytes, up to FRAMEBUFFER_MAX_LENGTH are needed)
+	// without taking the mutex, using frame.seq as a seqlock. info->frameBuffer is set to buffer.
+	// Only falls back to the mutex if the host keeps writing frames during the copy.
+	extern bool CopyFrameBuffer(sFramebufferInfo* info, UINT8* buffer, UINT32 bufferSize);
+	extern UINT16 GetFrameSequence();
+	// True while a host that sets FLAG_FRAME_SEQLOCK is writing a frame (seq is odd)
+	extern bool IsFrameBeingWritten();
+	// Frames the host wrote between two values of frame.seq
+	extern UINT16 GetFrameDistance(UINT16 from_seq, UINT16 to_seq);
 
 }; // namespace GameLink
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "GameLink.h"
+
+#include <atomic>
+
+//------------------------------------------------------------------------------
+// Protocol Definitions
+//------------------------------------------------------------------------------
+
+#define SYSTEM_NAME		"AppleWin"
+#define PROTOCOL_VER		4
+#define GAMELINK_MUTEX_NAME		"DWD_GAMELINK_MUTEX_R4"
+#define GAMELINK_MMAP_NAME		"DWD_GAMELINK_MMAP_R4"
+// Optional auto-reset event the host signals each time it empties buf_tohost.
+// Hosts that don't create it are still supported, the client then polls.
+#define GAMELINK_DRAINED_EVENT_NAME		"DWD_GAMELINK_DRAINED_R4"
+
+//------------------------------------------------------------------------------
+// Shared Memory Structure
+//------------------------------------------------------------------------------
+// The layout is fixed by AppleWin. Both the client (GameLink.cpp) and the
+// stand-in server (tools/GameLinkServer.cpp) map it through a GameLink::Transport.
+
+#pragma pack( push, 1 )
+
+	//
+	// sSharedMMapFrame_R1
+	//
+	// Server -> Client Frame. 32-bit RGBA up to MAX_WIDTH x MAX_HEIGHT
+	//
+struct sSharedMMapFrame_R1
+{
+	UINT16 seq;
+	UINT16 width;
+	UINT16 height;
+
+	UINT8 image_fmt; // 0 = no frame; 1 = 32-bit 0xAARRGGBB
+	UINT8 reserved0;
+
+	UINT16 par_x; // pixel aspect ratio
+	UINT16 par_y;
+
+	enum { MAX_WIDTH = 1280 };
+	enum { MAX_HEIGHT = 1024 };
+
+	enum { MAX_PAYLOAD = (int)MAX_WIDTH * (int)MAX_HEIGHT * 4 };
+	UINT8 buffer[MAX_PAYLOAD];
+};
+
+//
+// sSharedMMapInput_R2
+//
+// Client -> Server Input Data
+//
+
+struct sSharedMMapInput_R2
+{
+	float mouse_dx;
+	float mouse_dy;
+	UINT8 ready;
+	UINT8 mouse_btn;
+	UINT keyb_state[8];
+
+	enum { READY_NO = 0 };					// Input not ready
+	enum { READY_GC = 1 };					// Input from GC
+	enum { READY_OTHER = 17 };				// Input from other app
+};
+
+//
+// sSharedMMapPeek_R2
+//
+// Memory reading interface, an obsolete way of requesting RAM address values.
+// This is unnecessary now for reading RAM as the RAM is completely mapped at the end of the SHM
+// However we can use this interface to request processor registers!
+struct sSharedMMapPeek_R2
+{
+	enum { PEEK_SPECIAL_PC_H = UINT_MAX - 1 };	// Set this address to request program counter high byte
+	enum { PEEK_SPECIAL_PC_L = UINT_MAX - 2 };	// Set this address to request program counter low byte
+	enum { PEEK_LIMIT = 16 * 1024 };
+
+	UINT addr_count;
+	UINT addr[PEEK_LIMIT];
+	UINT8 data[PEEK_LIMIT];
+};
+
+//
+// sSharedMMapBuffer_R1
+//
+// General buffer (64Kb)
+//
+struct sSharedMMapBuffer_R1
+{
+	enum { BUFFER_SIZE = (64 * 1024) };
+
+	UINT16 payload;
+	UINT8 data[BUFFER_SIZE];
+};
+
+//
+// sSharedMMapAudio_R1
+//
+// Audio control interface.
+//
+struct sSharedMMapAudio_R1
+{
+	UINT8 master_vol_l;
+	UINT8 master_vol_r;
+};
+
+//
+// sSharedMemoryMap_R4
+//
+// Memory Map (top-level object)
+//
+
+constexpr int FLAG_WANT_KEYB = 1 << 0;
+constexpr int FLAG_WANT_MOUSE = 1 << 1;
+constexpr int FLAG_NO_FRAME = 1 << 2;
+constexpr int FLAG_PAUSED = 1 << 3;
+constexpr int FLAG_CMD_RING = 1 << 4;	// host serves a sSharedMMapCmdRing_R5 after the RAM
+constexpr int FLAG_SDHR_PUBLISH = 1 << 5;	// host understands ":sdhr_publish" (":sdhr_write" + ":sdhr_process")
+constexpr int FLAG_FRAME_SEQLOCK = 1 << 6;	// frame.seq is odd while the host writes the frame, and goes up by 2 per frame
+constexpr int SYSTEM_MAXLEN = 64;
+constexpr int PROGRAM_MAXLEN = 260;
+
+struct sSharedMemoryMap_R4
+{
+	UINT8 version; // = PROTOCOL_VER
+	UINT8 flags;
+	char system[SYSTEM_MAXLEN] = {}; // System name.
+	char program[PROGRAM_MAXLEN] = {}; // Program name. Zero terminated.
+	UINT program_hash[4] = { 0,0,0,0 }; // Program code hash (256-bits)
+
+	sSharedMMapFrame_R1 frame;
+	sSharedMMapInput_R2 input;
+	sSharedMMapPeek_R2 peek;
+	sSharedMMapBuffer_R1 buf_tohost;
+	sSharedMMapBuffer_R1 buf_recv; // a message to us.
+	sSharedMMapAudio_R1 audio;
+
+	// added for protocol v4
+	UINT ram_size;
+
+	// added a simpler, other input channel that isn't clobbered by gridcarto
+	sSharedMMapInput_R2 input_other;
+};
+
+#pragma pack( pop )
+
+constexpr int MEMORY_MAP_CORE_SIZE = sizeof(sSharedMemoryMap_R4);
+
+//
+// sSharedMMapCmdRing_R5
+//
+// Protocol extension: single-producer/single-consumer ring of buf_tohost-style slots.
+// A host that supports it sets FLAG_CMD_RING in flags and places the ring at GetCmdRingOffset(ram_size),
+// with version = CMD_RING_VERSION. A client that uses it writes its version to client_version and
+// from then on sends ALL its messages through the ring, so they stay in order.
+// The client fills slot[head % slot_count] then publishes head + 1; the host consumes up to head,
+// publishes tail, and signals the drained event. Neither side takes the mutex.
+// Not packed: the indices must be naturally aligned for the atomics to work across processes.
+//
+
+constexpr UINT32 CMD_RING_VERSION = 1;
+
+struct alignas(64) sSharedMMapRingSlot_R5
+{
+	UINT32 payload;
+	UINT8 data[sSharedMMapBuffer_R1::BUFFER_SIZE];
+};
+
+struct sSharedMMapCmdRing_R5
+{
+	enum { DEFAULT_SLOTS = 8 };
+
+	UINT32 version;			// = CMD_RING_VERSION, set by the host
+	UINT32 slot_count;		// power of 2
+	UINT32 client_version;	// set by the client when it starts using the ring
+	UINT32 reserved0;
+
+	alignas(64) std::atomic<UINT32> head;	// written by the client only
+	alignas(64) std::atomic<UINT32> tail;	// written by the host only
+
+	sSharedMMapRingSlot_R5* Slots() { return reinterpret_cast<sSharedMMapRingSlot_R5*>(this + 1); }
+	sSharedMMapRingSlot_R5& Slot(UINT32 index) { return Slots()[index & (slot_count - 1)]; }
+};
+
+static_assert(std::atomic<UINT32>::is_always_lock_free, "The command ring needs lock-free atomics");
+static_assert(sizeof(sSharedMMapCmdRing_R5) % 64 == 0, "Ring slots must stay 64-byte aligned");
+
+// The ring starts on the first 64-byte boundary after the RAM
+constexpr size_t GetCmdRingOffset(UINT ram_size)
+{
+	return ((size_t)MEMORY_MAP_CORE_SIZE + ram_size + 63) & ~(size_t)63;
+}
+
+constexpr size_t GetCmdRingSize(UINT slot_count)
+{
+	return sizeof(sSharedMMapCmdRing_R5) + (size_t)slot_count * sizeof(sSharedMMapRingSlot_R5);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "GameLink.h"
+
+namespace GameLink
+{
+	/**
+	 * @brief Result of a Transport::Lock() call
+	 * Mirrors the WaitForSingleObject() results the GameLink code was written against
+	*/
+	enum class LockResult {
+		ACQUIRED = 0,
+		ABANDONED,	// acquired, but the previous owner died while holding it (Win32 only)
+		TIMEOUT,
+		FAILED,
+	};
+
+	/**
+	 * @brief Transport
+	 * Platform layer giving access to the GameLink shared memory map and its cross-process mutex.
+	 * The client opens the objects AppleWin created, the stand-in server creates them.
+	 * Use CreateTransport() to get the implementation for the current platform.
+	*/
+	class Transport
+	{
+	public:
+		virtual ~Transport() {}
+
+		// Opens an existing shared memory map and maps all of it
+		virtual bool OpenMap() = 0;
+		// Opens the existing named mutex guarding the map
+		virtual bool OpenMutex() = 0;
+		// Opens the existing "buf_tohost drained" event. Optional, older hosts don't have it.
+		virtual bool OpenDrainedEvent() = 0;
+		// Creates the map (zero-filled), the mutex and the drained event. Used by servers.
+		virtual bool Create(size_t map_size) = 0;
+		// Unmaps and closes everything. Objects we created are removed.
+		virtual void Close() = 0;
+
+		virtual UINT8* GetMapPointer() = 0;
+		virtual size_t GetMapSize() = 0;
+
+		virtual LockResult Lock(UINT timeout_ms) = 0;
+		virtual void Unlock() = 0;
+
+		// Blocks until the host signals it drained buf_tohost, or the timeout expires.
+		// Returns false on timeout or if there's no event (then it doesn't block at all).
+		virtual bool WaitDrainedEvent(UINT timeout_ms) = 0;
+		// Wakes up a client waiting in WaitDrainedEvent(). Used by servers.
+		virtual void SignalDrainedEvent() = 0;
+		virtual bool HasDrainedEvent() = 0;
+
+		virtual void DebugOutput(const char* message) = 0;
+	};
+
+	// Returns a new transport for the platform we're compiled for. Caller owns it.
+	extern Transport* CreateTransport();
+
+}; // namespace GameLink
@@ -0,0 +1,235 @@
+#ifndef _WIN32
+
+#include "GameLinkTransport.h"
+#include "GameLinkProtocol.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace GameLink;
+
+// POSIX object names must start with a slash
+#define POSIX_MMAP_NAME		"/" GAMELINK_MMAP_NAME
+#define POSIX_MUTEX_NAME	"/" GAMELINK_MUTEX_NAME
+#define POSIX_DRAINED_NAME	"/" GAMELINK_DRAINED_EVENT_NAME
+
+/**
+ * @brief Transport_POSIX
+ * shm_open()/mmap() for the map, a named semaphore (initial count 1) as the mutex.
+ * The layout of the map is the same sSharedMemoryMap_R4 + RAM as on Windows.
+ * Semaphores have no owner, so an abandoned lock can't be detected: it'll time out instead.
+ * The drained event is a second named semaphore kept at 0 or 1 to behave like an auto-reset event.
+ * It's futex-backed on Linux, and unlike an eventfd unrelated processes can open it by name.
+*/
+class Transport_POSIX : public Transport
+{
+public:
+	~Transport_POSIX() { Close(); }
+
+	bool OpenMap() override;
+	bool OpenMutex() override;
+	bool OpenDrainedEvent() override;
+	bool Create(size_t map_size) override;
+	void Close() override;
+
+	UINT8* GetMapPointer() override { return p_map; }
+	size_t GetMapSize() override { return map_size; }
+
+	LockResult Lock(UINT timeout_ms) override;
+	void Unlock() override;
+
+	bool WaitDrainedEvent(UINT timeout_ms) override;
+	void SignalDrainedEvent() override;
+	bool HasDrainedEvent() override { return p_drained != SEM_FAILED; }
+
+	void DebugOutput(const char* message) override;
+
+private:
+	bool MapFd(int fd, size_t size);
+	static LockResult TimedWait(sem_t* sem, UINT timeout_ms);
+
+	sem_t* p_mutex = SEM_FAILED;
+	sem_t* p_drained = SEM_FAILED;
+	UINT8* p_map = nullptr;
+	size_t map_size = 0;
+	bool b_owner = false;	// we created the objects and must unlink them
+};
+
+bool Transport_POSIX::MapFd(int fd, size_t size)
+{
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	p_map = reinterpret_cast<UINT8*>(p);
+	map_size = size;
+	return true;
+}
+
+bool Transport_POSIX::OpenMap()
+{
+	int fd = shm_open(POSIX_MMAP_NAME, O_RDWR, 0);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < MEMORY_MAP_CORE_SIZE)
+	{
+		close(fd);
+		return false;
+	}
+	return MapFd(fd, (size_t)st.st_size);
+}
+
+bool Transport_POSIX::OpenMutex()
+{
+	p_mutex = sem_open(POSIX_MUTEX_NAME, 0);
+	return (p_mutex != SEM_FAILED);
+}
+
+bool Transport_POSIX::OpenDrainedEvent()
+{
+	p_drained = sem_open(POSIX_DRAINED_NAME, 0);
+	return (p_drained != SEM_FAILED);
+}
+
+bool Transport_POSIX::Create(size_t size)
+{
+	// Start from a clean slate in case a previous server crashed
+	shm_unlink(POSIX_MMAP_NAME);
+	sem_unlink(POSIX_MUTEX_NAME);
+	sem_unlink(POSIX_DRAINED_NAME);
+
+	int fd = shm_open(POSIX_MMAP_NAME, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd < 0)
+		return false;
+	b_owner = true;
+	if (ftruncate(fd, (off_t)size) != 0 || !MapFd(fd, size))
+	{
+		Close();
+		return false;
+	}
+	p_mutex = sem_open(POSIX_MUTEX_NAME, O_CREAT | O_EXCL, 0666, 1);
+	p_drained = sem_open(POSIX_DRAINED_NAME, O_CREAT | O_EXCL, 0666, 0);
+	if (p_mutex == SEM_FAILED || p_drained == SEM_FAILED)
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void Transport_POSIX::Close()
+{
+	if (p_map != nullptr)
+	{
+		munmap(p_map, map_size);
+		p_map = nullptr;
+	}
+	if (p_mutex != SEM_FAILED)
+	{
+		sem_close(p_mutex);
+		p_mutex = SEM_FAILED;
+	}
+	if (p_drained != SEM_FAILED)
+	{
+		sem_close(p_drained);
+		p_drained = SEM_FAILED;
+	}
+	if (b_owner)
+	{
+		shm_unlink(POSIX_MMAP_NAME);
+		sem_unlink(POSIX_MUTEX_NAME);
+		sem_unlink(POSIX_DRAINED_NAME);
+		b_owner = false;
+	}
+	map_size = 0;
+}
+
+LockResult Transport_POSIX::TimedWait(sem_t* sem, UINT timeout_ms)
+{
+#ifdef __APPLE__
+	// No sem_timedwait() on macOS, poll instead
+	for (UINT waited = 0; ; ++waited)
+	{
+		if (sem_trywait(sem) == 0)
+			return LockResult::ACQUIRED;
+		if (errno != EAGAIN && errno != EINTR)
+			return LockResult::FAILED;
+		if (waited >= timeout_ms)
+			return LockResult::TIMEOUT;
+		usleep(1000);
+	}
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000L;
+	}
+	while (sem_timedwait(sem, &ts) != 0)
+	{
+		if (errno == EINTR)
+			continue;
+		if (errno == ETIMEDOUT)
+			return LockResult::TIMEOUT;
+		return LockResult::FAILED;
+	}
+	return LockResult::ACQUIRED;
+#endif
+}
+
+LockResult Transport_POSIX::Lock(UINT timeout_ms)
+{
+	if (p_mutex == SEM_FAILED)
+		return LockResult::FAILED;
+	return TimedWait(p_mutex, timeout_ms);
+}
+
+void Transport_POSIX::Unlock()
+{
+	if (p_mutex != SEM_FAILED)
+		sem_post(p_mutex);
+}
+
+bool Transport_POSIX::WaitDrainedEvent(UINT timeout_ms)
+{
+	if (p_drained == SEM_FAILED)
+		return false;
+	return (TimedWait(p_drained, timeout_ms) == LockResult::ACQUIRED);
+}
+
+void Transport_POSIX::SignalDrainedEvent()
+{
+	if (p_drained == SEM_FAILED)
+		return;
+	// Don't let the count grow past 1, like a Win32 auto-reset event
+	int value = 0;
+	if (sem_getvalue(p_drained, &value) == 0 && value > 0)
+		return;
+	sem_post(p_drained);
+}
+
+void Transport_POSIX::DebugOutput(const char* message)
+{
+	fputs(message, stderr);
+}
+
+//------------------------------------------------------------------------------
+// Factory
+//------------------------------------------------------------------------------
+
+Transport* GameLink::CreateTransport()
+{
+	return new Transport_POSIX();
+}
+
+#endif // !_WIN32
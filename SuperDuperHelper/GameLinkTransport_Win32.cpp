@@ -0,0 +1,166 @@
+#ifdef _WIN32
+
+#include "GameLinkTransport.h"
+#include "GameLinkProtocol.h"
+
+using namespace GameLink;
+
+/**
+ * @brief Transport_Win32
+ * Named file mapping + named mutex, exactly what AppleWin creates
+*/
+class Transport_Win32 : public Transport
+{
+public:
+	~Transport_Win32() { Close(); }
+
+	bool OpenMap() override;
+	bool OpenMutex() override;
+	bool OpenDrainedEvent() override;
+	bool Create(size_t map_size) override;
+	void Close() override;
+
+	UINT8* GetMapPointer() override { return p_map; }
+	size_t GetMapSize() override { return map_size; }
+
+	LockResult Lock(UINT timeout_ms) override;
+	void Unlock() override;
+
+	bool WaitDrainedEvent(UINT timeout_ms) override;
+	void SignalDrainedEvent() override;
+	bool HasDrainedEvent() override { return h_drained != NULL; }
+
+	void DebugOutput(const char* message) override;
+
+private:
+	HANDLE h_mutex = NULL;
+	HANDLE h_mmap = NULL;
+	HANDLE h_drained = NULL;
+	UINT8* p_map = nullptr;
+	size_t map_size = 0;
+};
+
+bool Transport_Win32::OpenMap()
+{
+	h_mmap = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, GAMELINK_MMAP_NAME);
+	if (h_mmap == NULL)
+		return false;
+	p_map = reinterpret_cast<UINT8*>(MapViewOfFile(h_mmap, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (p_map == nullptr)
+	{
+		CloseHandle(h_mmap);
+		h_mmap = NULL;
+		return false;
+	}
+	MEMORY_BASIC_INFORMATION mbi;
+	if (VirtualQuery(p_map, &mbi, sizeof(mbi)))
+		map_size = mbi.RegionSize;
+	return true;
+}
+
+bool Transport_Win32::OpenMutex()
+{
+	h_mutex = OpenMutexA(SYNCHRONIZE, FALSE, GAMELINK_MUTEX_NAME);
+	return (h_mutex != NULL);
+}
+
+bool Transport_Win32::OpenDrainedEvent()
+{
+	h_drained = OpenEventA(SYNCHRONIZE, FALSE, GAMELINK_DRAINED_EVENT_NAME);
+	return (h_drained != NULL);
+}
+
+bool Transport_Win32::Create(size_t size)
+{
+	h_mmap = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		(DWORD)((UINT64)size >> 32), (DWORD)(size & 0xFFFFFFFF), GAMELINK_MMAP_NAME);
+	if (h_mmap == NULL)
+		return false;
+	p_map = reinterpret_cast<UINT8*>(MapViewOfFile(h_mmap, FILE_MAP_ALL_ACCESS, 0, 0, size));
+	h_mutex = CreateMutexA(NULL, FALSE, GAMELINK_MUTEX_NAME);
+	h_drained = CreateEventA(NULL, FALSE, FALSE, GAMELINK_DRAINED_EVENT_NAME);	// auto-reset
+	if (p_map == nullptr || h_mutex == NULL || h_drained == NULL)
+	{
+		Close();
+		return false;
+	}
+	map_size = size;
+	return true;
+}
+
+void Transport_Win32::Close()
+{
+	if (p_map != nullptr)
+	{
+		UnmapViewOfFile(p_map);
+		p_map = nullptr;
+	}
+	if (h_mmap != NULL)
+	{
+		CloseHandle(h_mmap);
+		h_mmap = NULL;
+	}
+	if (h_mutex != NULL)
+	{
+		CloseHandle(h_mutex);
+		h_mutex = NULL;
+	}
+	if (h_drained != NULL)
+	{
+		CloseHandle(h_drained);
+		h_drained = NULL;
+	}
+	map_size = 0;
+}
+
+LockResult Transport_Win32::Lock(UINT timeout_ms)
+{
+	DWORD dwWaitResult = WaitForSingleObject(h_mutex, timeout_ms);
+	switch (dwWaitResult)
+	{
+	case WAIT_OBJECT_0:
+		return LockResult::ACQUIRED;
+	case WAIT_ABANDONED:
+		return LockResult::ABANDONED;
+	case WAIT_TIMEOUT:
+		return LockResult::TIMEOUT;
+	case WAIT_FAILED:
+		[[fallthrough]];
+	default:
+		return LockResult::FAILED;
+	}
+}
+
+void Transport_Win32::Unlock()
+{
+	ReleaseMutex(h_mutex);
+}
+
+bool Transport_Win32::WaitDrainedEvent(UINT timeout_ms)
+{
+	if (h_drained == NULL)
+		return false;
+	return (WaitForSingleObject(h_drained, timeout_ms) == WAIT_OBJECT_0);
+}
+
+void Transport_Win32::SignalDrainedEvent()
+{
+	if (h_drained != NULL)
+		SetEvent(h_drained);
+}
+
+void Transport_Win32::DebugOutput(const char* message)
+{
+	OutputDebugStringA(message);
+}
+
+//------------------------------------------------------------------------------
+// Factory
+//------------------------------------------------------------------------------
+
+Transport* GameLink::CreateTransport()
+{
+	return new Transport_Win32();
+}
+
+#endif // _WIN32
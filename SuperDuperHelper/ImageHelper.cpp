@@ -3,8 +3,55 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include <SDL.h>
+#include <cstring>
+
+// Pixel buffer objects need GL 3.0 (or GLES3), which the GLES2 and WebGL builds don't have
+#if !defined(IMGUI_IMPL_OPENGL_ES2) && !defined(__EMSCRIPTEN__) && defined(GL_PIXEL_UNPACK_BUFFER)
+#define IMAGEHELPER_PIXEL_BUFFERS
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define IMAGEHELPER_SSE2
+#endif
+
 namespace ImageHelper
 {
+#ifdef IMAGEHELPER_PIXEL_BUFFERS
+	// Buffer object entry points. SDL_opengl.h only guarantees GL 1.1, so they're looked up at runtime.
+	static PFNGLGENBUFFERSPROC p_glGenBuffers;
+	static PFNGLDELETEBUFFERSPROC p_glDeleteBuffers;
+	static PFNGLBINDBUFFERPROC p_glBindBuffer;
+	static PFNGLBUFFERDATAPROC p_glBufferData;
+	static PFNGLMAPBUFFERRANGEPROC p_glMapBufferRange;
+	static PFNGLUNMAPBUFFERPROC p_glUnmapBuffer;
+
+	static bool LoadPixelBufferFunctions()
+	{
+		static bool bTried = false;
+		static bool bLoaded = false;
+		if (bTried)
+			return bLoaded;
+		bTried = true;
+
+		// Some platforms return entry points the context doesn't support, so check the version first
+		GLint major = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		if (major < 3 && !SDL_GL_ExtensionSupported("GL_ARB_map_buffer_range"))
+			return false;
+		p_glGenBuffers = (PFNGLGENBUFFERSPROC)SDL_GL_GetProcAddress("glGenBuffers");
+		p_glDeleteBuffers = (PFNGLDELETEBUFFERSPROC)SDL_GL_GetProcAddress("glDeleteBuffers");
+		p_glBindBuffer = (PFNGLBINDBUFFERPROC)SDL_GL_GetProcAddress("glBindBuffer");
+		p_glBufferData = (PFNGLBUFFERDATAPROC)SDL_GL_GetProcAddress("glBufferData");
+		p_glMapBufferRange = (PFNGLMAPBUFFERRANGEPROC)SDL_GL_GetProcAddress("glMapBufferRange");
+		p_glUnmapBuffer = (PFNGLUNMAPBUFFERPROC)SDL_GL_GetProcAddress("glUnmapBuffer");
+		bLoaded = p_glGenBuffers && p_glDeleteBuffers && p_glBindBuffer && p_glBufferData
+			&& p_glMapBufferRange && p_glUnmapBuffer;
+		return bLoaded;
+	}
+#endif
+
 	// Simple helper function to load an image into a OpenGL texture with common settings
 	bool LoadTextureFromFile(const char* filename, GLuint* out_texture, int* out_width, int* out_height)
 	{
@@ -25,7 +72,8 @@ namespace ImageHelper
 		return true;
 	}
 
-	bool LoadTextureFromMemory(const unsigned char* image_data, GLuint* out_texture, const int image_width, const int image_height, bool isARGB)
+	// Creates a texture with our common settings and leaves it bound
+	static GLuint CreateTexture()
 	{
 		// Create a OpenGL texture identifier
 		GLuint image_texture;
@@ -37,6 +85,12 @@ namespace ImageHelper
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); // This is required on WebGL for non power-of-two textures
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); // Same
+		return image_texture;
+	}
+
+	bool LoadTextureFromMemory(const unsigned char* image_data, GLuint* out_texture, const int image_width, const int image_height, bool isARGB)
+	{
+		GLuint image_texture = CreateTexture();
 
 		// Upload pixels into texture
 #if defined(GL_UNPACK_ROW_LENGTH) && !defined(__EMSCRIPTEN__)
@@ -52,6 +106,190 @@ namespace ImageHelper
 		return true;
 	}
 
+	// Spans closer than this many identical rows are uploaded as one
+	constexpr int DIRTY_ROWS_MERGE_GAP = 4;
+
+	static bool RowsEqual(const uint8_t* a, const uint8_t* b, size_t n)
+	{
+#ifdef IMAGEHELPER_SSE2
+		size_t i = 0;
+		for (; i + 64 <= n; i += 64)
+		{
+			__m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+			__m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 16)), _mm_loadu_si128((const __m128i*)(b + i + 16)));
+			__m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 32)), _mm_loadu_si128((const __m128i*)(b + i + 32)));
+			__m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 48)), _mm_loadu_si128((const __m128i*)(b + i + 48)));
+			__m128i eq = _mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3));
+			if (_mm_movemask_epi8(eq) != 0xFFFF)
+				return false;
+		}
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+			if (_mm_movemask_epi8(eq) != 0xFFFF)
+				return false;
+		}
+		return memcmp(a + i, b + i, n - i) == 0;
+#else
+		return memcmp(a, b, n) == 0;
+#endif
+	}
+
+	void FindDirtyRows(const uint8_t* image, const uint8_t* previous, size_t row_bytes, int rows, std::vector<sRowSpan>& spans)
+	{
+		spans.clear();
+		for (int y = 0; y < rows; ++y)
+		{
+			const size_t offset = y * row_bytes;
+			if (RowsEqual(image + offset, previous + offset, row_bytes))
+				continue;
+			if (!spans.empty() && y - (spans.back().y + spans.back().count) <= DIRTY_ROWS_MERGE_GAP)
+				spans.back().count = y + 1 - spans.back().y;
+			else
+				spans.push_back({ y, 1 });
+		}
+	}
+
+	bool StreamingTexture::Update(const unsigned char* image_data, const int image_width, const int image_height, bool isARGB)
+	{
+		if (image_data == nullptr || image_width <= 0 || image_height <= 0)
+			return false;
+		const size_t row_bytes = (size_t)image_width * 4;
+		const size_t size = row_bytes * image_height;
+		const bool bNewSize = (image_width != width || image_height != height);
+
+		// Find what changed since the last upload. Everything did if there's nothing to compare with.
+		v_spans.clear();
+		if (dirty_rows && !bNewSize && texture != 0 && v_previous.size() == size)
+			FindDirtyRows(image_data, v_previous.data(), row_bytes, image_height, v_spans);
+		else
+			v_spans.push_back({ 0, image_height });
+		pixels_submitted += (uint64_t)image_width * image_height;
+		if (v_spans.empty())
+			return true;
+		if (dirty_rows)
+		{
+			v_previous.resize(size);
+			for (auto& span : v_spans)
+				memcpy(v_previous.data() + span.y * row_bytes, image_data + span.y * row_bytes, span.count * row_bytes);
+		}
+
+		if (texture == 0)
+			texture = CreateTexture();
+		else
+			glBindTexture(GL_TEXTURE_2D, texture);
+
+#if defined(GL_UNPACK_ROW_LENGTH) && !defined(__EMSCRIPTEN__)
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+#endif
+		GLenum format = isARGB ? GL_BGRA : GL_RGBA;
+		GLenum type = isARGB ? GL_UNSIGNED_INT_8_8_8_8_REV : GL_UNSIGNED_BYTE;
+		const unsigned char* pixels = image_data;
+#ifdef IMAGEHELPER_PIXEL_BUFFERS
+		bool bPixelBuffer = false;
+		if (pbo_count > 0)
+		{
+			// Next buffer of the ring: the GPU may still be reading the one we used last time
+			if (pbos[0] == 0)
+				p_glGenBuffers(pbo_count, pbos);
+			pbo_index = (pbo_index + 1) % pbo_count;
+			p_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[pbo_index]);
+			if (size != pbo_size)
+			{
+				for (int i = 0; i < pbo_count; ++i)
+				{
+					p_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[i]);
+					p_glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+				}
+				p_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[pbo_index]);
+				pbo_size = size;
+			}
+			// Only the dirty rows are written, at the same place as in the image
+			auto p_mapped = (unsigned char*)p_glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			if (p_mapped != nullptr)
+			{
+				for (auto& span : v_spans)
+					memcpy(p_mapped + span.y * row_bytes, image_data + span.y * row_bytes, span.count * row_bytes);
+				p_glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				pixels = nullptr;	// offsets in the bound buffer
+				bPixelBuffer = true;
+			}
+			else
+			{
+				p_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+		}
+#endif
+		if (bNewSize)
+		{
+			// New size, new storage
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image_width, image_height, 0, format, type, pixels);
+			width = image_width;
+			height = image_height;
+			++allocations;
+		}
+		else
+		{
+			for (auto& span : v_spans)
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, span.y, image_width, span.count, format, type, (const void*)((uintptr_t)pixels + span.y * row_bytes));
+		}
+		for (auto& span : v_spans)
+			pixels_uploaded += (uint64_t)image_width * span.count;
+#ifdef IMAGEHELPER_PIXEL_BUFFERS
+		// The texture now sources the buffer asynchronously, and regular uploads mustn't go through it
+		if (bPixelBuffer)
+			p_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+#endif
+		return true;
+	}
+
+	void StreamingTexture::SetDirtyRowDetection(bool enable)
+	{
+		dirty_rows = enable;
+		if (!enable)
+			v_previous = std::vector<uint8_t>();
+	}
+
+	bool StreamingTexture::EnablePixelBuffers(int count)
+	{
+#ifdef IMAGEHELPER_PIXEL_BUFFERS
+		if (count < 2 || count > MAX_PIXEL_BUFFERS || !LoadPixelBufferFunctions())
+			return false;
+		if (count != pbo_count && pbos[0] != 0)
+		{
+			p_glDeleteBuffers(pbo_count, pbos);
+			memset(pbos, 0, sizeof(pbos));
+			pbo_size = 0;
+		}
+		pbo_count = count;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void StreamingTexture::SetPixelAspectRatio(int parX, int parY)
+	{
+		// A host that doesn't fill them in leaves them at 0
+		par_x = (parX > 0) ? parX : 1;
+		par_y = (parY > 0) ? parY : 1;
+	}
+
+	void StreamingTexture::Release()
+	{
+		if (texture != 0)
+			glDeleteTextures(1, &texture);
+#ifdef IMAGEHELPER_PIXEL_BUFFERS
+		if (pbos[0] != 0)
+			p_glDeleteBuffers(pbo_count, pbos);
+		memset(pbos, 0, sizeof(pbos));
+		pbo_size = 0;
+#endif
+		texture = 0;
+		width = 0;
+		height = 0;
+	}
+
 	void convertRGB888toRGB555(const uint8_t* rgb888_buffer, int width, int height, uint16_t* rgb555_buffer) {
 		size_t num_pixels = (size_t)width * height;
 
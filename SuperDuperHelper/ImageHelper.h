@@ -4,12 +4,85 @@
 #else
 #include <SDL_opengl.h>
 #endif
+#include <cstddef>
 #include <cstdint>
+#include <vector>
 
 namespace ImageHelper
 {
 	bool LoadTextureFromFile(const char* filename, GLuint* out_texture, int* out_width, int* out_height);
 	bool LoadTextureFromMemory(const unsigned char* image_data, GLuint* out_texture, const int image_width, const int image_height, bool isARGB = false);
 	void convertRGB888toRGB555(const uint8_t* rgb888_buffer, int width, int height, uint16_t* rgb555_buffer);
+
+	// Range of image rows
+	struct sRowSpan
+	{
+		int y;
+		int count;
+	};
+	// Compares two images row by row (SSE2 where available) and returns the spans of rows that differ.
+	// Spans separated by only a few identical rows are merged, it's cheaper to upload them than to split the upload.
+	void FindDirtyRows(const uint8_t* image, const uint8_t* previous, size_t row_bytes, int rows, std::vector<sRowSpan>& spans);
+
+	/**
+	 * @brief StreamingTexture
+	 * A texture for images that change every frame, like the emulator video.
+	 * Its storage is only allocated when the image size changes, otherwise it's updated in place with glTexSubImage2D().
+	 * Call Release() while the GL context is still current.
+	*/
+	class StreamingTexture
+	{
+	public:
+		StreamingTexture() {}
+		StreamingTexture(const StreamingTexture&) = delete;
+		StreamingTexture& operator=(const StreamingTexture&) = delete;
+		~StreamingTexture() { Release(); }
+
+		// Uploads a 32-bit image, RGBA or 0xAARRGGBB if isARGB. Returns false if there's nothing to upload.
+		bool Update(const unsigned char* image_data, const int image_width, const int image_height, bool isARGB = false);
+		// Uploads through a ring of count (2 or 3) pixel buffer objects from now on, so the driver doesn't copy
+		// each image synchronously: we write the next image into a mapped buffer while the GPU reads the previous one.
+		// Returns false, and keeps the synchronous path, where they aren't available (GLES2, Emscripten, GL < 3.0).
+		// Needs the GL context to be current.
+		bool EnablePixelBuffers(int count);
+		bool IsUsingPixelBuffers() const { return pbo_count > 0; }
+		// Keeps a copy of the last image and only uploads the rows that changed since (on by default)
+		void SetDirtyRowDetection(bool enable);
+		// Pixel aspect ratio of the image. It only changes the display size, not the texture.
+		void SetPixelAspectRatio(int par_x, int par_y);
+		void Release();
+
+		GLuint GetTexture() const { return texture; }
+		int GetWidth() const { return width; }
+		int GetHeight() const { return height; }
+		// Size to show the image at, stretched horizontally by the pixel aspect ratio
+		float GetDisplayWidth() const { return (float)width * par_x / par_y; }
+		float GetDisplayHeight() const { return (float)height; }
+		// How many times the storage was (re)allocated
+		uint64_t GetAllocationCount() const { return allocations; }
+		// Pixels given to Update(), and those that actually had to be uploaded
+		uint64_t GetPixelsSubmitted() const { return pixels_submitted; }
+		uint64_t GetPixelsUploaded() const { return pixels_uploaded; }
+
+	private:
+		GLuint texture = 0;
+		int width = 0;
+		int height = 0;
+		int par_x = 1;
+		int par_y = 1;
+		uint64_t allocations = 0;
+
+		enum { MAX_PIXEL_BUFFERS = 3 };
+		GLuint pbos[MAX_PIXEL_BUFFERS] = {};
+		int pbo_count = 0;			// 0 = synchronous uploads
+		int pbo_index = 0;			// buffer used by the last upload
+		size_t pbo_size = 0;		// bytes allocated in each buffer
+
+		bool dirty_rows = true;
+		std::vector<uint8_t> v_previous;	// what the texture holds, to find the dirty rows
+		std::vector<sRowSpan> v_spans;		// rows to upload
+		uint64_t pixels_submitted = 0;
+		uint64_t pixels_uploaded = 0;
+	};
 };
 
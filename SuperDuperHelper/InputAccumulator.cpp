@@ -0,0 +1,260 @@
+#include "InputAccumulator.h"
+
+#include <algorithm>
+#include <cmath>
+
+//------------------------------------------------------------------------------
+// Methods
+//------------------------------------------------------------------------------
+
+// With mutex held
+void InputAccumulator::NoteInput()
+{
+	if (!hasPendingInput)
+	{
+		hasPendingInput = true;
+		firstInput = Clock::now();
+	}
+}
+
+void InputAccumulator::SetKey(UINT scancode, bool isPressed)
+{
+	if (scancode >= KEY_COUNT)
+		return;
+	const UINT word = scancode / 32;
+	const UINT bit = 1u << (scancode % 32);
+	if (isPressed)
+	{
+		keys[word].fetch_or(bit, std::memory_order_relaxed);
+		latched[word].fetch_or(bit, std::memory_order_relaxed);
+	}
+	else
+	{
+		keys[word].fetch_and(~bit, std::memory_order_relaxed);
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	++stats.key_events;
+	NoteInput();
+}
+
+void InputAccumulator::ReleaseAll()
+{
+	for (auto& word : keys)
+		word.store(0, std::memory_order_relaxed);
+	std::lock_guard<std::mutex> lock(mutex);
+	mouse_buttons = 0;
+	gamepad_buttons = 0;
+	gamepad_axis[0] = 0.f;
+	gamepad_axis[1] = 0.f;
+}
+
+bool InputAccumulator::IsKeyDown(UINT scancode) const
+{
+	if (scancode >= KEY_COUNT)
+		return false;
+	return (keys[scancode / 32].load(std::memory_order_relaxed) >> (scancode % 32)) & 1;
+}
+
+void InputAccumulator::AddMouseMotion(float dx, float dy)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	mouse_dx += dx;
+	mouse_dy += dy;
+	++stats.mouse_events;
+	NoteInput();
+}
+
+void InputAccumulator::SetMouseButton(UINT button, bool isPressed)
+{
+	if (button > 1)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (isPressed)
+		mouse_buttons |= (UINT8)(1 << button);
+	else
+		mouse_buttons &= (UINT8)~(1 << button);
+	++stats.mouse_events;
+	NoteInput();
+}
+
+void InputAccumulator::SetGamepadAxis(UINT axis, float value)
+{
+	if (axis > 1)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	gamepad_axis[axis] = std::clamp(value, -1.f, 1.f);
+	++stats.gamepad_events;
+	NoteInput();
+}
+
+void InputAccumulator::SetGamepadButton(UINT button, bool isPressed)
+{
+	if (button > 1)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (isPressed)
+		gamepad_buttons |= (UINT8)(1 << button);
+	else
+		gamepad_buttons &= (UINT8)~(1 << button);
+	++stats.gamepad_events;
+	NoteInput();
+}
+
+void InputAccumulator::SetGamepadSpeed(float unitsPerSec)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	gamepad_speed = unitsPerSec;
+}
+
+float InputAccumulator::GetGamepadSpeed()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return gamepad_speed;
+}
+
+bool InputAccumulator::Publish()
+{
+	TrackLatency();
+
+	const auto now = Clock::now();
+	const float elapsed = (lastPublish == Clock::time_point()) ? 0.f : std::chrono::duration<float>(now - lastPublish).count();
+	lastPublish = now;
+
+	// Like the mouse, the gamepad only drives the host's mouse while it asks for one
+	const bool isMouseWanted = GameLink::IsMouseWanted();
+	GameLink::sInputState state = GameLink::sInputState();
+	bool hadInput;
+	Clock::time_point inputTime;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// The stick is a speed: it moves the mouse for as long as it's held
+		for (UINT axis = 0; isMouseWanted && axis < 2; ++axis)
+		{
+			float value = gamepad_axis[axis];
+			if (std::fabs(value) < GAMEPAD_DEADZONE)
+				continue;
+			value = (value - std::copysign(GAMEPAD_DEADZONE, value)) / (1.f - GAMEPAD_DEADZONE);
+			(axis == 0 ? mouse_dx : mouse_dy) += value * gamepad_speed * std::min(elapsed, 0.1f);
+		}
+		state.mouse_dx = mouse_dx;
+		state.mouse_dy = mouse_dy;
+		state.mouse_btn = mouse_buttons | (isMouseWanted ? gamepad_buttons : 0);
+		mouse_dx = 0.f;
+		mouse_dy = 0.f;
+		hadInput = hasPendingInput;
+		inputTime = firstInput;
+		hasPendingInput = false;
+	}
+
+	// Keys tapped since the last publish go out pressed, and released the time after
+	UINT taken[8];
+	UINT8 changed = 0;
+	for (UINT i = 0; i < 8; ++i)
+	{
+		taken[i] = latched[i].exchange(0, std::memory_order_relaxed);
+		state.keyb_state[i] = keys[i].load(std::memory_order_relaxed) | taken[i];
+		if (!publishedAll || state.keyb_state[i] != published[i])
+			changed |= (UINT8)(1 << i);
+	}
+	const bool sendMouse = !publishedAll || state.mouse_dx != 0.f || state.mouse_dy != 0.f || state.mouse_btn != published_buttons;
+	if (changed == 0 && !sendMouse)
+		return true;
+
+	if (!GameLink::SendInput(state, changed, sendMouse))
+	{
+		// Try again next time, with the motion and taps still there
+		for (UINT i = 0; i < 8; ++i)
+			latched[i].fetch_or(taken[i], std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(mutex);
+		mouse_dx += state.mouse_dx;
+		mouse_dy += state.mouse_dy;
+		if (hadInput && (!hasPendingInput || inputTime < firstInput))
+		{
+			hasPendingInput = true;
+			firstInput = inputTime;
+		}
+		++stats.busy;
+		return false;
+	}
+	for (UINT i = 0; i < 8; ++i)
+		published[i] = state.keyb_state[i];
+	published_buttons = state.mouse_btn;
+	publishedAll = true;
+
+	// Time it until the host shows a frame it made after getting this input
+	if (hadInput && !awaitingFrame)
+	{
+		awaitingFrame = true;
+		awaitingSince = inputTime;
+		awaitingSeq = GameLink::GetFrameSequence();
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	++stats.publishes;
+	return true;
+}
+
+void InputAccumulator::Reset()
+{
+	publishedAll = false;
+	awaitingFrame = false;
+}
+
+void InputAccumulator::TrackLatency()
+{
+	if (!awaitingFrame || GameLink::GetFrameSequence() == awaitingSeq || GameLink::IsFrameBeingWritten())
+		return;
+	awaitingFrame = false;
+	const double latency = std::chrono::duration<double, std::milli>(Clock::now() - awaitingSince).count();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	latency_samples[latency_count++ % LATENCY_SAMPLES] = latency;
+	const UINT count = std::min(latency_count, (UINT)LATENCY_SAMPLES);
+	double sum = 0.0;
+	double max = 0.0;
+	for (UINT i = 0; i < count; ++i)
+	{
+		sum += latency_samples[i];
+		max = std::max(max, latency_samples[i]);
+	}
+	stats.latency_ms_last = latency;
+	stats.latency_ms_avg = sum / count;
+	stats.latency_ms_max = max;
+}
+
+void InputAccumulator::Start(UINT rateHz)
+{
+	if (IsRunning())
+		return;
+	rate_hz = std::max(1u, rateHz);
+	quit = false;
+	thread = std::thread(&InputAccumulator::Run, this);
+}
+
+void InputAccumulator::Stop()
+{
+	if (!IsRunning())
+		return;
+	quit = true;
+	thread.join();
+}
+
+InputAccumulator::sStats InputAccumulator::GetStats()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
+
+void InputAccumulator::Run()
+{
+	const auto period = std::chrono::nanoseconds(1000000000LL / rate_hz);
+	auto next = Clock::now();
+	while (!quit)
+	{
+		Publish();
+		next += period;
+		const auto now = Clock::now();
+		if (now - next > 10 * period)
+			next = now;
+		std::this_thread::sleep_until(next);
+	}
+}
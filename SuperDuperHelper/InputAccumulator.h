@@ -0,0 +1,111 @@
+#pragma once
+
+#include "GameLink.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief InputAccumulator
+ * Collects the input for AppleWin on our side and hands it to the host in one go: Publish() writes the
+ * keyb_state words that changed, the mouse motion summed since the last publish and the buttons,
+ * all under a single lock.
+ * Keys are a 256-bit bitset of scancodes. A key pressed and released between two publishes is still
+ * seen pressed for one of them.
+ * The input_other channel only has a relative mouse, so the gamepad's stick moves it like a mouse
+ * (that's what drives the paddles), and its first two buttons are the mouse buttons. Both are ignored
+ * while the host doesn't set FLAG_WANT_MOUSE.
+ * Start() publishes from a thread at a fixed rate, otherwise call Publish() once per UI frame.
+ * The Set/Add methods may be called from another thread than the one publishing.
+*/
+class InputAccumulator
+{
+public:
+	enum : UINT { KEY_COUNT = 256 };
+
+	struct sStats
+	{
+		UINT64 key_events = 0;
+		UINT64 mouse_events = 0;
+		UINT64 gamepad_events = 0;
+		UINT64 publishes = 0;		// that wrote something
+		UINT64 busy = 0;			// the mutex was busy, retried on the next Publish()
+		// From the first input of a publish to the first frame the host finished after it
+		double latency_ms_last = 0.0;
+		double latency_ms_avg = 0.0;	// of the last LATENCY_SAMPLES
+		double latency_ms_max = 0.0;
+	};
+
+	~InputAccumulator() { Stop(); }
+
+	// Scancodes from KEY_COUNT up are ignored
+	void SetKey(UINT scancode, bool isPressed);
+	// Releases the keys and buttons and centers the stick, e.g. when the video window loses focus,
+	// so nothing stays stuck down
+	void ReleaseAll();
+	bool IsKeyDown(UINT scancode) const;
+
+	// Relative motion, summed until the next publish
+	void AddMouseMotion(float dx, float dy);
+	void SetMouseButton(UINT button, bool isPressed);	// 0 left, 1 right
+	// axis 0 is X and 1 is Y, from -1 to 1. Full tilt moves the mouse gamepad_speed units per second.
+	void SetGamepadAxis(UINT axis, float value);
+	void SetGamepadButton(UINT button, bool isPressed);	// 0 and 1 are the mouse buttons
+	void SetGamepadSpeed(float unitsPerSec);
+	float GetGamepadSpeed();
+
+	// Sends what changed since the last successful Publish(). Returns false if the mutex was busy.
+	bool Publish();
+	// Forgets what the host was sent, so the next Publish() writes everything (e.g. after GameLink::Init())
+	void Reset();
+
+	// Publishes rate_hz times per second from a thread. GameLink must be active, and stay so until Stop().
+	void Start(UINT rate_hz = 250);
+	// Stops and joins the thread. Call it before GameLink::Destroy().
+	void Stop();
+	bool IsRunning() const { return thread.joinable(); }
+
+	sStats GetStats();
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	void Run();
+	void NoteInput();
+	void TrackLatency();
+
+	enum : UINT { LATENCY_SAMPLES = 64 };
+	static constexpr float GAMEPAD_DEADZONE = 0.15f;
+
+	std::atomic<UINT> keys[8] = {};		// down now
+	std::atomic<UINT> latched[8] = {};	// went down since the last publish
+
+	// Everything below is under mutex (ours, not the host's)
+	std::mutex mutex;
+	float mouse_dx = 0.f;
+	float mouse_dy = 0.f;
+	UINT8 mouse_buttons = 0;
+	UINT8 gamepad_buttons = 0;
+	float gamepad_axis[2] = {};
+	float gamepad_speed = 400.f;
+	bool hasPendingInput = false;
+	Clock::time_point firstInput;		// of what the next publish sends
+	sStats stats;
+	double latency_samples[LATENCY_SAMPLES] = {};
+	UINT latency_count = 0;
+
+	// The publishing thread's
+	UINT published[8] = {};
+	UINT8 published_buttons = 0;
+	bool publishedAll = false;
+	Clock::time_point lastPublish;
+	bool awaitingFrame = false;
+	Clock::time_point awaitingSince;	// first input not seen in a frame yet
+	UINT16 awaitingSeq = 0;
+
+	std::thread thread;
+	std::atomic<bool> quit = false;
+	UINT rate_hz = 250;
+};
@@ -0,0 +1,258 @@
+#include "LatencyTracer.h"
+#include "SDHRDecoder.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+static UINT64 Microseconds(LatencyTracer::Clock::duration d)
+{
+	return (UINT64)std::max<long long>(0, std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+}
+
+//------------------------------------------------------------------------------
+// Methods
+//------------------------------------------------------------------------------
+
+void LatencyTracer::sHistogram::Add(UINT64 us)
+{
+	UINT bucket;
+	if (us < EXACT_BUCKETS)
+	{
+		bucket = (UINT)us;
+	}
+	else
+	{
+		// The top bit picks the octave, the 3 bits below it the bucket within it
+		const UINT msb = std::min((UINT)std::bit_width(us) - 1, 35u);
+		const UINT sub = (UINT)(std::min(us, (UINT64(1) << 36) - 1) >> (msb - 3)) & 7;
+		bucket = EXACT_BUCKETS + (msb - 4) * 8 + sub;
+	}
+	++buckets[bucket];
+	++count;
+	max_us = std::max(max_us, us);
+}
+
+double LatencyTracer::sHistogram::PercentileMs(double fraction) const
+{
+	if (count == 0)
+		return 0.0;
+	const UINT64 target = std::max<UINT64>(1, (UINT64)std::ceil(fraction * count));
+	UINT64 seen = 0;
+	for (UINT bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+	{
+		seen += buckets[bucket];
+		if (seen < target)
+			continue;
+		UINT64 upper = bucket;
+		if (bucket >= EXACT_BUCKETS)
+		{
+			const UINT shift = (bucket - EXACT_BUCKETS) / 8 + 1;
+			const UINT sub = (bucket - EXACT_BUCKETS) % 8;
+			upper = ((UINT64)(8 + sub + 1) << shift) - 1;
+		}
+		return std::min(upper, max_us) / 1000.0;
+	}
+	return max_us / 1000.0;
+}
+
+void LatencyTracer::Start(UINT pollUs)
+{
+	if (IsRunning())
+		return;
+	poll_us = std::max(1u, pollUs);
+	quit = false;
+	thread = std::thread(&LatencyTracer::Run, this);
+}
+
+void LatencyTracer::Stop()
+{
+	if (!IsRunning())
+		return;
+	quit = true;
+	thread.join();
+	std::lock_guard<std::mutex> lock(mutex);
+	d_inFlight.clear();
+}
+
+void LatencyTracer::RecordPublish(UINT32 type_mask, Clock::time_point publish_time)
+{
+	if (!IsRunning())
+		return;
+	sTrace trace = sTrace();
+	trace.type_mask = type_mask;
+	trace.publish = publish_time;
+	trace.sent = Clock::now();
+	trace.message = GameLink::GetMessagesSent();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	// The host isn't taking anything: stop growing
+	if (d_inFlight.size() >= MAX_IN_FLIGHT)
+	{
+		d_inFlight.pop_front();
+		++timed_out;
+	}
+	d_inFlight.push_back(trace);
+}
+
+void LatencyTracer::Poll()
+{
+	// Read the host's progress once, so every batch is judged against the same state
+	const UINT64 taken = GameLink::GetMessagesTaken();
+	const UINT16 seq = GameLink::GetFrameSequence();
+	const bool isFrameDone = !GameLink::IsFrameBeingWritten();
+	const auto now = Clock::now();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto it = d_inFlight.begin(); it != d_inFlight.end(); )
+	{
+		if (!it->isDrained)
+		{
+			// The host takes messages in order: the later batches aren't taken either
+			if (taken < it->message)
+				break;
+			it->isDrained = true;
+			it->drained = now;
+			it->drained_seq = seq;
+		}
+		if (seq != it->drained_seq && isFrameDone)
+		{
+			Add(*it, now);
+			it = d_inFlight.erase(it);
+		}
+		else if (now - it->drained > std::chrono::milliseconds(TIMEOUT_MS))
+		{
+			++timed_out;
+			it = d_inFlight.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+	// Nor those the host never takes
+	while (!d_inFlight.empty() && !d_inFlight.front().isDrained
+		&& now - d_inFlight.front().sent > std::chrono::milliseconds(TIMEOUT_MS))
+	{
+		++timed_out;
+		d_inFlight.pop_front();
+	}
+}
+
+// With mutex held
+void LatencyTracer::Add(const sTrace& trace, Clock::time_point shown)
+{
+	const UINT64 us[PHASE_COUNT] = {
+		Microseconds(trace.sent - trace.publish),
+		Microseconds(trace.drained - trace.sent),
+		Microseconds(shown - trace.drained),
+		Microseconds(shown - trace.publish),
+	};
+	const UINT32 mask = trace.type_mask | 1;	// bit 0 (NONE) is all batches
+	for (UINT type = 0; type < TYPE_COUNT; ++type)
+	{
+		if ((mask & (1u << type)) == 0)
+			continue;
+		for (UINT phase = 0; phase < PHASE_COUNT; ++phase)
+			Histogram(type, (Phase)phase).Add(us[phase]);
+	}
+	++traced;
+}
+
+void LatencyTracer::Clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::fill(v_histograms.begin(), v_histograms.end(), sHistogram());
+	traced = 0;
+	timed_out = 0;
+}
+
+std::vector<LatencyTracer::sSummary> LatencyTracer::GetSummary()
+{
+	std::vector<sSummary> v_rows;
+	std::lock_guard<std::mutex> lock(mutex);
+	for (UINT type = 0; type < TYPE_COUNT; ++type)
+	{
+		if (Histogram(type, Phase::TOTAL).count == 0)
+			continue;
+		for (UINT phase = 0; phase < PHASE_COUNT; ++phase)
+		{
+			const sHistogram& h = Histogram(type, (Phase)phase);
+			v_rows.push_back({ (SDHR_CMD)type, (Phase)phase, h.count,
+				h.PercentileMs(0.50), h.PercentileMs(0.99), h.max_us / 1000.0 });
+		}
+	}
+	return v_rows;
+}
+
+bool LatencyTracer::ExportCSV(const std::string& path)
+{
+	std::ofstream out(path, std::ios::out | std::ios::trunc);
+	if (!out)
+	{
+		fprintf(stderr, "Can't write the latency CSV to %s\n", path.c_str());
+		return false;
+	}
+	out << "type,phase,count,p50_ms,p99_ms,max_ms\n";
+	char line[160];
+	for (auto const& row : GetSummary())
+	{
+		snprintf(line, sizeof(line), "%s,%s,%llu,%.3f,%.3f,%.3f\n", GetTypeName(row.type), GetPhaseName(row.phase),
+			(unsigned long long)row.count, row.p50_ms, row.p99_ms, row.max_ms);
+		out << line;
+	}
+	return (bool)out;
+}
+
+UINT64 LatencyTracer::GetTracedCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return traced;
+}
+
+UINT64 LatencyTracer::GetTimedOutCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return timed_out;
+}
+
+size_t LatencyTracer::GetInFlightCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return d_inFlight.size();
+}
+
+const char* LatencyTracer::GetTypeName(SDHR_CMD type)
+{
+	if (type == SDHR_CMD::NONE)
+		return "all";
+	return SDHRStreamDecoder::GetCommandName(type);
+}
+
+const char* LatencyTracer::GetPhaseName(Phase phase)
+{
+	switch (phase)
+	{
+	case Phase::WRITE: return "write";
+	case Phase::DRAIN: return "drain";
+	case Phase::FRAME: return "frame";
+	case Phase::TOTAL: return "total";
+	default: return "unknown";
+	}
+}
+
+void LatencyTracer::Run()
+{
+	const auto period = std::chrono::microseconds(poll_us);
+	while (!quit)
+	{
+		Poll();
+		std::this_thread::sleep_for(period);
+	}
+}
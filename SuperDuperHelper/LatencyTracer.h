@@ -0,0 +1,106 @@
+#pragma once
+
+#include "GameLink.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief LatencyTracer
+ * Times SDHR batches from SDHRCommandBatcher::Publish() until the host shows them, in three phases:
+ * - write: from Publish() being called until the last message of the batch is handed to the host
+ * - drain: until the host takes that message out of buf_tohost or the command ring
+ * - frame: until the first frame.seq advance after that
+ * A thread watches the batches in flight, so the drain and frame times are as precise as its poll period.
+ * Each batch counts in the histogram of every command type it holds, and in the one of all batches.
+ * Histograms have 8 buckets per octave of microseconds: percentiles are within 12.5%, the max is exact.
+*/
+class LatencyTracer
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	enum class Phase : UINT { WRITE, DRAIN, FRAME, TOTAL, COUNT };
+
+	struct sSummary
+	{
+		SDHR_CMD type;		// NONE for all batches
+		Phase phase;
+		UINT64 count;
+		double p50_ms;
+		double p99_ms;
+		double max_ms;
+	};
+
+	~LatencyTracer() { Stop(); }
+
+	// Watches the batches from a thread, every poll_us microseconds.
+	// GameLink must be active, and stay so until Stop().
+	void Start(UINT poll_us = 250);
+	// Stops and joins the thread, forgetting the batches still in flight. Call it before GameLink::Destroy().
+	void Stop();
+	bool IsRunning() const { return thread.joinable(); }
+
+	// SDHRCommandBatcher::Publish() calls this once the whole batch is handed to the host.
+	// type_mask has bit n set for each SDHR_CMD n in the batch. Ignored unless running.
+	void RecordPublish(UINT32 type_mask, Clock::time_point publish_time);
+
+	void Clear();
+	// p50/p99/max of every phase, for all batches then for each command type that was sent
+	std::vector<sSummary> GetSummary();
+	// Writes GetSummary() as CSV. Returns false if the file can't be written.
+	bool ExportCSV(const std::string& path);
+	UINT64 GetTracedCount();
+	UINT64 GetTimedOutCount();	// batches the host didn't show within TIMEOUT_MS, e.g. while paused
+	size_t GetInFlightCount();
+
+	static const char* GetTypeName(SDHR_CMD type);
+	static const char* GetPhaseName(Phase phase);
+
+private:
+	enum : UINT { TYPE_COUNT = 32, PHASE_COUNT = (UINT)Phase::COUNT };	// types by SDHR_CMD value, NONE is all batches
+	enum : UINT { EXACT_BUCKETS = 16, BUCKET_COUNT = EXACT_BUCKETS + 32 * 8 };
+	enum : UINT { MAX_IN_FLIGHT = 1024, TIMEOUT_MS = 2000 };
+
+	struct sHistogram
+	{
+		UINT64 buckets[BUCKET_COUNT];
+		UINT64 count;
+		UINT64 max_us;
+
+		void Add(UINT64 us);
+		double PercentileMs(double fraction) const;
+	};
+
+	struct sTrace
+	{
+		UINT32 type_mask;
+		Clock::time_point publish;
+		Clock::time_point sent;
+		Clock::time_point drained;
+		UINT64 message;		// GameLink::GetMessagesSent() after the batch
+		UINT16 drained_seq;	// frame.seq when the host took the batch
+		bool isDrained;
+	};
+
+	void Run();
+	void Poll();
+	void Add(const sTrace& trace, Clock::time_point shown);
+	sHistogram& Histogram(UINT type, Phase phase) { return v_histograms[type * PHASE_COUNT + (UINT)phase]; }
+
+	// Everything below is under mutex, except the thread's
+	std::mutex mutex;
+	std::deque<sTrace> d_inFlight;
+	std::vector<sHistogram> v_histograms = std::vector<sHistogram>(TYPE_COUNT * PHASE_COUNT);
+	UINT64 traced = 0;
+	UINT64 timed_out = 0;
+
+	std::thread thread;
+	std::atomic<bool> quit = false;
+	UINT poll_us = 250;
+};
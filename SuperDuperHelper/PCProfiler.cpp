@@ -0,0 +1,126 @@
+#include "PCProfiler.h"
+
+#include <algorithm>
+#include <chrono>
+
+using Clock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+template <typename T>
+static std::vector<PCProfiler::sHotspot> TopEntries(const std::vector<T>& v_counts, UINT shift, size_t count)
+{
+	std::vector<PCProfiler::sHotspot> v_top;
+	for (size_t i = 0; i < v_counts.size(); ++i)
+	{
+		if (v_counts[i])
+			v_top.push_back({ (UINT16)(i << shift), (UINT64)v_counts[i] });
+	}
+	count = std::min(count, v_top.size());
+	std::partial_sort(v_top.begin(), v_top.begin() + count, v_top.end(),
+		[](const PCProfiler::sHotspot& a, const PCProfiler::sHotspot& b) { return a.samples > b.samples; });
+	v_top.resize(count);
+	return v_top;
+}
+
+//------------------------------------------------------------------------------
+// Methods
+//------------------------------------------------------------------------------
+
+void PCProfiler::Start(UINT samplesPerSec)
+{
+	if (IsRunning())
+		return;
+	samples_per_sec = std::max(1u, samplesPerSec);
+	quit = false;
+	thread = std::thread(&PCProfiler::Run, this);
+}
+
+void PCProfiler::Stop()
+{
+	if (!IsRunning())
+		return;
+	quit = true;
+	thread.join();
+}
+
+void PCProfiler::Update()
+{
+	const UINT32 end = head.load(std::memory_order_acquire);
+	UINT32 t = tail.load(std::memory_order_relaxed);
+	const UINT32 count = end - t;
+	for (; t != end; ++t)
+	{
+		const UINT16 pc = v_ring[t & RING_MASK];
+		++v_histogram[pc];
+		++v_pages[pc >> 8];
+	}
+	tail.store(t, std::memory_order_release);
+	samples += count;
+
+	rate_samples += count;
+	const double now = std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+	if (now - rate_time >= 1.0)
+	{
+		sample_rate = (rate_time > 0.0) ? rate_samples / (now - rate_time) : 0.0;
+		rate_samples = 0;
+		rate_time = now;
+	}
+}
+
+void PCProfiler::Clear()
+{
+	std::fill(v_histogram.begin(), v_histogram.end(), 0);
+	std::fill(v_pages.begin(), v_pages.end(), 0);
+	samples = 0;
+}
+
+std::vector<PCProfiler::sHotspot> PCProfiler::GetTopAddresses(size_t count) const
+{
+	return TopEntries(v_histogram, 0, count);
+}
+
+std::vector<PCProfiler::sHotspot> PCProfiler::GetHotPages(size_t count) const
+{
+	return TopEntries(v_pages, 8, count);
+}
+
+void PCProfiler::Run()
+{
+	const auto period = std::chrono::nanoseconds(1000000000LL / samples_per_sec);
+	auto next = Clock::now();
+	while (!quit)
+	{
+		UINT16 pc;
+		if (GameLink::GetProgramCounter(&pc))
+		{
+			const UINT32 h = head.load(std::memory_order_relaxed);
+			if (h - tail.load(std::memory_order_acquire) < RING_SIZE)
+			{
+				v_ring[h & RING_MASK] = pc;
+				head.store(h + 1, std::memory_order_release);
+			}
+			else
+			{
+				dropped.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		// Keep the rate, but don't burst to catch up after a stall
+		next += period;
+		auto now = Clock::now();
+		if (now - next > 10 * period)
+			next = now;
+#ifdef _WIN32
+		// Windows sleeps a millisecond at least: sleep the bulk, then yield until it's time
+		if (next - now > std::chrono::milliseconds(2))
+			std::this_thread::sleep_for(next - now - std::chrono::milliseconds(1));
+		while (Clock::now() < next && !quit)
+			std::this_thread::yield();
+#else
+		std::this_thread::sleep_until(next);
+#endif
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "GameLink.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief PCProfiler
+ * Sampling profiler of the emulated 6502: a background thread reads the program counter from the
+ * GameLink peek table at a fixed rate and pushes it into a lock-free ring. The UI thread drains the
+ * ring into a histogram of the 64K addresses, from which the hottest addresses and pages are taken.
+ * Samples are only as fresh as the host's peek table, which AppleWin refreshes as it runs.
+*/
+class PCProfiler
+{
+public:
+	struct sHotspot
+	{
+		UINT16 address;		// first address of the page for GetHotPages()
+		UINT64 samples;
+	};
+
+	~PCProfiler() { Stop(); }
+
+	// Starts the sampling thread. GameLink must be active, and stay so until Stop().
+	void Start(UINT samples_per_sec = 10000);
+	// Stops and joins the sampling thread. Call it before GameLink::Destroy().
+	void Stop();
+	bool IsRunning() const { return thread.joinable(); }
+
+	// Moves the samples from the ring into the histogram. Call it from the UI thread, e.g. every frame.
+	void Update();
+	// Forgets the histogram
+	void Clear();
+
+	// The addresses, or 256-byte pages, with the most samples, most first
+	std::vector<sHotspot> GetTopAddresses(size_t count) const;
+	std::vector<sHotspot> GetHotPages(size_t count) const;
+
+	UINT64 GetSampleCount() const { return samples; }
+	UINT64 GetDroppedCount() const { return dropped.load(std::memory_order_relaxed); }
+	// Samples per second that actually reached the histogram, over the last second
+	double GetSampleRate() const { return sample_rate; }
+
+private:
+	void Run();
+
+	// Single producer (the sampling thread), single consumer (Update())
+	enum : UINT32 { RING_SIZE = 1 << 16, RING_MASK = RING_SIZE - 1 };
+	std::vector<UINT16> v_ring = std::vector<UINT16>(RING_SIZE);
+	std::atomic<UINT32> head = 0;	// next slot written
+	std::atomic<UINT32> tail = 0;	// next slot read
+
+	std::vector<UINT32> v_histogram = std::vector<UINT32>(0x10000);
+	std::vector<UINT64> v_pages = std::vector<UINT64>(0x100);
+	UINT64 samples = 0;
+	UINT64 rate_samples = 0;
+	double rate_time = 0.0;
+	double sample_rate = 0.0;
+
+	std::thread thread;
+	std::atomic<bool> quit = false;
+	std::atomic<UINT64> dropped = 0;	// ring full
+	UINT samples_per_sec = 10000;
+};
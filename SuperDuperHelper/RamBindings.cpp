@@ -0,0 +1,258 @@
+#include "RamBindings.h"
+#include "SDHRCommand.h"
+#include "ini.h"
+
+#include <cstdio>
+
+//------------------------------------------------------------------------------
+// Local data
+//------------------------------------------------------------------------------
+
+// SDHR windows the host has
+constexpr int64_t SDHR_WINDOW_COUNT = 16;
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+// Parses the key's value, "$1F", "0x1F" or "31". Throws std::invalid_argument(key) if it's not a number.
+static int64_t ParseNumber(const mINI::INIMap<std::string>& section, const std::string& key)
+{
+	std::string text = section.get(key);
+	if (!text.empty() && text[0] == '$')
+		text = "0x" + text.substr(1);
+	size_t used = 0;
+	int64_t value = 0;
+	try
+	{
+		value = std::stoll(text, &used, 0);
+	}
+	catch (const std::exception&)
+	{
+		throw std::invalid_argument(key);
+	}
+	if (used != text.size())
+		throw std::invalid_argument(key);
+	return value;
+}
+
+// Same, checked before the caller narrows it. Throws std::out_of_range(key) if it's not within [min, max].
+static int64_t ParseNumber(const mINI::INIMap<std::string>& section, const std::string& key, int64_t min, int64_t max)
+{
+	const int64_t value = ParseNumber(section, key);
+	if (value < min || value > max)
+		throw std::out_of_range(key);
+	return value;
+}
+
+static bool ParseOperand(const mINI::INIMap<std::string>& section, const std::string& prefix, RamBindings::sOperand* operand)
+{
+	if (!section.has(prefix + "_address"))
+		return false;
+	operand->address = (UINT32)ParseNumber(section, prefix + "_address", 0, UINT32_MAX);
+	if (section.has(prefix + "_bytes"))
+		operand->bytes = (UINT8)ParseNumber(section, prefix + "_bytes", 1, 4);
+	if (section.has(prefix + "_mask"))
+		operand->mask = (UINT32)ParseNumber(section, prefix + "_mask", 0, UINT32_MAX);
+	if (section.has(prefix + "_scale"))
+		operand->scale = ParseNumber(section, prefix + "_scale");
+	if (section.has(prefix + "_offset"))
+		operand->offset = ParseNumber(section, prefix + "_offset");
+	operand->used = true;
+	return true;
+}
+
+static int64_t Evaluate(const RamBindings::sOperand& operand, const UINT8* ram, UINT32 ram_size)
+{
+	UINT32 raw = 0;
+	for (UINT8 i = 0; i < operand.bytes && operand.address + i < ram_size; ++i)
+		raw |= (UINT32)ram[operand.address + i] << (8 * i);
+	return (int64_t)(raw & operand.mask) * operand.scale + operand.offset;
+}
+
+//------------------------------------------------------------------------------
+// Methods
+//------------------------------------------------------------------------------
+
+bool RamBindings::Load(const std::string& _filename)
+{
+	Clear();
+	filename = _filename;
+	mINI::INIFile file(filename);
+	mINI::INIStructure ini;
+	if (!file.read(ini))
+	{
+		fprintf(stderr, "RamBindings: can't read %s\n", filename.c_str());
+		return false;
+	}
+	for (auto const& it : ini)
+	{
+		sBinding binding;
+		binding.name = it.first;
+		auto const& section = it.second;
+		try
+		{
+			std::string action = section.get("action");
+			if (action == "window_view")
+				binding.action = Action::WindowView;
+			else if (action == "window_position")
+				binding.action = Action::WindowPosition;
+			else if (action == "window_enable")
+				binding.action = Action::WindowEnable;
+			else
+				throw std::invalid_argument("action");
+			binding.window_index = (int8_t)ParseNumber(section, "window", 0, SDHR_WINDOW_COUNT - 1);
+			if (binding.action == Action::WindowEnable)
+			{
+				if (!ParseOperand(section, "value", &binding.x))
+					throw std::invalid_argument("value_address");
+			}
+			else
+			{
+				// One of the coordinates may stay unbound, and then is 0 plus its offset
+				ParseOperand(section, "x", &binding.x);
+				ParseOperand(section, "y", &binding.y);
+				if (!binding.x.used && !binding.y.used)
+					throw std::invalid_argument("x_address");
+				if (!binding.x.used && section.has("x_offset"))
+					binding.x.offset = ParseNumber(section, "x_offset");
+				if (!binding.y.used && section.has("y_offset"))
+					binding.y.offset = ParseNumber(section, "y_offset");
+			}
+		}
+		catch (const std::exception& e)
+		{
+			fprintf(stderr, "RamBindings: %s: [%s] has a bad or missing %s, skipped\n", filename.c_str(), binding.name.c_str(), e.what());
+			continue;
+		}
+		v_bindings.push_back(binding);
+	}
+	WatchAll();
+	return true;
+}
+
+void RamBindings::Clear()
+{
+	watcher.UnwatchAll();
+	v_bindings.clear();
+	hasSeq = false;
+}
+
+void RamBindings::Reset()
+{
+	for (auto& binding : v_bindings)
+	{
+		binding.dirty = true;
+		binding.emitted = false;
+	}
+	hasSeq = false;
+}
+
+void RamBindings::WatchAll()
+{
+	watcher.UnwatchAll();
+	for (size_t i = 0; i < v_bindings.size(); ++i)
+	{
+		for (const sOperand* operand : { &v_bindings[i].x, &v_bindings[i].y })
+		{
+			if (!operand->used)
+				continue;
+			watcher.Watch(operand->address, operand->bytes, [this, i](UINT32, UINT32, const UINT8*) {
+				v_bindings[i].dirty = true;
+			});
+		}
+	}
+}
+
+bool RamBindings::Update()
+{
+	if (v_bindings.empty())
+		return false;
+	const UINT8* ram = GameLink::GetMemoryBasePointer();
+	if (ram == nullptr)
+		return false;
+	// Evaluate between frames, not halfway through one
+	UINT16 seq = GameLink::GetFrameSequence();
+	if ((hasSeq && seq == lastSeq) || GameLink::IsFrameBeingWritten())
+		return false;
+	hasSeq = true;
+	lastSeq = seq;
+	++stats.frames_evaluated;
+
+	const UINT32 ram_size = (UINT32)GameLink::GetMemorySize();
+	watcher.Poll(ram, ram_size);
+
+	// Saved to the bindings only once the host has them, so a failed publish is retried next frame
+	struct sPending
+	{
+		sBinding* binding;
+		int64_t x;
+		int64_t y;
+	};
+	std::vector<sPending> v_pending;
+	for (auto& binding : v_bindings)
+	{
+		if (!binding.dirty)
+			continue;
+		int64_t x = binding.x.used ? Evaluate(binding.x, ram, ram_size) : binding.x.offset;
+		int64_t y = binding.y.used ? Evaluate(binding.y, ram, ram_size) : binding.y.offset;
+		if (binding.emitted && x == binding.last_x && y == binding.last_y)
+		{
+			binding.dirty = false;	// the bytes changed, not the value
+			continue;
+		}
+		switch (binding.action)
+		{
+		case Action::WindowView:
+		{
+			const UpdateWindowAdjustWindowViewCmd cmd = { binding.window_index, x, y };
+			batcher.AddCommand(&cmd);
+			break;
+		}
+		case Action::WindowPosition:
+		{
+			const UpdateWindowSetWindowPositionCmd cmd = { binding.window_index, x, y };
+			batcher.AddCommand(&cmd);
+			break;
+		}
+		case Action::WindowEnable:
+		{
+			const UpdateWindowEnableCmd cmd = { binding.window_index, x != 0 };
+			batcher.AddCommand(&cmd);
+			break;
+		}
+		}
+		v_pending.push_back({ &binding, x, y });
+	}
+	if (v_pending.empty())
+		return false;
+	if (!batcher.Publish())
+	{
+		++stats.publish_failures;
+		return false;	// still dirty
+	}
+	for (const auto& pending : v_pending)
+	{
+		pending.binding->dirty = false;
+		pending.binding->last_x = pending.x;
+		pending.binding->last_y = pending.y;
+		pending.binding->emitted = true;
+	}
+	++stats.batches_published;
+	stats.commands_published += v_pending.size();
+	return true;
+}
+
+const char* RamBindings::GetActionName(Action action)
+{
+	switch (action)
+	{
+	case Action::WindowView:
+		return "window_view";
+	case Action::WindowPosition:
+		return "window_position";
+	case Action::WindowEnable:
+		return "window_enable";
+	}
+	return "";
+}
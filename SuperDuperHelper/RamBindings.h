@@ -0,0 +1,109 @@
+#pragma once
+
+#include "RamWatcher.h"
+#include "SDHRCommand.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief RamBindings
+ * Drives SDHR windows from the game state: each binding maps Apple II RAM locations to an SDHR command,
+ * for instance the player's X/Y bytes to UpdateWindowAdjustWindowViewCmd for window 0.
+ * Bindings are loaded from an ini file, one section per binding:
+ *
+ *   [player_view]
+ *   ; window_view, window_position or window_enable
+ *   action = window_view
+ *   ; 0 to 15
+ *   window = 0
+ *   ; $hex, 0xhex or decimal offset into the GameLink RAM
+ *   x_address = $0A2
+ *   ; optional: 1 to 4 bytes little-endian, and value = (RAM & mask) * scale + offset
+ *   x_bytes = 1
+ *   x_mask = 0xFF
+ *   x_scale = 16
+ *   x_offset = 0
+ *   y_address = $0A3
+ *   y_scale = 16
+ *
+ * window_view sets tile_xbegin/tile_ybegin from x/y, window_position sets screen_xbegin/screen_ybegin,
+ * and window_enable enables the window when "value" is nonzero.
+ * Update() evaluates the bindings once per emulator frame, and publishes one batch with the commands
+ * of the bindings whose values changed, nothing at all if none did.
+*/
+class RamBindings
+{
+public:
+	enum class Action
+	{
+		WindowView,
+		WindowPosition,
+		WindowEnable
+	};
+
+	struct sOperand
+	{
+		bool used = false;
+		UINT32 address = 0;
+		UINT8 bytes = 1;
+		UINT32 mask = 0xFFFFFFFF;
+		int64_t scale = 1;
+		int64_t offset = 0;
+	};
+
+	struct sBinding
+	{
+		std::string name;
+		Action action = Action::WindowView;
+		int8_t window_index = 0;
+		sOperand x;		// "value" for window_enable
+		sOperand y;
+		bool dirty = true;		// watched bytes changed since the last evaluation
+		bool emitted = false;	// last_x/last_y were sent
+		int64_t last_x = 0;
+		int64_t last_y = 0;
+	};
+
+	struct sStats
+	{
+		UINT64 frames_evaluated = 0;
+		UINT64 batches_published = 0;
+		UINT64 commands_published = 0;
+		UINT64 publish_failures = 0;	// batches retried on a later frame
+	};
+
+	RamBindings() = default;
+	RamBindings(const RamBindings&) = delete;
+	RamBindings& operator=(const RamBindings&) = delete;
+
+	// Replaces the bindings with the ones in the ini file. Invalid sections are reported and skipped.
+	// Returns false if the file couldn't be read.
+	bool Load(const std::string& filename);
+	void Clear();
+
+	// Call every UI frame with GameLink active and SDHR on. Does nothing unless frame.seq moved.
+	// Returns true if a batch was published. If publishing fails, the changed bindings are sent again next frame.
+	bool Update();
+	// Forgets what was sent, so the next Update() sends every binding again (e.g. after an SDHR reset)
+	void Reset();
+
+	const std::vector<sBinding>& GetBindings() const { return v_bindings; }
+	const std::string& GetFilename() const { return filename; }
+	sStats GetStats() const { return stats; }
+	RamWatcher::sStats GetWatcherStats() const { return watcher.GetStats(); }
+
+	static const char* GetActionName(Action action);
+
+private:
+	void WatchAll();
+
+	std::vector<sBinding> v_bindings;
+	std::string filename;
+	RamWatcher watcher;
+	SDHRCommandBatcher batcher;
+	bool hasSeq = false;
+	UINT16 lastSeq = 0;
+	sStats stats;
+};
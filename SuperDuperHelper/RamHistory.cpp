@@ -0,0 +1,235 @@
+#include "RamHistory.h"
+
+#include <algorithm>
+#include <cstring>
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+static void PutVarint(std::vector<UINT8>& out, UINT32 value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back((UINT8)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((UINT8)value);
+}
+
+static bool GetVarint(const UINT8* data, size_t size, size_t* pos, UINT32* value)
+{
+	*value = 0;
+	for (UINT shift = 0; *pos < size && shift < 35; shift += 7)
+	{
+		UINT8 b = data[(*pos)++];
+		*value |= (UINT32)(b & 0x7F) << shift;
+		if ((b & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+// Appends cur XOR prev as runs of [unchanged count][changed count][changed bytes XORed]
+static void EncodeXorRle(const UINT8* prev, const UINT8* cur, UINT32 length, std::vector<UINT8>& out)
+{
+	UINT32 i = 0;
+	while (i < length)
+	{
+		// Unchanged bytes, 8 at a time while we can
+		const UINT32 unchanged = i;
+		for (; i + 8 <= length; i += 8)
+		{
+			UINT64 a, b;
+			memcpy(&a, prev + i, 8);
+			memcpy(&b, cur + i, 8);
+			if (a != b)
+				break;
+		}
+		while (i < length && prev[i] == cur[i])
+			++i;
+		PutVarint(out, i - unchanged);
+
+		// Changed bytes. Gaps of one or two unchanged bytes cost less kept in than as a new run.
+		const UINT32 changed = i;
+		while (i < length)
+		{
+			if (prev[i] != cur[i])
+			{
+				++i;
+				continue;
+			}
+			UINT32 j = i;
+			while (j < length && j - i < 3 && prev[j] == cur[j])
+				++j;
+			if (j - i >= 3 || j == length)
+				break;
+			i = j;
+		}
+		PutVarint(out, i - changed);
+		for (UINT32 k = changed; k < i; ++k)
+			out.push_back(prev[k] ^ cur[k]);
+	}
+}
+
+// XORs an EncodeXorRle() output into ram, turning the previous snapshot into the encoded one
+static void ApplyXorRle(const UINT8* data, size_t size, UINT8* ram, UINT32 length)
+{
+	size_t pos = 0;
+	UINT32 i = 0;
+	while (pos < size)
+	{
+		UINT32 unchanged, changed;
+		if (!GetVarint(data, size, &pos, &unchanged) || !GetVarint(data, size, &pos, &changed))
+			return;
+		i += unchanged;
+		if (changed > length - std::min(i, length) || changed > size - pos)
+			return;
+		for (UINT32 k = 0; k < changed; ++k)
+			ram[i++] ^= data[pos++];
+	}
+}
+
+//------------------------------------------------------------------------------
+// Methods
+//------------------------------------------------------------------------------
+
+bool RamHistory::Update()
+{
+	const UINT8* ram = GameLink::GetMemoryBasePointer();
+	if (ram == nullptr || GameLink::IsFrameBeingWritten())
+		return false;
+	UINT16 seq = GameLink::GetFrameSequence();
+	if (!hasSeq)
+	{
+		hasSeq = true;
+		nextFrame = frame;
+	}
+	else
+	{
+		frame += GameLink::GetFrameDistance(lastSeq, seq);
+	}
+	lastSeq = seq;
+	if (frame < nextFrame)
+		return false;
+
+	// The emulator keeps running: encode a copy, so the XOR base is exactly what was encoded
+	const UINT32 size = (UINT32)GameLink::GetMemorySize();
+	v_capture.assign(ram, ram + size);
+	Capture(v_capture.data(), size, frame);
+	nextFrame = frame + interval;
+	return true;
+}
+
+void RamHistory::Capture(const UINT8* ram, UINT32 size, UINT64 snapshotFrame)
+{
+	if (size != ram_size)
+	{
+		d_groups.clear();
+		count = 0;
+		encoded_bytes = 0;
+		first_serial = 0;
+		cache_serial = UINT64_MAX;
+		ram_size = size;
+	}
+
+	// Keyframes are the XOR with zeros
+	if (d_groups.empty() || d_groups.back().v_offsets.size() == GROUP_SIZE)
+	{
+		if (!d_groups.empty())
+			d_groups.back().v_data.shrink_to_fit();
+		d_groups.emplace_back();
+		v_last.assign(ram_size, 0);
+	}
+	sGroup& group = d_groups.back();
+	const size_t before = group.v_data.size();
+	group.v_offsets.push_back((UINT32)before);
+	group.v_frames.push_back(snapshotFrame);
+	EncodeXorRle(v_last.data(), ram, ram_size, group.v_data);
+	memcpy(v_last.data(), ram, ram_size);
+	encoded_bytes += group.v_data.size() - before;
+	++count;
+
+	// Over budget: drop the oldest group, keeping at least the one being filled
+	while (encoded_bytes > budget && d_groups.size() > 1)
+	{
+		const sGroup& oldest = d_groups.front();
+		encoded_bytes -= oldest.v_data.size();
+		count -= oldest.v_offsets.size();
+		first_serial += oldest.v_offsets.size();
+		d_groups.pop_front();
+	}
+}
+
+void RamHistory::Clear()
+{
+	d_groups.clear();
+	count = 0;
+	encoded_bytes = 0;
+	first_serial = 0;
+	cache_serial = UINT64_MAX;
+	hasSeq = false;
+	frame = 0;
+	nextFrame = 0;
+}
+
+RamHistory::sSnapshotInfo RamHistory::GetInfo(size_t index) const
+{
+	sSnapshotInfo info = sSnapshotInfo();
+	if (index >= count)
+		return info;
+	const sGroup& group = d_groups[index / GROUP_SIZE];
+	const size_t i = index % GROUP_SIZE;
+	info.frame = group.v_frames[i];
+	info.encoded_bytes = (UINT32)group.SnapshotBytes(i);
+	info.keyframe = (i == 0);
+	return info;
+}
+
+bool RamHistory::GetSnapshot(size_t index, std::vector<UINT8>& ram)
+{
+	if (index >= count)
+		return false;
+	// Groups are only dropped whole, so all but the newest are full
+	const sGroup& group = d_groups[index / GROUP_SIZE];
+	const size_t target = index % GROUP_SIZE;
+	const UINT64 groupSerial = first_serial + index - target;
+
+	// Carry on from the cached snapshot if it's an earlier one of the same group
+	size_t i = 0;
+	if (cache_serial != UINT64_MAX && cache_serial >= groupSerial && cache_serial <= groupSerial + target)
+		i = (size_t)(cache_serial - groupSerial) + 1;
+	else
+		v_cache.assign(ram_size, 0);
+	for (; i <= target; ++i)
+		ApplyXorRle(group.v_data.data() + group.v_offsets[i], group.SnapshotBytes(i), v_cache.data(), ram_size);
+	cache_serial = groupSerial + target;
+	ram = v_cache;
+	return true;
+}
+
+size_t RamHistory::Diff(size_t a, size_t b, std::vector<sDiff>& diffs, size_t max_diffs)
+{
+	diffs.clear();
+	std::vector<UINT8> v_a, v_b;
+	if (!GetSnapshot(a, v_a) || !GetSnapshot(b, v_b))
+		return 0;
+	size_t differing = 0;
+	UINT32 i = 0;
+	while (i < ram_size)
+	{
+		if (i + 8 <= ram_size && memcmp(&v_a[i], &v_b[i], 8) == 0)
+		{
+			i += 8;
+			continue;
+		}
+		if (v_a[i] != v_b[i])
+		{
+			if (diffs.size() < max_diffs)
+				diffs.push_back({ i, v_a[i], v_b[i] });
+			++differing;
+		}
+		++i;
+	}
+	return differing;
+}
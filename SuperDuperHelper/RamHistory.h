@@ -0,0 +1,89 @@
+#pragma once
+
+#include "GameLink.h"
+
+#include <deque>
+#include <vector>
+
+/**
+ * @brief RamHistory
+ * Records the emulated RAM every few emulator frames, to go back to any point and see what changed
+ * between two of them, e.g. to find which bytes hold the game state when writing RAM bindings.
+ * Each snapshot is stored as the XOR with the previous one, run-length encoded: frames that
+ * change a few hundred bytes cost about as many. Snapshots are grouped, and each group starts
+ * with a full (still encoded) snapshot so any one of them decodes without replaying the whole history.
+ * When the history goes over its byte budget, the oldest group is dropped.
+*/
+class RamHistory
+{
+public:
+	struct sSnapshotInfo
+	{
+		UINT64 frame;			// emulator frames since recording started
+		UINT32 encoded_bytes;
+		bool keyframe;
+	};
+
+	struct sDiff
+	{
+		UINT32 address;
+		UINT8 before;
+		UINT8 after;
+	};
+
+	// Snapshot every interval emulator frames
+	void SetInterval(UINT frames) { interval = frames ? frames : 1; }
+	UINT GetInterval() const { return interval; }
+	void SetBudget(size_t bytes) { budget = bytes; }
+	size_t GetBudget() const { return budget; }
+
+	// Call every UI frame while recording, with GameLink active.
+	// Returns true if a snapshot was taken.
+	bool Update();
+	// Adds a snapshot of any RAM image. A different ram_size than before starts a new history.
+	void Capture(const UINT8* ram, UINT32 ram_size, UINT64 frame);
+	void Clear();
+
+	size_t GetCount() const { return count; }
+	UINT32 GetRamSize() const { return ram_size; }
+	sSnapshotInfo GetInfo(size_t index) const;
+	// Decodes snapshot index (0 is the oldest) into ram. Stepping through neighbours is cheap.
+	bool GetSnapshot(size_t index, std::vector<UINT8>& ram);
+	// Fills diffs with up to max_diffs bytes that differ between snapshots a and b.
+	// Returns how many bytes differ in all.
+	size_t Diff(size_t a, size_t b, std::vector<sDiff>& diffs, size_t max_diffs);
+
+	size_t GetEncodedBytes() const { return encoded_bytes; }
+	UINT64 GetRawBytes() const { return (UINT64)count * ram_size; }
+
+private:
+	enum : UINT32 { GROUP_SIZE = 4096 };	// snapshots per group, the first is a keyframe
+
+	struct sGroup
+	{
+		std::vector<UINT8> v_data;		// encoded snapshots, back to back
+		std::vector<UINT32> v_offsets;	// of each snapshot in v_data
+		std::vector<UINT64> v_frames;
+
+		size_t SnapshotBytes(size_t i) const { return (i + 1 < v_offsets.size() ? v_offsets[i + 1] : v_data.size()) - v_offsets[i]; }
+	};
+
+	std::deque<sGroup> d_groups;
+	size_t count = 0;
+	size_t encoded_bytes = 0;
+	UINT32 ram_size = 0;
+	std::vector<UINT8> v_last;		// newest snapshot, what the next one is XORed with
+	std::vector<UINT8> v_capture;
+
+	// Last snapshot decoded by GetSnapshot(), numbered from the start of the recording
+	std::vector<UINT8> v_cache;
+	UINT64 cache_serial = UINT64_MAX;
+	UINT64 first_serial = 0;	// of d_groups.front()'s keyframe
+
+	UINT interval = 1;
+	size_t budget = 64 * 1024 * 1024;
+	bool hasSeq = false;
+	UINT16 lastSeq = 0;
+	UINT64 frame = 0;
+	UINT64 nextFrame = 0;
+};
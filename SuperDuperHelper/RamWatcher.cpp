@@ -0,0 +1,295 @@
+#include "RamWatcher.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RAMWATCHER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAMWATCHER_SSE2
+#endif
+
+// GCC and Clang only emit AVX2 in functions marked for it. MSVC always does.
+#if defined(__GNUC__) || defined(__clang__)
+#define RAMWATCHER_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define RAMWATCHER_TARGET_AVX2
+#endif
+
+//------------------------------------------------------------------------------
+// Local data
+//------------------------------------------------------------------------------
+
+// Changes closer than this many unchanged bytes are reported as one span
+constexpr UINT32 RAM_WATCH_MERGE_GAP = 4;
+
+struct sSpan
+{
+	UINT32 offset;
+	UINT32 length;
+};
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+// Adds the bytes set in mask (bit i = byte base + i differs) to the spans
+static void AddChangedBytes(UINT64 mask, UINT32 base, std::vector<sSpan>& v_spans)
+{
+	while (mask)
+	{
+		// Find the next run of set bits
+#if defined(_MSC_VER) && !defined(__clang__)
+		unsigned long first;
+		_BitScanForward64(&first, mask);
+		UINT64 shifted = ~(mask >> first);
+		unsigned long run = 64 - first;
+		if (shifted)
+		{
+			_BitScanForward64(&run, shifted);
+		}
+#else
+		unsigned first = (unsigned)__builtin_ctzll(mask);
+		UINT64 shifted = ~(mask >> first);
+		unsigned run = shifted ? (unsigned)__builtin_ctzll(shifted) : 64 - first;
+#endif
+		const UINT32 offset = base + first;
+		if (!v_spans.empty() && offset - (v_spans.back().offset + v_spans.back().length) <= RAM_WATCH_MERGE_GAP)
+			v_spans.back().length = offset + run - v_spans.back().offset;
+		else
+			v_spans.push_back({ offset, (UINT32)run });
+		mask = (first + run >= 64) ? 0 : (mask & ~((((UINT64)1 << (first + run)) - 1)));
+	}
+}
+
+// Finds the bytes of a that differ from b in [from, length), 8 at a time
+static void FindChangesScalar(const UINT8* a, const UINT8* b, UINT32 from, UINT32 length, std::vector<sSpan>& v_spans)
+{
+	UINT32 i = from;
+	for (; i + 8 <= length; i += 8)
+	{
+		UINT64 wa, wb;
+		memcpy(&wa, a + i, 8);
+		memcpy(&wb, b + i, 8);
+		if (wa == wb)
+			continue;
+		UINT64 mask = 0;
+		for (UINT32 j = 0; j < 8; ++j)
+		{
+			if (a[i + j] != b[i + j])
+				mask |= (UINT64)1 << j;
+		}
+		AddChangedBytes(mask, i, v_spans);
+	}
+	UINT64 mask = 0;
+	for (UINT32 j = 0; i + j < length; ++j)
+	{
+		if (a[i + j] != b[i + j])
+			mask |= (UINT64)1 << j;
+	}
+	AddChangedBytes(mask, i, v_spans);
+}
+
+#ifdef RAMWATCHER_SSE2
+static void FindChangesSSE2(const UINT8* a, const UINT8* b, UINT32 length, std::vector<sSpan>& v_spans)
+{
+	UINT32 i = 0;
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+		UINT32 mask = ~(UINT32)_mm_movemask_epi8(eq) & 0xFFFF;
+		if (mask)
+			AddChangedBytes(mask, i, v_spans);
+	}
+	FindChangesScalar(a, b, i, length, v_spans);
+}
+#endif
+
+#ifdef RAMWATCHER_X86
+RAMWATCHER_TARGET_AVX2
+static void FindChangesAVX2(const UINT8* a, const UINT8* b, UINT32 length, std::vector<sSpan>& v_spans)
+{
+	UINT32 i = 0;
+	for (; i + 64 <= length; i += 64)
+	{
+		__m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+		__m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i + 32)), _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+		UINT64 mask = ~(((UINT64)(UINT32)_mm256_movemask_epi8(eq1) << 32) | (UINT32)_mm256_movemask_epi8(eq0));
+		if (mask)
+			AddChangedBytes(mask, i, v_spans);
+	}
+	FindChangesScalar(a, b, i, length, v_spans);
+}
+
+static bool CpuHasAVX2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	// The OS must save the YMM registers too
+	if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+typedef void (*FindChangesFunc)(const UINT8* a, const UINT8* b, UINT32 length, std::vector<sSpan>& v_spans);
+
+#ifndef RAMWATCHER_SSE2
+static void FindChangesPortable(const UINT8* a, const UINT8* b, UINT32 length, std::vector<sSpan>& v_spans)
+{
+	FindChangesScalar(a, b, 0, length, v_spans);
+}
+#endif
+
+static FindChangesFunc SelectFindChanges(const char** name)
+{
+#ifdef RAMWATCHER_X86
+	if (CpuHasAVX2())
+	{
+		*name = "AVX2";
+		return FindChangesAVX2;
+	}
+#endif
+#ifdef RAMWATCHER_SSE2
+	*name = "SSE2";
+	return FindChangesSSE2;
+#else
+	*name = "scalar";
+	return FindChangesPortable;
+#endif
+}
+
+static const char* g_findChangesName = "";
+static const FindChangesFunc g_findChanges = SelectFindChanges(&g_findChangesName);
+
+//------------------------------------------------------------------------------
+// Methods
+//------------------------------------------------------------------------------
+
+RamWatcher::WatchId RamWatcher::Watch(UINT32 address, UINT32 length, Callback callback)
+{
+	sWatch watch;
+	watch.id = nextId++;
+	watch.address = address;
+	watch.length = length;
+	watch.callback = std::move(callback);
+	v_watches.push_back(std::move(watch));
+	return v_watches.back().id;
+}
+
+void RamWatcher::Unwatch(WatchId id)
+{
+	// Poll() may be in a callback of it: only flag it, so the watch and its snapshot stay put
+	for (auto& watch : v_watches)
+	{
+		if (watch.id == id)
+			watch.isRemoved = true;
+	}
+	if (!isPolling)
+		EraseRemoved();
+}
+
+void RamWatcher::UnwatchAll()
+{
+	for (auto& watch : v_watches)
+		watch.isRemoved = true;
+	if (!isPolling)
+		EraseRemoved();
+}
+
+void RamWatcher::EraseRemoved()
+{
+	v_watches.erase(std::remove_if(v_watches.begin(), v_watches.end(),
+		[](const sWatch& watch) { return watch.isRemoved; }), v_watches.end());
+}
+
+size_t RamWatcher::Poll()
+{
+	const UINT8* ram = GameLink::GetMemoryBasePointer();
+	if (ram == nullptr)
+		return 0;
+	return Poll(ram, (UINT32)GameLink::GetMemorySize());
+}
+
+size_t RamWatcher::Poll(const UINT8* ram, UINT32 ram_size)
+{
+	assert(!isPolling && "RamWatcher::Poll() called from one of its callbacks");
+	if (isPolling)
+		return 0;
+	isPolling = true;
+	++stats.polls;
+	size_t reported = 0;
+	std::vector<sSpan> v_spans;
+	// By index: a callback may add watches, which moves them. Those are left for the next Poll().
+	const size_t count = v_watches.size();
+	for (size_t i = 0; i < count; ++i)
+	{
+		sWatch& watch = v_watches[i];
+		if (watch.isRemoved || watch.address >= ram_size)
+			continue;
+		const UINT32 length = std::min(watch.length, ram_size - watch.address);
+		const UINT8* live = ram + watch.address;
+
+		v_spans.clear();
+		if (watch.v_snapshot.size() != length)
+		{
+			// First time, everything is news
+			watch.v_snapshot.resize(length);
+			v_spans.push_back({ 0, length });
+		}
+		else
+		{
+			g_findChanges(live, watch.v_snapshot.data(), length, v_spans);
+			stats.bytes_compared += length;
+		}
+
+		// The emulator keeps writing the RAM: report the bytes from the snapshot, so the callback
+		// sees what the snapshot will be compared against next time.
+		// All of them first, as the callbacks may unwatch this range.
+		UINT8* snapshot = watch.v_snapshot.data();
+		for (auto& span : v_spans)
+		{
+			span.length = std::min(span.length, length - span.offset);
+			memcpy(snapshot + span.offset, live + span.offset, span.length);
+			stats.bytes_reported += span.length;
+		}
+		stats.spans_reported += v_spans.size();
+		reported += v_spans.size();
+
+		if (v_spans.empty() || !watch.callback)
+			continue;
+		// A copy, as the callback may move v_watches (by adding one) with itself in it. The snapshot's
+		// bytes don't move: watches are only erased after the loop.
+		const Callback callback = watch.callback;
+		const UINT32 address = watch.address;
+		for (const auto& span : v_spans)
+		{
+			if (v_watches[i].isRemoved)
+				break;
+			callback(address + span.offset, span.length, snapshot + span.offset);
+		}
+	}
+	isPolling = false;
+	EraseRemoved();
+	return reported;
+}
+
+const char* RamWatcher::GetImplementationName()
+{
+	return g_findChangesName;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "GameLink.h"
+
+#include <functional>
+#include <vector>
+
+/**
+ * @brief RamWatcher
+ * Watches ranges of the emulated Apple II RAM (GameLink::GetMemoryBasePointer()) and, on each Poll(),
+ * reports the parts that changed since the previous one to the range's callback.
+ * The comparison against the snapshot runs 32 bytes at a time with AVX2 when the CPU has it,
+ * 16 with SSE2, and 8 otherwise, so unchanged memory costs next to nothing.
+*/
+class RamWatcher
+{
+public:
+	typedef int WatchId;
+
+	// Called for each changed span of a watched range, with the span's new bytes.
+	// The first Poll() after Watch() reports the whole range.
+	// It may call Watch(), Unwatch() and UnwatchAll(): ranges watched from a callback are first
+	// reported by the next Poll(), and an unwatched range gets no more callbacks. Not Poll() though.
+	using Callback = std::function<void(UINT32 address, UINT32 length, const UINT8* data)>;
+
+	struct sStats
+	{
+		UINT64 polls = 0;
+		UINT64 bytes_compared = 0;
+		UINT64 spans_reported = 0;
+		UINT64 bytes_reported = 0;
+	};
+
+	// Returns the id to unwatch it with
+	WatchId Watch(UINT32 address, UINT32 length, Callback callback);
+	void Unwatch(WatchId id);
+	void UnwatchAll();
+
+	// Compares the watched ranges with the live RAM. Returns how many spans were reported.
+	size_t Poll();
+	// Same, with any memory image. Ranges past ram_size are clipped.
+	size_t Poll(const UINT8* ram, UINT32 ram_size);
+
+	sStats GetStats() const { return stats; }
+	// Name of the compare implementation in use: "AVX2", "SSE2" or "scalar"
+	static const char* GetImplementationName();
+
+private:
+	struct sWatch
+	{
+		WatchId id;
+		UINT32 address;
+		UINT32 length;
+		Callback callback;
+		std::vector<UINT8> v_snapshot;	// empty until the first Poll()
+		bool isRemoved = false;			// unwatched during Poll(), erased at its end
+	};
+
+	void EraseRemoved();
+
+	std::vector<sWatch> v_watches;
+	WatchId nextId = 1;
+	bool isPolling = false;
+	sStats stats;
+};
@@ -1,186 +1,302 @@
 #include "SDHRCommand.h"
 #include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 
 
 /* End SHDR Command Structures */
 
-void SDHRCommandBatcher::Publish()
+static sSDHRBatcherStats g_stats;
+static SDHRBatchSink* g_sink;
+static SDHRCommandBatcher::PublishCallback g_publishCallback;
+
+// Largest encoded command: its size header is a uint16 that doesn't count the id byte
+constexpr size_t SDHR_MAX_COMMAND_WIRE_SIZE = 2 + 1 + UINT16_MAX;
+
+// The host reads the fields byte for byte as they are in the packed structs: catch a layout change
+static_assert(SDHRFixedWireSize<UpdateWindowEnableCmd>() == 3 + 2, "UpdateWindowEnableCmd changed size");
+static_assert(SDHRFixedWireSize<UpdateWindowAdjustWindowViewCmd>() == 3 + 17, "UpdateWindowAdjustWindowViewCmd changed size");
+static_assert(SDHRFixedWireSize<DefineWindowCmd>() == 3 + 82, "DefineWindowCmd changed size");
+static_assert(SDHRFieldsLength<UpdateWindowSetBothCmd>() == 33, "UpdateWindowSetBothCmd changed size");
+static_assert(SDHRFieldsLength<UpdateWindowSingleTilesetCmd>() == 34, "UpdateWindowSingleTilesetCmd changed size");
+
+// Splits an UpdateWindow command with per-tile data (TCmd) that is too large to encode
+// within maxWireSize bytes into bands of whole tile rows that fit.
+// fields points to the command's fields in the arena. store(bytes, length) copies the fields of
+// each band to the arena (which may move it) and returns their offset. The bands' data is
+// the original tile data.
+// Returns false if even a single row doesn't fit.
+template <typename TCmd, typename TRef, typename FStore>
+static bool SplitTileRows(const TRef& ref, const uint8_t* fields, size_t bytesPerTile, size_t maxWireSize,
+	FStore store, std::vector<TRef>& v_out)
+{
+	// fields are TCmd without its data pointer. Commands encoded as SDHRCommand objects
+	// have their tile data in the fields too.
+	constexpr size_t fieldsLength = SDHRFieldsLength<TCmd>();
+	if (ref.fields_length < fieldsLength)
+		return false;
+	TCmd band;
+	memcpy(&band, fields, fieldsLength);
+	const size_t tiles = (ref.data_length > 0) ? ref.data : ref.fields + fieldsLength;
+	const size_t rowSize = (size_t)band.tile_xcount * bytesPerTile;
+	if (rowSize == 0 || 3 + fieldsLength + rowSize > maxWireSize)
+		return false;
+
+	const uint64_t rowsPerBand = (maxWireSize - 3 - fieldsLength) / rowSize;
+	const int64_t ybegin = band.tile_ybegin;
+	const uint64_t ycount = band.tile_ycount;
+	for (uint64_t row = 0; row < ycount; row += rowsPerBand)
+	{
+		band.tile_ybegin = ybegin + (int64_t)row;
+		band.tile_ycount = std::min(rowsPerBand, ycount - row);
+		TRef bandRef = ref;
+		bandRef.fields = store(&band, fieldsLength);
+		bandRef.fields_length = fieldsLength;
+		bandRef.data = tiles + row * rowSize;
+		bandRef.data_length = band.tile_ycount * rowSize;
+		bandRef.encoded_copies = 0;
+		v_out.push_back(bandRef);
+	}
+	return true;
+}
+
+template <typename T>
+void SDHRCommandBatcher::Reserve(std::vector<T>& v, size_t count)
 {
-	// TODO: Shouldn't have to recreate a vector
-	uint64_t vecsize = 0;
-	for (auto& cmd : v_cmds)
+	if (count <= v.capacity())
+		return;
+	v.reserve(std::max(count, 2 * v.capacity()));
+	++allocations;
+}
+
+size_t SDHRCommandBatcher::Store(const void* bytes, size_t length)
+{
+	if (arena_used + length > v_arena.size())
+	{
+		// Grow geometrically, so the arena soon stops growing
+		v_arena.resize(std::max({ arena_used + length, 2 * v_arena.size(), (size_t)64 * 1024 }));
+		++allocations;
+	}
+	const size_t offset = arena_used;
+	if (length > 0)
+		memcpy(v_arena.data() + offset, bytes, length);
+	arena_used += length;
+	g_stats.bytes_copied += length;
+	return offset;
+}
+
+bool SDHRCommandBatcher::Publish()
+{
+	const auto publishTime = std::chrono::steady_clock::now();
+	if (g_sink == nullptr)
+	{
+		fprintf(stderr, "SDHR batch published without a sink, dropped\n");
+		v_cmds.clear();
+		arena_used = 0;
+		return false;
+	}
+	const size_t capacity = g_sink->GetBatchCapacity();
+	const size_t maxWireSize = std::min(capacity, SDHR_MAX_COMMAND_WIRE_SIZE);
+
+	// Tile updates too large for a single message are split in row bands
+	auto store = [this](const void* bytes, size_t length) { return Store(bytes, length); };
+	v_send.clear();
+	Reserve(v_send, v_cmds.size());
+	for (auto& ref : v_cmds)
+	{
+		if (ref.WireSize() <= maxWireSize)
+		{
+			Reserve(v_send, v_send.size() + 1);
+			v_send.push_back(ref);
+			continue;
+		}
+		size_t first = v_send.size();
+		bool split = false;
+		const size_t sendCapacity = v_send.capacity();
+		if (ref.id == SDHR_CMD::UPDATE_WINDOW_SET_BOTH)
+			split = SplitTileRows<UpdateWindowSetBothCmd>(ref, v_arena.data() + ref.fields, 2, maxWireSize, store, v_send);
+		else if (ref.id == SDHR_CMD::UPDATE_WINDOW_SINGLE_TILESET)
+			split = SplitTileRows<UpdateWindowSingleTilesetCmd>(ref, v_arena.data() + ref.fields, 1, maxWireSize, store, v_send);
+		if (v_send.capacity() != sendCapacity)
+			++allocations;
+		if (!split)
+		{
+			// The host would reject a truncated command anyway
+			fprintf(stderr, "SDHR command %d is too large to send (%zu bytes), dropped\n", (int)ref.id, ref.WireSize());
+			v_send.resize(first);
+			continue;
+		}
+		// The encoding copy of the whole command still happened
+		g_stats.bytes_copied += ref.encoded_copies;
+	}
+
+	// Serialize the commands straight into as few messages as possible, cutting only between commands
+	UINT32 typeMask = 0;
+	bool isSent = true;
+	size_t iCmd = 0;
+	do
+	{
+		size_t iEnd = iCmd;
+		UINT32 length = 0;
+		while (iEnd < v_send.size() && length + v_send[iEnd].WireSize() <= capacity)
+			length += (UINT32)v_send[iEnd++].WireSize();
+		const bool isLast = (iEnd == v_send.size());
+
+		UINT32 room = 0;
+		uint8_t* ptrdata = g_sink->BeginBatch(isLast, &room);
+		if (ptrdata == nullptr)
+		{
+			isSent = false;
+			break;
+		}
+		for (; iCmd < iEnd; ++iCmd)
+		{
+			const sCommandRef& ref = v_send[iCmd];
+			uint16_t cmd_size = (uint16_t)(ref.WireSize() - 3);
+			memcpy(ptrdata, &cmd_size, 2);
+			ptrdata[2] = (uint8_t)ref.id;
+			ptrdata += 3;
+			memcpy(ptrdata, v_arena.data() + ref.fields, ref.fields_length);
+			ptrdata += ref.fields_length;
+			if (ref.data_length > 0)
+				memcpy(ptrdata, v_arena.data() + ref.data, ref.data_length);
+			ptrdata += ref.data_length;
+
+			typeMask |= 1u << ((UINT32)ref.id & 31);
+			++g_stats.commands;
+			g_stats.bytes_published += ref.WireSize();
+			g_stats.bytes_copied += ref.WireSize() + ref.encoded_copies;
+		}
+		g_sink->EndBatch(length);
+		isHostBatchOpen = !isLast;
+	} while (iCmd < v_send.size());
+
+	if (!isSent && isHostBatchOpen)
 	{
-		vecsize += cmd->v_data.size();
+		// Dropping the rest would have the host run the fragments it has as the head of the next,
+		// unrelated batch: keep the rest in the arena, to send first next time
+		const size_t kept = v_send.size() - iCmd;
+		fprintf(stderr, "SDHR batch interrupted, %zu commands left for the next publish\n", kept);
+		Reserve(v_cmds, kept);
+		v_cmds.assign(v_send.begin() + (std::ptrdiff_t)iCmd, v_send.end());
 	}
-	std::vector<uint8_t> v_fulldata;
-	v_fulldata.reserve(vecsize);
-	for (auto& cmd : v_cmds)
+	else
 	{
-		uint16_t cmd_size = cmd->v_data.size() - 1;
-		uint8_t* p_cmdsize = (uint8_t*)&cmd_size;
-		v_fulldata.insert(v_fulldata.end(), p_cmdsize, p_cmdsize + 2);
-		v_fulldata.insert(v_fulldata.end(), cmd->v_data.begin(), cmd->v_data.end());
+		// Start the next batch from an empty arena, keeping its memory
+		v_cmds.clear();
+		arena_used = 0;
 	}
-	GameLink::SDHR_write(v_fulldata);
-	GameLink::SendCommand(std::string(":sdhr_process"));
+	v_send.clear();
+	last_allocations = allocations;
+	g_stats.allocations += allocations;
+	allocations = 0;
+
+	if (g_publishCallback && isSent)
+		g_publishCallback(typeMask, publishTime);
+	return isSent;
 }
 
-void SDHRCommandBatcher::AddCommand(SDHRCommand* command)
+sSDHRBatcherStats SDHRCommandBatcher::GetStats()
 {
-	v_cmds.push_back(command);
+	return g_stats;
 }
 
-void SDHRCommand::InsertSizeHeader()
+void SDHRCommandBatcher::SetSink(SDHRBatchSink* sink)
 {
-	// OBSOLETE
-// 	uint16_t vSize = v_data.size() - 1;
-// 	uint8_t* p;
-// 	p = (uint8_t*)&vSize;
-// 	v_data.insert(v_data.begin(), p[1]);
-// 	v_data.insert(v_data.begin(), p[0]);
+	g_sink = sink;
+}
+
+void SDHRCommandBatcher::SetPublishCallback(PublishCallback callback)
+{
+	g_publishCallback = std::move(callback);
+}
+
+void SDHRCommandBatcher::AddRef(SDHR_CMD id, const void* fields, size_t fields_length, const void* data, size_t data_length)
+{
+	sCommandRef ref = { id, 0, fields_length, 0, data_length, 0 };
+	ref.fields = Store(fields, fields_length);
+	ref.data = Store(data, data_length);
+	Reserve(v_cmds, v_cmds.size() + 1);
+	v_cmds.push_back(ref);
+}
+
+void SDHRCommandBatcher::AddCommand(const SDHRCommand* command)
+{
+	// v_data already holds the id and everything else, encoded
+	AddRef(command->id, command->v_data.data() + 1, command->v_data.size() - 1);
+	v_cmds.back().encoded_copies = command->v_data.size();
 }
 
 SDHRCommand_UpdateWindowEnable::SDHRCommand_UpdateWindowEnable(UpdateWindowEnableCmd* cmd)
 {
-	id = SDHR_CMD::UPDATE_WINDOW_ENABLE;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	for (size_t i = 0; i < sizeof(UpdateWindowEnableCmd); i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 SDHRCommand_DefineTilesetImmediate::SDHRCommand_DefineTilesetImmediate(DefineTilesetImmediateCmd* cmd)
 {
-	id = SDHR_CMD::DEFINE_TILESET_IMMEDIATE;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	// push all but the pointer to the data field
-	for (size_t i = 0; i < (sizeof(DefineTilesetImmediateCmd) - sizeof(uint8_t*)); i++) { v_data.push_back(p[i]); };
-	// push the data field
-	p = cmd->data;
-	size_t entries = (cmd->num_entries == 0) ? 256 : cmd->num_entries;
-	for (size_t i = 0; i < (size_t)4 * entries; i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 SDHRCommand_DefineWindow::SDHRCommand_DefineWindow(DefineWindowCmd* cmd)
 {
-	id = SDHR_CMD::DEFINE_WINDOW;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	for (size_t i = 0; i < sizeof(DefineWindowCmd); i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 SDHRCommand_UpdateWindowSetBoth::SDHRCommand_UpdateWindowSetBoth(UpdateWindowSetBothCmd* cmd)
 {
-	id = SDHR_CMD::UPDATE_WINDOW_SET_BOTH;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	// push all but the pointer to the data field
-	for (size_t i = 0; i < (sizeof(UpdateWindowSetBothCmd) - sizeof(uint8_t*)); i++) { v_data.push_back(p[i]); };
-	// push the data field
-	p = cmd->data;
-	for (size_t i = 0; i < (size_t)cmd->tile_xcount * cmd->tile_ycount * 2; i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 SDHRCommand_UpdateWindowSetUpload::SDHRCommand_UpdateWindowSetUpload(UpdateWindowSetUploadCmd* cmd)
 {
-	id = SDHR_CMD::UPDATE_WINDOW_SET_UPLOAD;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	for (size_t i = 0; i < sizeof(UpdateWindowSetUploadCmd); i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
-SDHRCommand_UpdateWindowSetWindowPosition::SDHRCommand_UpdateWindowSetWindowPosition(UpdateWindowSetWindowPositionCmd* cmd) {
-	id = SDHR_CMD::UPDATE_WINDOW_SET_WINDOW_POSITION;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	for (size_t i = 0; i < sizeof(UpdateWindowSetWindowPositionCmd); i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+SDHRCommand_UpdateWindowSetWindowPosition::SDHRCommand_UpdateWindowSetWindowPosition(UpdateWindowSetWindowPositionCmd* cmd)
+{
+	Encode(cmd);
 }
 
 SDHRCommand_UploadData::SDHRCommand_UploadData(UploadDataCmd* cmd)
 {
-	id = SDHR_CMD::UPLOAD_DATA;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	for (size_t i = 0; i < sizeof(UploadDataCmd); i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 SDHRCommand_UploadDataFilename::SDHRCommand_UploadDataFilename(UploadDataFilenameCmd* cmd)
 {
-	id = SDHR_CMD::UPLOAD_DATA_FILENAME;
-	v_data.push_back((uint8_t)id);
-	v_data.push_back(cmd->dest_addr_med);
-	v_data.push_back(cmd->dest_addr_high);
-	v_data.push_back(cmd->filename_length);
-	// push the filename string (no trailing null)
-	for (size_t i = 0; i < cmd->filename_length; i++) { v_data.push_back(cmd->filename[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 SDHRCommand_DefineImageAsset::SDHRCommand_DefineImageAsset(DefineImageAssetCmd* cmd)
 {
-	id = SDHR_CMD::DEFINE_IMAGE_ASSET;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	for (size_t i = 0; i < sizeof(DefineImageAssetCmd); i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 SDHRCommand_DefineImageAssetFilename::SDHRCommand_DefineImageAssetFilename(DefineImageAssetFilenameCmd* cmd)
 {
-	id = SDHR_CMD::DEFINE_IMAGE_ASSET_FILENAME;
-	v_data.push_back((uint8_t)id);
-	v_data.push_back(cmd->asset_index);
-	v_data.push_back(cmd->filename_length);
-	// push the filename string (no trailing null)
-	for (size_t i = 0; i < cmd->filename_length; i++) { v_data.push_back(cmd->filename[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 
 SDHRCommand_DefineTileset::SDHRCommand_DefineTileset(DefineTilesetCmd* cmd)
 {
-	id = SDHR_CMD::DEFINE_TILESET;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	for (size_t i = 0; i < sizeof(DefineTilesetCmd); i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 
 SDHRCommand_UpdateWindowSingleTileset::SDHRCommand_UpdateWindowSingleTileset(UpdateWindowSingleTilesetCmd* cmd)
 {
-	id = SDHR_CMD::UPDATE_WINDOW_SINGLE_TILESET;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	// push all but the pointer to the data field
-	for (size_t i = 0; i < (sizeof(UpdateWindowSingleTilesetCmd) - sizeof(uint8_t*)); i++) { v_data.push_back(p[i]); };
-	// push the data field
-	p = cmd->data;
-	for (size_t i = 0; i < (size_t)cmd->tile_xcount * cmd->tile_ycount; i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 SDHRCommand_UpdateWindowShiftTiles::SDHRCommand_UpdateWindowShiftTiles(UpdateWindowShiftTilesCmd* cmd)
 {
-	id = SDHR_CMD::UPDATE_WINDOW_SHIFT_TILES;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	for (size_t i = 0; i < sizeof(UpdateWindowShiftTilesCmd); i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
 
 SDHRCommand_UpdateWindowAdjustWindowView::SDHRCommand_UpdateWindowAdjustWindowView(UpdateWindowAdjustWindowViewCmd* cmd)
 {
-	id = SDHR_CMD::UPDATE_WINDOW_ADJUST_WINDOW_VIEW;
-	v_data.push_back((uint8_t)id);
-	uint8_t* p = (uint8_t*)cmd;
-	for (size_t i = 0; i < sizeof(UpdateWindowAdjustWindowViewCmd); i++) { v_data.push_back(p[i]); };
-	InsertSizeHeader();
+	Encode(cmd);
 }
@@ -1,28 +1,132 @@
 #pragma once
 #include "GameLink.h"
+#include <chrono>
+#include <cstring>
+#include <functional>
 #include <vector>
 
 class SDHRCommand;	// forward declaration
+struct UploadDataCmd;
+struct UploadDataFilenameCmd;
+struct DefineImageAssetCmd;
+struct DefineImageAssetFilenameCmd;
+struct DefineTilesetCmd;
+struct DefineTilesetImmediateCmd;
+struct DefineWindowCmd;
+struct UpdateWindowSetBothCmd;
+struct UpdateWindowSetUploadCmd;
+struct UpdateWindowSingleTilesetCmd;
+struct UpdateWindowShiftTilesCmd;
+struct UpdateWindowSetWindowPositionCmd;
+struct UpdateWindowAdjustWindowViewCmd;
+struct UpdateWindowEnableCmd;
+
+// How each command struct goes on the wire, specialized for each of them below the structs
+template <typename TCmd>
+struct SDHRCommandTraits
+{
+	static constexpr bool is_command = false;
+};
+
+/**
+ * @brief Running totals of what SDHRCommandBatcher::Publish() sent
+ * bytes_copied counts every copy of command bytes made on our side: into the batcher's arena,
+ * then into the shared memory, plus the encoding of commands first built as SDHRCommand objects.
+ * allocations counts the heap allocations of all batchers, which stop once they've grown to
+ * the largest batch they publish.
+*/
+struct sSDHRBatcherStats
+{
+	UINT64 commands = 0;
+	UINT64 bytes_published = 0;
+	UINT64 bytes_copied = 0;
+	UINT64 allocations = 0;
+};
+
+/**
+ * @brief SDHRBatchSink
+ * Where SDHRCommandBatcher::Publish() writes its batches, one message at a time, in place.
+ * GameLink::GetSDHRBatchSink() sends them to AppleWin. The batcher itself doesn't depend on GameLink.
+*/
+class SDHRBatchSink
+{
+public:
+	virtual ~SDHRBatchSink() {}
+
+	// Bytes of commands that fit in one message
+	virtual UINT32 GetBatchCapacity() = 0;
+	// As GameLink::SDHR_begin_batch() and SDHR_end_batch()
+	virtual uint8_t* BeginBatch(bool isLast, UINT32* capacity) = 0;
+	virtual void EndBatch(UINT32 length) = 0;
+};
 
 /**
  * @brief SDHRCommandBatcher
  * Writes the complete command batch to SHM along with a SDHR_CMD_READY flag
- * Call GameLink::SDHR_process() to have AppleWin process them
+ * and has AppleWin process it, in one handshake if the host supports it.
+ * AddCommand() copies the command and its data into the batcher's arena, so they can go
+ * out of scope right away. Publish() empties the arena but keeps its memory: reuse the batcher,
+ * and publishing doesn't allocate anymore once it has seen the largest batch.
 */
 class SDHRCommandBatcher
 {
 public:
 
-	// Publishes the queued commands.
-	// Call GameLink::SDHR_process() to have AppleWin process them
-	void Publish();
+	// Publishes the queued commands and has AppleWin process them, then empties the batch.
+	// Returns false if the host was stuck and they couldn't all be sent: the batch is dropped,
+	// unless the host already has its first fragments, then the rest goes with the next Publish().
+	bool Publish();
 
 	// Stream of subcommands to add to the command
 	// They'll be processed in FIFO.
-	void AddCommand(SDHRCommand* command);
+	void AddCommand(const SDHRCommand* command);
+
+	// Any command struct (and the data it points to), encoded as it's added,
+	// without building an SDHRCommand first
+	template <typename TCmd> requires SDHRCommandTraits<TCmd>::is_command
+	void AddCommand(const TCmd* cmd);
+
+	// Heap allocations made by this batcher for the last batch, from its first AddCommand() to its Publish()
+	UINT GetLastPublishAllocations() const { return last_allocations; }
+	size_t GetArenaCapacity() const { return v_arena.size(); }
+
+	// Called after each batch sent in full, with the SDHR_CMD bits (1 << id) it had and when its Publish()
+	// started, e.g. for LatencyTracer::RecordPublish()
+	using PublishCallback = std::function<void(UINT32 type_mask, std::chrono::steady_clock::time_point publish_time)>;
+
+	static sSDHRBatcherStats GetStats();
+	// Where every batcher publishes. Publish() fails until it's set.
+	static void SetSink(SDHRBatchSink* sink);
+	static void SetPublishCallback(PublishCallback callback);
 
 private:
-	std::vector<SDHRCommand*> v_cmds;
+	// A command as it goes on the wire: [uint16 size][id][fields][data]
+	// The fields and data are in the arena. They're offsets, as the arena moves when it grows.
+	struct sCommandRef
+	{
+		SDHR_CMD id;
+		size_t fields;
+		size_t fields_length;
+		size_t data;
+		size_t data_length;
+		size_t encoded_copies;	// bytes already copied to encode it before AddCommand()
+
+		size_t WireSize() const { return 2 + 1 + fields_length + data_length; }
+	};
+
+	void AddRef(SDHR_CMD id, const void* fields, size_t fields_length, const void* data = nullptr, size_t data_length = 0);
+	// Copies length bytes to the arena, returns their offset
+	size_t Store(const void* bytes, size_t length);
+	template <typename T>
+	void Reserve(std::vector<T>& v, size_t count);
+
+	std::vector<uint8_t> v_arena;
+	size_t arena_used = 0;
+	std::vector<sCommandRef> v_cmds;
+	std::vector<sCommandRef> v_send;	// Publish()'s, kept for its capacity
+	UINT allocations = 0;				// since the last Publish()
+	UINT last_allocations = 0;
+	bool isHostBatchOpen = false;		// the host has fragments of a batch it hasn't got the READY of
 };
 
 /**
@@ -148,6 +252,157 @@ struct UpdateWindowEnableCmd {
 
 #pragma pack(pop)
 
+/**
+ * @brief SDHR command descriptors
+ * One line per command struct says how it goes on the wire, [uint16 size][id][fields][tail]:
+ * - SDHRFixedCommand: the fields are the whole struct
+ * - SDHRTailCommand: the struct ends with a pointer to a variable-length tail, which the fields
+ *   stop short of. TailLength computes the tail's bytes from the fields.
+ * The encoder, the decoder view and the size queries below are generated from them.
+*/
+template <SDHR_CMD ID, typename TCmd>
+struct SDHRFixedCommand
+{
+	static constexpr bool is_command = true;
+	static constexpr SDHR_CMD id = ID;
+	static constexpr size_t fields_length = sizeof(TCmd);
+	static constexpr bool has_tail = false;
+	static constexpr size_t TailLength(const TCmd&) { return 0; }
+	static const uint8_t* Tail(const TCmd&) { return nullptr; }
+};
+
+template <SDHR_CMD ID, typename TCmd, auto TAIL, size_t (*TAIL_LENGTH)(const TCmd&)>
+struct SDHRTailCommand
+{
+	static_assert(sizeof(((TCmd*)nullptr)->*TAIL) == sizeof(void*), "The tail must be a pointer");
+	static constexpr bool is_command = true;
+	static constexpr SDHR_CMD id = ID;
+	static constexpr size_t fields_length = sizeof(TCmd) - sizeof(void*);	// the tail pointer is last
+	static constexpr bool has_tail = true;
+	static constexpr size_t TailLength(const TCmd& cmd) { return TAIL_LENGTH(cmd); }
+	static const uint8_t* Tail(const TCmd& cmd)
+	{
+		// The pointer is unaligned in the packed struct: copy it rather than load it
+		const void* tail;
+		memcpy(&tail, &(cmd.*TAIL), sizeof(tail));
+		return (const uint8_t*)tail;
+	}
+};
+
+// Tail lengths
+template <typename TCmd, size_t BYTES_PER_TILE>
+constexpr size_t SDHRTilesLength(const TCmd& cmd) { return (size_t)cmd.tile_xcount * cmd.tile_ycount * BYTES_PER_TILE; }
+template <typename TCmd>
+constexpr size_t SDHRFilenameLength(const TCmd& cmd) { return cmd.filename_length; }	// no trailing null
+constexpr size_t SDHRTilesetEntriesLength(const DefineTilesetImmediateCmd& cmd) { return (size_t)4 * (cmd.num_entries ? cmd.num_entries : 256); }
+
+template <> struct SDHRCommandTraits<UploadDataCmd> : SDHRFixedCommand<SDHR_CMD::UPLOAD_DATA, UploadDataCmd> {};
+template <> struct SDHRCommandTraits<UploadDataFilenameCmd> : SDHRTailCommand<SDHR_CMD::UPLOAD_DATA_FILENAME, UploadDataFilenameCmd, &UploadDataFilenameCmd::filename, SDHRFilenameLength<UploadDataFilenameCmd>> {};
+template <> struct SDHRCommandTraits<DefineImageAssetCmd> : SDHRFixedCommand<SDHR_CMD::DEFINE_IMAGE_ASSET, DefineImageAssetCmd> {};
+template <> struct SDHRCommandTraits<DefineImageAssetFilenameCmd> : SDHRTailCommand<SDHR_CMD::DEFINE_IMAGE_ASSET_FILENAME, DefineImageAssetFilenameCmd, &DefineImageAssetFilenameCmd::filename, SDHRFilenameLength<DefineImageAssetFilenameCmd>> {};
+template <> struct SDHRCommandTraits<DefineTilesetCmd> : SDHRFixedCommand<SDHR_CMD::DEFINE_TILESET, DefineTilesetCmd> {};
+template <> struct SDHRCommandTraits<DefineTilesetImmediateCmd> : SDHRTailCommand<SDHR_CMD::DEFINE_TILESET_IMMEDIATE, DefineTilesetImmediateCmd, &DefineTilesetImmediateCmd::data, SDHRTilesetEntriesLength> {};
+template <> struct SDHRCommandTraits<DefineWindowCmd> : SDHRFixedCommand<SDHR_CMD::DEFINE_WINDOW, DefineWindowCmd> {};
+template <> struct SDHRCommandTraits<UpdateWindowSetBothCmd> : SDHRTailCommand<SDHR_CMD::UPDATE_WINDOW_SET_BOTH, UpdateWindowSetBothCmd, &UpdateWindowSetBothCmd::data, SDHRTilesLength<UpdateWindowSetBothCmd, 2>> {};
+template <> struct SDHRCommandTraits<UpdateWindowSetUploadCmd> : SDHRFixedCommand<SDHR_CMD::UPDATE_WINDOW_SET_UPLOAD, UpdateWindowSetUploadCmd> {};
+template <> struct SDHRCommandTraits<UpdateWindowSingleTilesetCmd> : SDHRTailCommand<SDHR_CMD::UPDATE_WINDOW_SINGLE_TILESET, UpdateWindowSingleTilesetCmd, &UpdateWindowSingleTilesetCmd::data, SDHRTilesLength<UpdateWindowSingleTilesetCmd, 1>> {};
+template <> struct SDHRCommandTraits<UpdateWindowShiftTilesCmd> : SDHRFixedCommand<SDHR_CMD::UPDATE_WINDOW_SHIFT_TILES, UpdateWindowShiftTilesCmd> {};
+template <> struct SDHRCommandTraits<UpdateWindowSetWindowPositionCmd> : SDHRFixedCommand<SDHR_CMD::UPDATE_WINDOW_SET_WINDOW_POSITION, UpdateWindowSetWindowPositionCmd> {};
+template <> struct SDHRCommandTraits<UpdateWindowAdjustWindowViewCmd> : SDHRFixedCommand<SDHR_CMD::UPDATE_WINDOW_ADJUST_WINDOW_VIEW, UpdateWindowAdjustWindowViewCmd> {};
+template <> struct SDHRCommandTraits<UpdateWindowEnableCmd> : SDHRFixedCommand<SDHR_CMD::UPDATE_WINDOW_ENABLE, UpdateWindowEnableCmd> {};
+
+// Bytes on the wire of any TCmd without a tail, and of the fields of any TCmd
+template <typename TCmd> requires (!SDHRCommandTraits<TCmd>::has_tail)
+constexpr size_t SDHRFixedWireSize() { return 3 + SDHRCommandTraits<TCmd>::fields_length; }
+template <typename TCmd> requires SDHRCommandTraits<TCmd>::is_command
+constexpr size_t SDHRFieldsLength() { return SDHRCommandTraits<TCmd>::fields_length; }
+
+template <typename TCmd> requires SDHRCommandTraits<TCmd>::is_command
+constexpr size_t SDHRWireSize(const TCmd& cmd)
+{
+	return 3 + SDHRCommandTraits<TCmd>::fields_length + SDHRCommandTraits<TCmd>::TailLength(cmd);
+}
+
+// Writes cmd as [uint16 size][id][fields][tail] to out, which must have room for SDHRWireSize(cmd) bytes.
+// Returns the bytes written. Only the tail's length varies, the rest are fixed-size copies.
+// The size can't tell commands over UINT16_MAX bytes: SDHRCommandBatcher splits those into bands first.
+template <typename TCmd> requires SDHRCommandTraits<TCmd>::is_command
+size_t SDHREncode(const TCmd& cmd, uint8_t* out)
+{
+	using T = SDHRCommandTraits<TCmd>;
+	const size_t tailLength = T::TailLength(cmd);
+	const uint16_t size = (uint16_t)(T::fields_length + tailLength);
+	memcpy(out, &size, 2);
+	out[2] = (uint8_t)T::id;
+	memcpy(out + 3, &cmd, T::fields_length);
+	if constexpr (T::has_tail)
+		memcpy(out + 3 + T::fields_length, T::Tail(cmd), tailLength);
+	return 3 + T::fields_length + tailLength;
+}
+
+// Appends cmd to a stream built without SDHRCommandBatcher, e.g. to decode or render it offline
+template <typename TCmd> requires SDHRCommandTraits<TCmd>::is_command
+void SDHRAppend(std::vector<uint8_t>& v_stream, const TCmd& cmd)
+{
+	const size_t offset = v_stream.size();
+	v_stream.resize(offset + SDHRWireSize(cmd));
+	SDHREncode(cmd, v_stream.data() + offset);
+}
+
+// Appends the READY command that ends a batch
+inline void SDHRAppendReady(std::vector<uint8_t>& v_stream)
+{
+	const uint8_t ready[3] = { 0, 0, (uint8_t)SDHR_CMD::READY };
+	v_stream.insert(v_stream.end(), ready, ready + 3);
+}
+
+/**
+ * @brief SDHRCommandView
+ * A TCmd read back from an encoded stream without copying its tail.
+ * Decode() takes what follows the size header, [id][fields][tail], and checks that it's a TCmd
+ * whose tail is exactly as long as its fields say.
+*/
+template <typename TCmd> requires SDHRCommandTraits<TCmd>::is_command
+class SDHRCommandView
+{
+public:
+	bool Decode(const uint8_t* body, size_t length)
+	{
+		using T = SDHRCommandTraits<TCmd>;
+		if (length < 1 + T::fields_length || body[0] != (uint8_t)T::id)
+			return false;
+		// The fields may be anywhere in the stream, copy them to an aligned struct
+		memcpy(&fields, body + 1, T::fields_length);
+		tail = body + 1 + T::fields_length;
+		tail_length = length - 1 - T::fields_length;
+		return T::TailLength(fields) == tail_length;
+	}
+
+	// The fields. The tail pointer, if any, isn't set: use Tail().
+	const TCmd& Fields() const { return fields; }
+	const uint8_t* Tail() const { return tail; }
+	size_t TailLength() const { return tail_length; }
+	// A bool field as sent, where any byte but 0 is true: reading it from Fields() is undefined for those
+	bool IsSet(const bool TCmd::* flag) const
+	{
+		uint8_t value;
+		memcpy(&value, &(fields.*flag), 1);
+		return value != 0;
+	}
+
+private:
+	TCmd fields = TCmd();
+	const uint8_t* tail = nullptr;
+	size_t tail_length = 0;
+};
+
+template <typename TCmd> requires SDHRCommandTraits<TCmd>::is_command
+void SDHRCommandBatcher::AddCommand(const TCmd* cmd)
+{
+	using T = SDHRCommandTraits<TCmd>;
+	AddRef(T::id, cmd, T::fields_length, T::Tail(*cmd), T::TailLength(*cmd));
+}
+
 /**
  * @brief SDHRCommand
  * Superclass of all SDHR commands
@@ -160,7 +415,20 @@ public:
 	SDHR_CMD id = SDHR_CMD::NONE;
 	std::vector<uint8_t> v_data;
 protected:
-	void InsertSizeHeader();
+	// Fills v_data with the id, the fields and the tail, in one allocation of the exact size
+	template <typename TCmd> requires SDHRCommandTraits<TCmd>::is_command
+	void Encode(const TCmd* cmd)
+	{
+		using T = SDHRCommandTraits<TCmd>;
+		id = T::id;
+		const size_t tailLength = T::TailLength(*cmd);
+		v_data.clear();
+		v_data.reserve(1 + T::fields_length + tailLength);
+		v_data.push_back((uint8_t)id);
+		v_data.insert(v_data.end(), (const uint8_t*)cmd, (const uint8_t*)cmd + T::fields_length);
+		if constexpr (T::has_tail)
+			v_data.insert(v_data.end(), T::Tail(*cmd), T::Tail(*cmd) + tailLength);
+	}
 };
 
 class SDHRCommand_UploadData : public SDHRCommand
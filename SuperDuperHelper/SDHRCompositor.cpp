@@ -0,0 +1,445 @@
+#include "SDHRCompositor.h"
+
+// Private copy of stb_image, so the compositor doesn't depend on ImageHelper (and SDL, GL)
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#include "stb_image.h"
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+static uint64_t UploadAddress(uint8_t addr_med, uint8_t addr_high)
+{
+	return ((uint64_t)addr_high << 16) | ((uint64_t)addr_med << 8);
+}
+
+// Always positive, for wrapping views
+static uint64_t Wrap(int64_t value, uint64_t modulo)
+{
+	const int64_t m = (int64_t)modulo;
+	return (uint64_t)(((value % m) + m) % m);
+}
+
+// src over dst by src's alpha, the result is opaque
+static inline UINT32 Blend(UINT32 src, UINT32 dst)
+{
+	const UINT32 a = src >> 24;
+	if (a == 255)
+		return src;
+	if (a == 0)
+		return dst;
+	UINT32 out = SDHRCompositor::BLACK;
+	for (UINT shift = 0; shift < 24; shift += 8)
+	{
+		const UINT32 s = (src >> shift) & 0xFF;
+		const UINT32 d = (dst >> shift) & 0xFF;
+		out |= ((s * a + d * (255 - a) + 127) / 255) << shift;
+	}
+	return out;
+}
+
+//------------------------------------------------------------------------------
+// Methods
+//------------------------------------------------------------------------------
+
+SDHRCompositor::SDHRCompositor()
+{
+	Reset();
+}
+
+void SDHRCompositor::Reset()
+{
+	decoder.Reset();
+	v_upload.clear();
+	v_assets.assign(SDHRStreamDecoder::MAX_ASSETS, sAsset());
+	v_tilesets.assign(SDHRStreamDecoder::MAX_TILESETS, sTileset());
+	v_windows.assign(SDHRStreamDecoder::MAX_WINDOWS, sWindow());
+}
+
+bool SDHRCompositor::Apply(const uint8_t* stream, size_t length)
+{
+	const UINT64 rejected = stats.rejected;
+	decoder.Feed(stream, length);
+	sSDHRDecodedCommand cmd;
+	while (decoder.Next(&cmd))
+	{
+		if (cmd.error != SDHRDecodeError::NONE)
+		{
+			++stats.rejected;
+			continue;
+		}
+		ApplyCommand(cmd);
+		++stats.commands;
+	}
+	if (decoder.GetFramingError() != SDHRDecodeError::NONE)
+		++stats.rejected;
+	return stats.rejected == rejected;
+}
+
+bool SDHRCompositor::HasEnabledWindow() const
+{
+	return std::any_of(v_windows.begin(), v_windows.end(), [](const sWindow& w) { return w.isDefined && w.isEnabled; });
+}
+
+uint8_t* SDHRCompositor::Upload(uint64_t address)
+{
+	// The decoder has checked the range
+	if (v_upload.empty())
+		v_upload.resize(SDHRStreamDecoder::UPLOAD_REGION_SIZE);
+	return v_upload.data() + address;
+}
+
+void SDHRCompositor::LoadAsset(UINT8 asset_index, const uint8_t* encoded, size_t length, const std::string& filename)
+{
+	sAsset& asset = v_assets[asset_index];
+	asset = sAsset();
+	int channels = 0;
+	stbi_uc* rgba = filename.empty()
+		? stbi_load_from_memory(encoded, (int)length, &asset.width, &asset.height, &channels, 4)
+		: stbi_load(filename.c_str(), &asset.width, &asset.height, &channels, 4);
+	if (rgba == nullptr)
+	{
+		fprintf(stderr, "Can't load SDHR image asset %u (%s): %s\n", asset_index,
+			filename.empty() ? "uploaded" : filename.c_str(), stbi_failure_reason());
+		asset = sAsset();
+		++stats.load_failures;
+		return;
+	}
+	asset.v_pixels.resize((size_t)asset.width * asset.height);
+	for (size_t i = 0; i < asset.v_pixels.size(); ++i)
+	{
+		const stbi_uc* p = rgba + i * 4;
+		asset.v_pixels[i] = ((UINT32)p[3] << 24) | ((UINT32)p[0] << 16) | ((UINT32)p[1] << 8) | p[2];
+		asset.isOpaque = asset.isOpaque && (p[3] == 255);
+	}
+	stbi_image_free(rgba);
+}
+
+void SDHRCompositor::SetTiles(sWindow& w, int64_t xbegin, int64_t ybegin, uint64_t xcount, uint64_t ycount,
+	const uint8_t* src, UINT8 single_tileset, bool isSingle)
+{
+	for (uint64_t row = 0; row < ycount; ++row)
+	{
+		uint8_t* dst = w.v_tiles.data() + (((uint64_t)ybegin + row) * w.tile_xcount + (uint64_t)xbegin) * 2;
+		if (!isSingle)
+		{
+			memcpy(dst, src + row * xcount * 2, xcount * 2);
+			continue;
+		}
+		const uint8_t* indexes = src + row * xcount;
+		for (uint64_t i = 0; i < xcount; ++i)
+		{
+			dst[i * 2] = single_tileset;
+			dst[i * 2 + 1] = indexes[i];
+		}
+	}
+}
+
+void SDHRCompositor::ShiftTiles(sWindow& w, int x_dir, int y_dir)
+{
+	// One tile at most in each direction, the tiles shifted in are cleared
+	const size_t rowBytes = w.tile_xcount * 2;
+	uint8_t* tiles = w.v_tiles.data();
+	if (x_dir != 0)
+	{
+		for (uint64_t row = 0; row < w.tile_ycount; ++row)
+		{
+			uint8_t* p = tiles + row * rowBytes;
+			if (x_dir > 0)
+			{
+				memmove(p + 2, p, rowBytes - 2);
+				p[0] = p[1] = 0;
+			}
+			else
+			{
+				memmove(p, p + 2, rowBytes - 2);
+				p[rowBytes - 2] = p[rowBytes - 1] = 0;
+			}
+		}
+	}
+	if (y_dir > 0)
+	{
+		memmove(tiles + rowBytes, tiles, rowBytes * (w.tile_ycount - 1));
+		memset(tiles, 0, rowBytes);
+	}
+	else if (y_dir < 0)
+	{
+		memmove(tiles, tiles + rowBytes, rowBytes * (w.tile_ycount - 1));
+		memset(tiles + rowBytes * (w.tile_ycount - 1), 0, rowBytes);
+	}
+}
+
+void SDHRCompositor::ApplyCommand(const sSDHRDecodedCommand& cmd)
+{
+	// The decoder has validated everything, the views can't fail
+	switch (cmd.id)
+	{
+	case SDHR_CMD::UPLOAD_DATA:
+	{
+		SDHRCommandView<UploadDataCmd> view;
+		cmd.As(&view);
+		const UploadDataCmd& c = view.Fields();
+		const size_t source = (size_t)c.source_addr_med * 256;
+		const size_t length = (size_t)c.num_256b_pages * 256;
+		uint8_t* dst = Upload(UploadAddress(c.dest_addr_med, c.dest_addr_high));
+		if (p_apple_memory != nullptr && source + length <= apple_memory_length)
+			memcpy(dst, p_apple_memory + source, length);
+		else
+			memset(dst, 0, length);
+		break;
+	}
+	case SDHR_CMD::UPLOAD_DATA_FILENAME:
+	{
+		SDHRCommandView<UploadDataFilenameCmd> view;
+		cmd.As(&view);
+		const std::string filename((const char*)view.Tail(), view.TailLength());
+		const uint64_t address = UploadAddress(view.Fields().dest_addr_med, view.Fields().dest_addr_high);
+		std::ifstream in(filename, std::ios::binary);
+		if (!in)
+		{
+			fprintf(stderr, "Can't read SDHR upload file %s\n", filename.c_str());
+			++stats.load_failures;
+			break;
+		}
+		// What doesn't fit in the upload region is ignored
+		in.read((char*)Upload(address), (std::streamsize)(SDHRStreamDecoder::UPLOAD_REGION_SIZE - address));
+		break;
+	}
+	case SDHR_CMD::DEFINE_IMAGE_ASSET:
+	{
+		SDHRCommandView<DefineImageAssetCmd> view;
+		cmd.As(&view);
+		const DefineImageAssetCmd& c = view.Fields();
+		LoadAsset(c.asset_index, Upload(UploadAddress(c.upload_addr_med, c.upload_addr_high)),
+			(size_t)c.upload_page_count * 256, std::string());
+		break;
+	}
+	case SDHR_CMD::DEFINE_IMAGE_ASSET_FILENAME:
+	{
+		SDHRCommandView<DefineImageAssetFilenameCmd> view;
+		cmd.As(&view);
+		LoadAsset(view.Fields().asset_index, nullptr, 0, std::string((const char*)view.Tail(), view.TailLength()));
+		break;
+	}
+	case SDHR_CMD::DEFINE_TILESET:
+	{
+		SDHRCommandView<DefineTilesetCmd> view;
+		cmd.As(&view);
+		const DefineTilesetCmd& c = view.Fields();
+		sTileset& ts = v_tilesets[c.tileset_index];
+		ts.entries = c.num_entries ? c.num_entries : 256;
+		ts.xdim = c.xdim;
+		ts.ydim = c.ydim;
+		ts.asset_index = c.asset_index;
+		memcpy(ts.origins, Upload(UploadAddress(c.data_med, c.data_high)), (size_t)ts.entries * 4);
+		break;
+	}
+	case SDHR_CMD::DEFINE_TILESET_IMMEDIATE:
+	{
+		SDHRCommandView<DefineTilesetImmediateCmd> view;
+		cmd.As(&view);
+		const DefineTilesetImmediateCmd& c = view.Fields();
+		sTileset& ts = v_tilesets[c.tileset_index];
+		ts.entries = c.num_entries ? c.num_entries : 256;
+		ts.xdim = c.xdim;
+		ts.ydim = c.ydim;
+		ts.asset_index = c.asset_index;
+		memcpy(ts.origins, view.Tail(), view.TailLength());
+		break;
+	}
+	case SDHR_CMD::DEFINE_WINDOW:
+	{
+		SDHRCommandView<DefineWindowCmd> view;
+		cmd.As(&view);
+		const DefineWindowCmd& c = view.Fields();
+		sWindow& w = v_windows[c.window_index];
+		w.isDefined = true;
+		w.isEnabled = false;
+		w.black_or_wrap = view.IsSet(&DefineWindowCmd::black_or_wrap);
+		w.screen_xbegin = c.screen_xbegin;
+		w.screen_ybegin = c.screen_ybegin;
+		w.screen_xcount = c.screen_xcount;
+		w.screen_ycount = c.screen_ycount;
+		w.tile_xbegin = c.tile_xbegin;
+		w.tile_ybegin = c.tile_ybegin;
+		w.tile_xdim = c.tile_xdim;
+		w.tile_ydim = c.tile_ydim;
+		w.tile_xcount = c.tile_xcount;
+		w.tile_ycount = c.tile_ycount;
+		w.v_tiles.assign(c.tile_xcount * c.tile_ycount * 2, 0);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SET_BOTH:
+	{
+		SDHRCommandView<UpdateWindowSetBothCmd> view;
+		cmd.As(&view);
+		const UpdateWindowSetBothCmd& c = view.Fields();
+		SetTiles(v_windows[c.window_index], c.tile_xbegin, c.tile_ybegin, c.tile_xcount, c.tile_ycount, view.Tail(), 0, false);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SET_UPLOAD:
+	{
+		SDHRCommandView<UpdateWindowSetUploadCmd> view;
+		cmd.As(&view);
+		const UpdateWindowSetUploadCmd& c = view.Fields();
+		SetTiles(v_windows[c.window_index], c.tile_xbegin, c.tile_ybegin, c.tile_xcount, c.tile_ycount,
+			Upload(UploadAddress(c.upload_addr_med, c.upload_addr_high)), 0, false);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SINGLE_TILESET:
+	{
+		SDHRCommandView<UpdateWindowSingleTilesetCmd> view;
+		cmd.As(&view);
+		const UpdateWindowSingleTilesetCmd& c = view.Fields();
+		SetTiles(v_windows[c.window_index], c.tile_xbegin, c.tile_ybegin, c.tile_xcount, c.tile_ycount,
+			view.Tail(), c.tileset_index, true);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SHIFT_TILES:
+	{
+		SDHRCommandView<UpdateWindowShiftTilesCmd> view;
+		cmd.As(&view);
+		ShiftTiles(v_windows[view.Fields().window_index], view.Fields().x_dir, view.Fields().y_dir);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SET_WINDOW_POSITION:
+	{
+		SDHRCommandView<UpdateWindowSetWindowPositionCmd> view;
+		cmd.As(&view);
+		sWindow& w = v_windows[view.Fields().window_index];
+		w.screen_xbegin = view.Fields().screen_xbegin;
+		w.screen_ybegin = view.Fields().screen_ybegin;
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_ADJUST_WINDOW_VIEW:
+	{
+		SDHRCommandView<UpdateWindowAdjustWindowViewCmd> view;
+		cmd.As(&view);
+		sWindow& w = v_windows[view.Fields().window_index];
+		w.tile_xbegin = view.Fields().tile_xbegin;
+		w.tile_ybegin = view.Fields().tile_ybegin;
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_ENABLE:
+	{
+		SDHRCommandView<UpdateWindowEnableCmd> view;
+		cmd.As(&view);
+		v_windows[view.Fields().window_index].isEnabled = view.IsSet(&UpdateWindowEnableCmd::enabled);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void SDHRCompositor::Render(UINT32* frame, UINT width, UINT height)
+{
+	std::fill(frame, frame + (size_t)width * height, (UINT32)BLACK);
+	for (auto const& w : v_windows)
+	{
+		if (w.isDefined && w.isEnabled)
+			RenderWindow(w, frame, width, height);
+	}
+	++stats.frames;
+}
+
+void SDHRCompositor::RenderWindow(const sWindow& w, UINT32* frame, UINT width, UINT height) const
+{
+	// Off the frame entirely: this also keeps the coordinates below from overflowing
+	if (w.screen_xbegin >= (int64_t)width || w.screen_ybegin >= (int64_t)height
+		|| w.screen_xbegin <= -(int64_t)w.screen_xcount || w.screen_ybegin <= -(int64_t)w.screen_ycount)
+		return;
+	const int64_t x0 = std::max<int64_t>(0, w.screen_xbegin);
+	const int64_t y0 = std::max<int64_t>(0, w.screen_ybegin);
+	const int64_t x1 = std::min<int64_t>(width, w.screen_xbegin + (int64_t)w.screen_xcount);
+	const int64_t y1 = std::min<int64_t>(height, w.screen_ybegin + (int64_t)w.screen_ycount);
+	const uint64_t totalWidth = w.tile_xcount * w.tile_xdim;
+	const uint64_t totalHeight = w.tile_ycount * w.tile_ydim;
+
+	for (int64_t y = y0; y < y1; ++y)
+	{
+		UINT32* row = frame + (size_t)y * width;
+		// The view may be anywhere: add unsigned, it can't overflow
+		int64_t ty = (int64_t)((uint64_t)w.tile_ybegin + (uint64_t)(y - w.screen_ybegin));
+		if (w.black_or_wrap)
+			ty = (int64_t)Wrap(ty, totalHeight);
+		else if (ty < 0 || (uint64_t)ty >= totalHeight)
+		{
+			std::fill(row + x0, row + x1, (UINT32)BLACK);
+			continue;
+		}
+		const uint8_t* records = w.v_tiles.data() + ((uint64_t)ty / w.tile_ydim) * w.tile_xcount * 2;
+		const uint64_t fy = (uint64_t)ty % w.tile_ydim;
+
+		int64_t x = x0;
+		while (x < x1)
+		{
+			int64_t tx = (int64_t)((uint64_t)w.tile_xbegin + (uint64_t)(x - w.screen_xbegin));
+			if (w.black_or_wrap)
+				tx = (int64_t)Wrap(tx, totalWidth);
+			else if (tx < 0)
+			{
+				// Up to the array's left edge
+				const int64_t run = (tx < x - x1) ? (x1 - x) : -tx;
+				std::fill(row + x, row + x + run, (UINT32)BLACK);
+				x += run;
+				continue;
+			}
+			else if ((uint64_t)tx >= totalWidth)
+			{
+				std::fill(row + x, row + x1, (UINT32)BLACK);
+				break;
+			}
+			// To the end of this tile
+			const uint64_t fx = (uint64_t)tx % w.tile_xdim;
+			const UINT run = (UINT)std::min<uint64_t>(w.tile_xdim - fx, (uint64_t)(x1 - x));
+			DrawTileRun(w, records + ((uint64_t)tx / w.tile_xdim) * 2, fx, fy, row + x, run);
+			x += run;
+		}
+	}
+}
+
+void SDHRCompositor::DrawTileRun(const sWindow& w, const uint8_t* record, uint64_t fx, uint64_t fy, UINT32* dst, UINT count) const
+{
+	const sTileset& ts = v_tilesets[record[0]];
+	const UINT index = record[1];
+	const sAsset& asset = v_assets[ts.asset_index];
+	// Tiles that don't point to an image are black
+	const uint64_t ox = (uint64_t)ts.origins[index * 2] * ts.xdim;
+	const uint64_t oy = (uint64_t)ts.origins[index * 2 + 1] * ts.ydim;
+	if (index >= ts.entries || asset.v_pixels.empty()
+		|| ox + ts.xdim > (uint64_t)asset.width || oy + ts.ydim > (uint64_t)asset.height)
+	{
+		std::fill(dst, dst + count, (UINT32)BLACK);
+		return;
+	}
+
+	if (ts.xdim == w.tile_xdim && ts.ydim == w.tile_ydim)
+	{
+		const UINT32* src = asset.v_pixels.data() + (oy + fy) * asset.width + ox + fx;
+		if (asset.isOpaque)
+		{
+			memcpy(dst, src, count * sizeof(UINT32));
+			return;
+		}
+		for (UINT i = 0; i < count; ++i)
+			dst[i] = Blend(src[i], dst[i]);
+		return;
+	}
+	// Tiles of another size than the window's are scaled to it, nearest pixel
+	const UINT32* src = asset.v_pixels.data() + (oy + fy * ts.ydim / w.tile_ydim) * asset.width + ox;
+	for (UINT i = 0; i < count; ++i)
+		dst[i] = Blend(src[(fx + i) * ts.xdim / w.tile_xdim], dst[i]);
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "SDHRDecoder.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief SDHRCompositor
+ * Renders SDHR commands on the CPU, without AppleWin: keeps the upload region, the image assets
+ * (decoded with stb_image), the tilesets and the windows, applies decoded commands to them, and
+ * composes the enabled windows into a 32-bit 0xAARRGGBB frame.
+ * Windows are drawn in index order over black, each clipped to its screen area. Its view starts at
+ * pixel tile_xbegin/tile_ybegin of its tile array. Outside the array the window is black, or the view
+ * wraps around it if black_or_wrap is set. Image pixels are blended over what's below by their alpha.
+ * Commands go through SDHRStreamDecoder first: invalid ones are skipped, as the host would.
+*/
+class SDHRCompositor
+{
+public:
+	enum : UINT32 { BLACK = 0xFF000000 };
+
+	struct sStats
+	{
+		UINT64 commands = 0;		// applied
+		UINT64 rejected = 0;		// invalid, skipped
+		UINT64 load_failures = 0;	// files and images that couldn't be loaded or decoded
+		UINT64 frames = 0;
+	};
+
+	SDHRCompositor();
+
+	// Decodes and applies the commands of stream in order. Returns false if any was skipped.
+	bool Apply(const uint8_t* stream, size_t length);
+	bool Apply(const std::vector<uint8_t>& v_stream) { return Apply(v_stream.data(), v_stream.size()); }
+	// Composes the enabled windows into frame, width * height pixels
+	void Render(UINT32* frame, UINT width, UINT height);
+	// Forgets everything, as after SDHR_reset()
+	void Reset();
+
+	// UploadData's source, the emulated Apple II memory. Without it UploadData uploads zeros.
+	void SetAppleMemory(const UINT8* memory, size_t length) { p_apple_memory = memory; apple_memory_length = length; }
+	bool HasEnabledWindow() const;
+	sStats GetStats() const { return stats; }
+
+private:
+	struct sAsset
+	{
+		int width = 0;
+		int height = 0;
+		bool isOpaque = true;		// no pixel to blend: rows are copied
+		std::vector<UINT32> v_pixels;
+	};
+
+	struct sTileset
+	{
+		UINT16 entries = 0;			// 0 while undefined
+		UINT8 xdim = 0;
+		UINT8 ydim = 0;
+		UINT8 asset_index = 0;
+		UINT16 origins[256 * 2] = {};	// x, y of each tile in the asset, in tiles of xdim * ydim
+	};
+
+	struct sWindow
+	{
+		bool isDefined = false;
+		bool isEnabled = false;
+		bool black_or_wrap = false;
+		int64_t screen_xbegin = 0;
+		int64_t screen_ybegin = 0;
+		uint64_t screen_xcount = 0;
+		uint64_t screen_ycount = 0;
+		int64_t tile_xbegin = 0;
+		int64_t tile_ybegin = 0;
+		uint64_t tile_xdim = 0;
+		uint64_t tile_ydim = 0;
+		uint64_t tile_xcount = 0;
+		uint64_t tile_ycount = 0;
+		std::vector<uint8_t> v_tiles;	// [tileset][index] per tile, row by row
+	};
+
+	void ApplyCommand(const sSDHRDecodedCommand& cmd);
+	uint8_t* Upload(uint64_t address);
+	void LoadAsset(UINT8 asset_index, const uint8_t* encoded, size_t length, const std::string& filename);
+	// Writes a rectangle of tiles, row by row from src: [tileset][index] records, or index bytes of single_tileset
+	void SetTiles(sWindow& w, int64_t xbegin, int64_t ybegin, uint64_t xcount, uint64_t ycount,
+		const uint8_t* src, UINT8 single_tileset, bool isSingle);
+	void ShiftTiles(sWindow& w, int x_dir, int y_dir);
+	void RenderWindow(const sWindow& w, UINT32* frame, UINT width, UINT height) const;
+	// Draws count pixels of tile record (tileset, index), from pixel fx, fy of the window's tile
+	void DrawTileRun(const sWindow& w, const uint8_t* record, uint64_t fx, uint64_t fy, UINT32* dst, UINT count) const;
+
+	SDHRStreamDecoder decoder;
+	std::vector<uint8_t> v_upload;		// UPLOAD_REGION_SIZE bytes once anything is uploaded
+	std::vector<sAsset> v_assets;
+	std::vector<sTileset> v_tilesets;
+	std::vector<sWindow> v_windows;
+	const UINT8* p_apple_memory = nullptr;
+	size_t apple_memory_length = 0;
+	sStats stats;
+};
@@ -0,0 +1,397 @@
+#include "SDHRDecoder.h"
+
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+// Start of a 24-bit address in the upload region
+static uint64_t UploadAddress(uint8_t addr_med, uint8_t addr_high)
+{
+	return ((uint64_t)addr_high << 16) | ((uint64_t)addr_med << 8);
+}
+
+static bool IsUploadRangeValid(uint64_t address, uint64_t length)
+{
+	return length <= SDHRStreamDecoder::UPLOAD_REGION_SIZE && address <= SDHRStreamDecoder::UPLOAD_REGION_SIZE - length;
+}
+
+static bool IsDimensionValid(uint64_t pixels)
+{
+	return pixels > 0 && pixels <= SDHRStreamDecoder::MAX_DIMENSION;
+}
+
+static bool IsFilenameValid(const uint8_t* name, size_t length)
+{
+	// Not null terminated, and no null within either
+	return length > 0 && memchr(name, 0, length) == nullptr;
+}
+
+//------------------------------------------------------------------------------
+// Methods
+//------------------------------------------------------------------------------
+
+void SDHRStreamDecoder::Feed(const uint8_t* stream, size_t length)
+{
+	p_stream = stream;
+	stream_length = (stream != nullptr) ? length : 0;
+	position = 0;
+	framing_error = SDHRDecodeError::NONE;
+}
+
+bool SDHRStreamDecoder::Next(sSDHRDecodedCommand* cmd)
+{
+	if (position >= stream_length || framing_error != SDHRDecodeError::NONE)
+		return false;
+	const size_t remaining = stream_length - position;
+	uint16_t size = 0;
+	if (remaining >= 2)
+		memcpy(&size, p_stream + position, 2);
+	if (remaining < 3 || (size_t)size + 3 > remaining)
+	{
+		framing_error = SDHRDecodeError::TRUNCATED;
+		++stats.errors;
+		return false;
+	}
+	cmd->id = (SDHR_CMD)p_stream[position + 2];
+	cmd->body = p_stream + position + 2;
+	cmd->length = (size_t)size + 1;
+	cmd->offset = position;
+	position += (size_t)size + 3;
+
+	cmd->error = Check(*cmd);
+	++stats.commands;
+	stats.bytes += (size_t)size + 3;
+	if (cmd->error != SDHRDecodeError::NONE)
+		++stats.errors;
+	return true;
+}
+
+SDHRDecodeError SDHRStreamDecoder::ValidateAll(size_t* errorOffset)
+{
+	SDHRDecodeError first = SDHRDecodeError::NONE;
+	size_t firstOffset = 0;
+	sSDHRDecodedCommand cmd;
+	while (Next(&cmd))
+	{
+		if (cmd.error != SDHRDecodeError::NONE && first == SDHRDecodeError::NONE)
+		{
+			first = cmd.error;
+			firstOffset = cmd.offset;
+		}
+	}
+	if (framing_error != SDHRDecodeError::NONE && first == SDHRDecodeError::NONE)
+	{
+		first = framing_error;
+		firstOffset = position;
+	}
+	if (errorOffset != nullptr)
+		*errorOffset = firstOffset;
+	return first;
+}
+
+void SDHRStreamDecoder::Reset()
+{
+	std::fill(std::begin(windows), std::end(windows), sWindow());
+	std::fill(std::begin(tileset_entries), std::end(tileset_entries), (UINT16)0);
+	std::fill(std::begin(isAssetDefined), std::end(isAssetDefined), false);
+	full_tilesets = 0;
+}
+
+void SDHRStreamDecoder::DefineTileset(uint8_t tileset_index, UINT entries)
+{
+	tileset_entries[tileset_index] = (UINT16)entries;
+	full_tilesets = 0;
+	while (full_tilesets < MAX_TILESETS && tileset_entries[full_tilesets] == 256)
+		++full_tilesets;
+}
+
+// UpdateWindowSetBoth's [tileset][index] records
+bool SDHRStreamDecoder::AreTileRecordsValid(const uint8_t* tiles, size_t length) const
+{
+	// Usually the tiles only use full tilesets numbered from 0: then any index is fine, and it's
+	// enough that the OR of all tileset bytes (the even ones, 8 bytes at a time) is below full_tilesets.
+	// The mask picks them out of little-endian words.
+	uint64_t ored = 0;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, tiles + i, 8);
+		ored |= word;
+	}
+	ored &= 0x00FF00FF00FF00FFull;
+	UINT tilesets = (UINT)((ored | (ored >> 16) | (ored >> 32) | (ored >> 48)) & 0xFF);
+	for (; i < length; i += 2)
+		tilesets |= tiles[i];
+	if (tilesets < full_tilesets)
+		return true;
+
+	// Otherwise each record: an undefined tileset has 0 entries, so one compare covers both.
+	// No early exit, so the loop has no branch in it.
+	const size_t count = length / 2;
+	UINT bad = 0;
+	for (size_t t = 0; t < count; ++t)
+		bad |= (UINT)(tiles[2 * t + 1] >= tileset_entries[tiles[2 * t]]);
+	return bad == 0;
+}
+
+SDHRDecodeError SDHRStreamDecoder::CheckWindow(int8_t window_index) const
+{
+	if (window_index < 0 || window_index >= (int)MAX_WINDOWS)
+		return SDHRDecodeError::BAD_WINDOW;
+	if (isCheckingDefinitions && !windows[window_index].isDefined)
+		return SDHRDecodeError::UNDEFINED_WINDOW;
+	return SDHRDecodeError::NONE;
+}
+
+SDHRDecodeError SDHRStreamDecoder::CheckTileRange(int8_t window_index, int64_t xbegin, int64_t ybegin,
+	uint64_t xcount, uint64_t ycount) const
+{
+	if (window_index < 0 || window_index >= (int)MAX_WINDOWS)
+		return SDHRDecodeError::BAD_WINDOW;
+	// Bounded first, so the product can't overflow (nor could the tail length it was checked against)
+	if (xcount > MAX_WINDOW_TILES || ycount > MAX_WINDOW_TILES || xcount * ycount > MAX_WINDOW_TILES)
+		return SDHRDecodeError::BAD_DIMENSIONS;
+	if (xbegin < 0 || ybegin < 0)
+		return SDHRDecodeError::BAD_TILE_RANGE;
+	if (!isCheckingDefinitions)
+		return SDHRDecodeError::NONE;
+	const sWindow& w = windows[window_index];
+	if (!w.isDefined)
+		return SDHRDecodeError::UNDEFINED_WINDOW;
+	if ((uint64_t)xbegin > w.tile_xcount || xcount > w.tile_xcount - (uint64_t)xbegin
+		|| (uint64_t)ybegin > w.tile_ycount || ycount > w.tile_ycount - (uint64_t)ybegin)
+		return SDHRDecodeError::BAD_TILE_RANGE;
+	return SDHRDecodeError::NONE;
+}
+
+SDHRDecodeError SDHRStreamDecoder::Check(const sSDHRDecodedCommand& cmd)
+{
+	SDHRDecodeError error = SDHRDecodeError::NONE;
+	switch (cmd.id)
+	{
+	case SDHR_CMD::UPLOAD_DATA:
+	{
+		SDHRCommandView<UploadDataCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		const UploadDataCmd& c = view.Fields();
+		const uint64_t length = (uint64_t)c.num_256b_pages * 256;
+		if (!IsUploadRangeValid(UploadAddress(c.dest_addr_med, c.dest_addr_high), length)
+			|| (uint64_t)c.source_addr_med * 256 + length > APPLE_MEMORY_SIZE)
+			return SDHRDecodeError::BAD_UPLOAD_RANGE;
+		break;
+	}
+	case SDHR_CMD::UPLOAD_DATA_FILENAME:
+	{
+		SDHRCommandView<UploadDataFilenameCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		if (!IsFilenameValid(view.Tail(), view.TailLength()))
+			return SDHRDecodeError::BAD_FILENAME;
+		break;
+	}
+	case SDHR_CMD::DEFINE_IMAGE_ASSET:
+	{
+		SDHRCommandView<DefineImageAssetCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		const DefineImageAssetCmd& c = view.Fields();
+		if (c.upload_page_count == 0)
+			return SDHRDecodeError::BAD_DIMENSIONS;
+		if (!IsUploadRangeValid(UploadAddress(c.upload_addr_med, c.upload_addr_high), (uint64_t)c.upload_page_count * 256))
+			return SDHRDecodeError::BAD_UPLOAD_RANGE;
+		isAssetDefined[c.asset_index] = true;
+		break;
+	}
+	case SDHR_CMD::DEFINE_IMAGE_ASSET_FILENAME:
+	{
+		SDHRCommandView<DefineImageAssetFilenameCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		if (!IsFilenameValid(view.Tail(), view.TailLength()))
+			return SDHRDecodeError::BAD_FILENAME;
+		isAssetDefined[view.Fields().asset_index] = true;
+		break;
+	}
+	case SDHR_CMD::DEFINE_TILESET:
+	{
+		SDHRCommandView<DefineTilesetCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		const DefineTilesetCmd& c = view.Fields();
+		const UINT entries = c.num_entries ? c.num_entries : 256;
+		if (c.xdim == 0 || c.ydim == 0)
+			return SDHRDecodeError::BAD_DIMENSIONS;
+		if (isCheckingDefinitions && !isAssetDefined[c.asset_index])
+			return SDHRDecodeError::UNDEFINED_ASSET;
+		if (!IsUploadRangeValid(UploadAddress(c.data_med, c.data_high), (uint64_t)entries * 4))
+			return SDHRDecodeError::BAD_UPLOAD_RANGE;
+		DefineTileset(c.tileset_index, entries);
+		break;
+	}
+	case SDHR_CMD::DEFINE_TILESET_IMMEDIATE:
+	{
+		SDHRCommandView<DefineTilesetImmediateCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		const DefineTilesetImmediateCmd& c = view.Fields();
+		if (c.xdim == 0 || c.ydim == 0)
+			return SDHRDecodeError::BAD_DIMENSIONS;
+		if (isCheckingDefinitions && !isAssetDefined[c.asset_index])
+			return SDHRDecodeError::UNDEFINED_ASSET;
+		DefineTileset(c.tileset_index, c.num_entries ? c.num_entries : 256);
+		break;
+	}
+	case SDHR_CMD::DEFINE_WINDOW:
+	{
+		SDHRCommandView<DefineWindowCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		const DefineWindowCmd& c = view.Fields();
+		if (c.window_index < 0 || c.window_index >= (int)MAX_WINDOWS)
+			return SDHRDecodeError::BAD_WINDOW;
+		if (!IsDimensionValid(c.screen_xcount) || !IsDimensionValid(c.screen_ycount)
+			|| !IsDimensionValid(c.tile_xdim) || !IsDimensionValid(c.tile_ydim)
+			|| c.tile_xcount == 0 || c.tile_ycount == 0
+			|| c.tile_xcount > MAX_WINDOW_TILES || c.tile_ycount > MAX_WINDOW_TILES
+			|| c.tile_xcount * c.tile_ycount > MAX_WINDOW_TILES)
+			return SDHRDecodeError::BAD_DIMENSIONS;
+		windows[c.window_index] = { true, c.tile_xcount, c.tile_ycount };
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SET_BOTH:
+	{
+		SDHRCommandView<UpdateWindowSetBothCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		const UpdateWindowSetBothCmd& c = view.Fields();
+		error = CheckTileRange(c.window_index, c.tile_xbegin, c.tile_ybegin, c.tile_xcount, c.tile_ycount);
+		if (error != SDHRDecodeError::NONE || !isCheckingDefinitions)
+			break;
+		if (!AreTileRecordsValid(view.Tail(), view.TailLength()))
+			return SDHRDecodeError::BAD_TILE;
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SET_UPLOAD:
+	{
+		SDHRCommandView<UpdateWindowSetUploadCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		const UpdateWindowSetUploadCmd& c = view.Fields();
+		error = CheckTileRange(c.window_index, c.tile_xbegin, c.tile_ybegin, c.tile_xcount, c.tile_ycount);
+		if (error != SDHRDecodeError::NONE)
+			break;
+		if (!IsUploadRangeValid(UploadAddress(c.upload_addr_med, c.upload_addr_high), c.tile_xcount * c.tile_ycount * 2))
+			return SDHRDecodeError::BAD_UPLOAD_RANGE;
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SINGLE_TILESET:
+	{
+		SDHRCommandView<UpdateWindowSingleTilesetCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		const UpdateWindowSingleTilesetCmd& c = view.Fields();
+		error = CheckTileRange(c.window_index, c.tile_xbegin, c.tile_ybegin, c.tile_xcount, c.tile_ycount);
+		if (error != SDHRDecodeError::NONE || !isCheckingDefinitions)
+			break;
+		const UINT entries = tileset_entries[c.tileset_index];
+		if (entries == 0)
+			return SDHRDecodeError::UNDEFINED_TILESET;
+		// Any byte is a valid index of a full tileset
+		if (entries < 256 && view.TailLength() > 0
+			&& *std::max_element(view.Tail(), view.Tail() + view.TailLength()) >= entries)
+			return SDHRDecodeError::BAD_TILE;
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SHIFT_TILES:
+	{
+		SDHRCommandView<UpdateWindowShiftTilesCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		error = CheckWindow(view.Fields().window_index);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SET_WINDOW_POSITION:
+	{
+		SDHRCommandView<UpdateWindowSetWindowPositionCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		error = CheckWindow(view.Fields().window_index);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_ADJUST_WINDOW_VIEW:
+	{
+		SDHRCommandView<UpdateWindowAdjustWindowViewCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		error = CheckWindow(view.Fields().window_index);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_ENABLE:
+	{
+		SDHRCommandView<UpdateWindowEnableCmd> view;
+		if (!cmd.As(&view))
+			return SDHRDecodeError::BAD_LENGTH;
+		error = CheckWindow(view.Fields().window_index);
+		break;
+	}
+	case SDHR_CMD::READY:
+		// Ends the batch: [0x0000][READY]
+		if (cmd.length != 1)
+			return SDHRDecodeError::BAD_LENGTH;
+		++stats.batches;
+		break;
+	default:
+		return SDHRDecodeError::UNKNOWN_COMMAND;
+	}
+	return error;
+}
+
+const char* SDHRStreamDecoder::GetCommandName(SDHR_CMD id)
+{
+	switch (id)
+	{
+	case SDHR_CMD::NONE: return "None";
+	case SDHR_CMD::UPLOAD_DATA: return "UploadData";
+	case SDHR_CMD::DEFINE_IMAGE_ASSET: return "DefineImageAsset";
+	case SDHR_CMD::DEFINE_IMAGE_ASSET_FILENAME: return "DefineImageAssetFilename";
+	case SDHR_CMD::DEFINE_TILESET: return "DefineTileset";
+	case SDHR_CMD::DEFINE_TILESET_IMMEDIATE: return "DefineTilesetImmediate";
+	case SDHR_CMD::DEFINE_WINDOW: return "DefineWindow";
+	case SDHR_CMD::UPDATE_WINDOW_SET_BOTH: return "UpdateWindowSetBoth";
+	case SDHR_CMD::UPDATE_WINDOW_SINGLE_TILESET: return "UpdateWindowSingleTileset";
+	case SDHR_CMD::UPDATE_WINDOW_SHIFT_TILES: return "UpdateWindowShiftTiles";
+	case SDHR_CMD::UPDATE_WINDOW_SET_WINDOW_POSITION: return "UpdateWindowSetWindowPosition";
+	case SDHR_CMD::UPDATE_WINDOW_ADJUST_WINDOW_VIEW: return "UpdateWindowAdjustWindowView";
+	case SDHR_CMD::UPDATE_WINDOW_SET_BITMASKS: return "UpdateWindowSetBitmasks";
+	case SDHR_CMD::UPDATE_WINDOW_ENABLE: return "UpdateWindowEnable";
+	case SDHR_CMD::READY: return "Ready";
+	case SDHR_CMD::UPLOAD_DATA_FILENAME: return "UploadDataFilename";
+	case SDHR_CMD::UPDATE_WINDOW_SET_UPLOAD: return "UpdateWindowSetUpload";
+	default: return "unknown";
+	}
+}
+
+const char* SDHRStreamDecoder::GetErrorName(SDHRDecodeError error)
+{
+	switch (error)
+	{
+	case SDHRDecodeError::NONE: return "ok";
+	case SDHRDecodeError::TRUNCATED: return "truncated";
+	case SDHRDecodeError::UNKNOWN_COMMAND: return "unknown command";
+	case SDHRDecodeError::BAD_LENGTH: return "bad length";
+	case SDHRDecodeError::BAD_WINDOW: return "bad window index";
+	case SDHRDecodeError::UNDEFINED_WINDOW: return "undefined window";
+	case SDHRDecodeError::UNDEFINED_TILESET: return "undefined tileset";
+	case SDHRDecodeError::UNDEFINED_ASSET: return "undefined asset";
+	case SDHRDecodeError::BAD_DIMENSIONS: return "bad dimensions";
+	case SDHRDecodeError::BAD_TILE_RANGE: return "tiles outside the window";
+	case SDHRDecodeError::BAD_TILE: return "bad tile";
+	case SDHRDecodeError::BAD_UPLOAD_RANGE: return "bad upload range";
+	case SDHRDecodeError::BAD_FILENAME: return "bad filename";
+	default: return "unknown";
+	}
+}
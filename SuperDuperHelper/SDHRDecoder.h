@@ -0,0 +1,116 @@
+#pragma once
+
+#include "SDHRCommand.h"
+
+/**
+ * @brief Why SDHRStreamDecoder rejected a command
+*/
+enum class SDHRDecodeError : UINT8 {
+	NONE = 0,
+	TRUNCATED,				// the size header or the command runs past the end of the stream (framing)
+	UNKNOWN_COMMAND,		// an id without a command struct, skipped by its size
+	BAD_LENGTH,				// the size doesn't match the fields and the tail they announce
+	BAD_WINDOW,				// window_index out of range
+	UNDEFINED_WINDOW,
+	UNDEFINED_TILESET,
+	UNDEFINED_ASSET,
+	BAD_DIMENSIONS,			// zero or huge window, tile or screen sizes
+	BAD_TILE_RANGE,			// tiles outside the window's tile array
+	BAD_TILE,				// a tile record with an undefined tileset or an index past its entries
+	BAD_UPLOAD_RANGE,		// past the end of the upload region or of the Apple II memory
+	BAD_FILENAME,
+	COUNT
+};
+
+/**
+ * @brief One command of an SDHR stream, as SDHRStreamDecoder::Next() returns it
+ * body points into the stream: nothing is copied. As() reads it back as its command struct.
+*/
+struct sSDHRDecodedCommand
+{
+	SDHR_CMD id;
+	const uint8_t* body;	// [id][fields][tail], after the size header
+	size_t length;			// of the body
+	size_t offset;			// of the size header, from the start of the stream
+	SDHRDecodeError error;
+
+	template <typename TCmd> requires SDHRCommandTraits<TCmd>::is_command
+	bool As(SDHRCommandView<TCmd>* view) const { return view->Decode(body, length); }
+};
+
+/**
+ * @brief SDHRStreamDecoder
+ * Walks the [uint16 size][id][fields][tail] commands that SDHRCommandBatcher::Publish() writes after
+ * the GameLink tag, and checks every field the way the host would have to before acting on it:
+ * the size against the fields and tail, tile counts against the tile data, window, tileset and asset
+ * indexes, tile rectangles against the window's tile array, and upload addresses against the upload region.
+ * Windows, tilesets and assets are remembered across Feed() calls, as the host keeps them across batches,
+ * so a stream is judged by the definitions before it. Turn that off to inspect a capture that starts midway.
+ * The fields are read through SDHRCommandView, which copies them to an aligned struct; the tail never is.
+*/
+class SDHRStreamDecoder
+{
+public:
+	enum : UINT {
+		MAX_WINDOWS = 16,						// the host's window table
+		MAX_TILESETS = 256,
+		MAX_ASSETS = 256,
+		UPLOAD_REGION_SIZE = 1 << 24,			// 24-bit addresses, from addr_med and addr_high
+		APPLE_MEMORY_SIZE = 1 << 16,			// UploadData's source
+		MAX_WINDOW_TILES = 1 << 24,				// tile_xcount * tile_ycount
+		MAX_DIMENSION = 1 << 16,				// of screen areas and tiles, in pixels
+	};
+
+	struct sStats
+	{
+		UINT64 commands = 0;
+		UINT64 bytes = 0;
+		UINT64 errors = 0;
+		UINT64 batches = 0;		// READY commands
+	};
+
+	// Starts on the next stream (a message's SDHR bytes, or a whole capture), keeping the definitions
+	void Feed(const uint8_t* stream, size_t length);
+	// Decodes and checks the next command into cmd. A command that fails a check still comes out,
+	// with cmd->error set, and decoding goes on after it. Returns false at the end of the stream,
+	// or at a framing error past which nothing can be read (GetFramingError() tells).
+	bool Next(sSDHRDecodedCommand* cmd);
+	// Runs Next() over the rest of the stream. Returns the first error, and where its command starts.
+	SDHRDecodeError ValidateAll(size_t* errorOffset = nullptr);
+
+	SDHRDecodeError GetFramingError() const { return framing_error; }
+	// Forgets the windows, tilesets and assets
+	void Reset();
+	// Off: commands referring to windows, tilesets or assets aren't checked against their definitions
+	void SetCheckDefinitions(bool check) { isCheckingDefinitions = check; }
+	sStats GetStats() const { return stats; }
+
+	static const char* GetCommandName(SDHR_CMD id);
+	static const char* GetErrorName(SDHRDecodeError error);
+
+private:
+	struct sWindow
+	{
+		bool isDefined;
+		uint64_t tile_xcount;
+		uint64_t tile_ycount;
+	};
+
+	SDHRDecodeError Check(const sSDHRDecodedCommand& cmd);
+	SDHRDecodeError CheckWindow(int8_t window_index) const;
+	SDHRDecodeError CheckTileRange(int8_t window_index, int64_t xbegin, int64_t ybegin, uint64_t xcount, uint64_t ycount) const;
+	bool AreTileRecordsValid(const uint8_t* tiles, size_t length) const;
+	void DefineTileset(uint8_t tileset_index, UINT entries);
+
+	const uint8_t* p_stream = nullptr;
+	size_t stream_length = 0;
+	size_t position = 0;
+	SDHRDecodeError framing_error = SDHRDecodeError::NONE;
+
+	bool isCheckingDefinitions = true;
+	sWindow windows[MAX_WINDOWS] = {};
+	UINT16 tileset_entries[MAX_TILESETS] = {};	// 0 while undefined
+	UINT full_tilesets = 0;						// tilesets 0 to full_tilesets - 1 all have 256 entries
+	bool isAssetDefined[MAX_ASSETS] = {};
+	sStats stats;
+};
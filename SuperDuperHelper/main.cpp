@@ -8,6 +8,7 @@
 #include "imgui_impl_opengl3.h"
 #include "misc/cpp/imgui_stdlib.h"
 #include <stdio.h>
+#include <cmath>
 #include <memory>
 #include <SDL.h>
 #include "font8x8.h"
@@ -21,6 +22,10 @@
 #endif
 
 #include "ImageHelper.h"
+#include "FrameCapture.h"
+#include "RamBindings.h"
+#include "PCProfiler.h"
+#include "RamHistory.h"
 #include "ImGuiFileDialog/ImGuiFileDialog.h"
 #include "ini.h"
 
@@ -28,11 +33,10 @@
 #ifdef __EMSCRIPTEN__
 #include "../libs/emscripten/emscripten_mainloop_stub.h"
 #endif
-#include <map>
 
 #include "SDHRCommand.h"
-
-std::map<int, bool> keyboard; // Saves the state(true=pressed; false=released) of each SDL_Key.
+#include "InputAccumulator.h"
+#include "LatencyTracer.h"
 
 // Main code
 int main(int, char**)
@@ -127,7 +131,15 @@ int main(int, char**)
 	int my_image_width = 0;
 	int my_image_height = 0;
 	GLuint my_image_texture = 0;
-	GLuint gamelink_video_texture = 0;
+	ImageHelper::StreamingTexture gamelink_video_texture;
+	gamelink_video_texture.EnablePixelBuffers(3);	// asynchronous uploads where GL has PBOs
+	GameLink::sFramebufferInfo gamelink_video_info = GameLink::sFramebufferInfo();	// of the frame in gamelink_video_texture
+	UINT64 gamelink_frames_uploaded = 0;	// UI frames that uploaded a new AppleWin frame
+	UINT64 gamelink_frames_skipped = 0;		// UI frames that reused the texture
+	double gamelink_upload_fraction = 0.0;	// of the pixels of new frames, how many were uploaded in the last second
+	uint64_t gamelink_pixels_submitted = 0;
+	uint64_t gamelink_pixels_uploaded = 0;
+	double gamelink_upload_sample_time = 0.0;
 
     // Our state
     bool show_demo_window = false;
@@ -135,6 +147,9 @@ int main(int, char**)
 	bool show_tileset_window = false;
 	bool show_gamelink_video_window = true;
     bool is_gamelink_focused = false;
+    bool is_gamelink_hovered = false;	// the mouse is over the video
+    InputAccumulator gamelink_input;	// keys, mouse and gamepad for AppleWin, sent from its own thread
+    const UINT gamelink_input_rate = 250;	// per second, so input waits 4ms at most
 	ImGuiFileDialog instance_a;
 	ImGuiFileDialog dialog_data;
 	ImGuiFileDialog dialog_image0;
@@ -232,6 +247,30 @@ int main(int, char**)
     	
     }
 
+    GameLink::sWaitPolicy wait_policy;
+    try
+    {
+        wait_policy.spin_count = std::stoi(ini["GameLink"]["Wait_spin_count"]);
+        wait_policy.block_slice_ms = std::stoi(ini["GameLink"]["Wait_block_slice_ms"]);
+        wait_policy.timeout_ms = std::stoi(ini["GameLink"]["Wait_timeout_ms"]);
+    }
+    catch (const std::exception& e)
+    {
+
+    }
+    GameLink::SetWaitPolicy(wait_policy);
+
+    float gamepad_speed = gamelink_input.GetGamepadSpeed();
+    try
+    {
+        gamepad_speed = std::stof(ini["Input"]["Gamepad_speed"]);
+    }
+    catch (const std::exception& e)
+    {
+
+    }
+    gamelink_input.SetGamepadSpeed(gamepad_speed);
+
 
 
 
@@ -244,6 +283,54 @@ int main(int, char**)
     int64_t tile_posx = 560;  // coords of iolo's hut
     int64_t tile_posy = 832;
 
+    // GameLink statistics, sampled every second to show rates
+    GameLink::sStats stats_last;
+    GameLink::sStats stats_per_sec;
+    double stats_sample_time = 0.0;
+
+    // AppleWin frames, captured in the background while the video window is shown
+    FrameCapture frame_capture;
+
+    // Where the emulated program spends its time
+    PCProfiler pc_profiler;
+    int pc_profiler_rate = 10000;
+    bool show_profiler_window = false;
+
+    // Recorded RAM, to find where the game keeps its state
+    RamHistory ram_history;
+    bool record_ram_history = false;
+    bool show_ram_history_window = false;
+    int ram_history_a = 0;
+    int ram_history_b = 0;
+    size_t ram_history_differing = 0;
+    std::vector<RamHistory::sDiff> ram_history_diffs;
+    bool ram_history_diff_stale = true;
+
+    // RAM values read together through a peek set, e.g. where the game keeps its state
+    std::string peek_addresses = ini["Peek"]["Peek_addresses"];
+    std::vector<UINT> v_peek_addresses;
+    std::vector<UINT8> v_peek_values;
+    int peek_set = -1;
+
+    // Every SDHR batch goes through it, so its arena is reused rather than allocated each time
+    SDHRCommandBatcher batcher;
+
+    // How long SDHR batches take to show up
+    LatencyTracer latency_tracer;
+    SDHRCommandBatcher::SetSink(GameLink::GetSDHRBatchSink());
+    SDHRCommandBatcher::SetPublishCallback([&latency_tracer](UINT32 type_mask, std::chrono::steady_clock::time_point publish_time) {
+        latency_tracer.RecordPublish(type_mask, publish_time);
+    });
+    bool show_latency_window = false;
+    std::string latency_csv_filename = "sdhr_latency.csv";
+
+    // SDHR commands driven by the game's RAM, evaluated once per AppleWin frame
+    RamBindings ram_bindings;
+    bool activate_bindings = false;
+    std::string bindings_filename = ini["Bindings"]["Bindings_filename"];
+    if (!bindings_filename.empty())
+        ram_bindings.Load(bindings_filename);
+
     // Main loop
     bool done = false;
 #ifdef __EMSCRIPTEN__
@@ -271,18 +358,46 @@ int main(int, char**)
 				switch (event.type)
 				{
 				case SDL_KEYDOWN:
-					keyboard[event.key.keysym.sym] = true;
-                    if (GameLink::IsActive())
-                        GameLink::SendKeystroke((UINT)SDL_GetScancodeFromKey(event.key.keysym.sym), true);
+					gamelink_input.SetKey((UINT)SDL_GetScancodeFromKey(event.key.keysym.sym), true);
 					break;
 				case SDL_KEYUP:
-					keyboard[event.key.keysym.sym] = false;
-                    if (GameLink::IsActive())
-					    GameLink::SendKeystroke((UINT)SDL_GetScancodeFromKey(event.key.keysym.sym), false);
+					gamelink_input.SetKey((UINT)SDL_GetScancodeFromKey(event.key.keysym.sym), false);
+					break;
+				// The mouse only goes to AppleWin when the host asks for it, and is over the video.
+				// Releases always do, so no button stays down.
+				case SDL_MOUSEMOTION:
+					if (is_gamelink_hovered && gamelink_video_info.wantsMouse)
+						gamelink_input.AddMouseMotion((float)event.motion.xrel, (float)event.motion.yrel);
+					break;
+				case SDL_MOUSEBUTTONDOWN:
+				case SDL_MOUSEBUTTONUP:
+					if ((is_gamelink_hovered && gamelink_video_info.wantsMouse) || event.type == SDL_MOUSEBUTTONUP)
+					{
+						if (event.button.button == SDL_BUTTON_LEFT)
+							gamelink_input.SetMouseButton(0, event.type == SDL_MOUSEBUTTONDOWN);
+						else if (event.button.button == SDL_BUTTON_RIGHT)
+							gamelink_input.SetMouseButton(1, event.type == SDL_MOUSEBUTTONDOWN);
+					}
+					break;
+				case SDL_CONTROLLERAXISMOTION:
+					if (event.caxis.axis == SDL_CONTROLLER_AXIS_LEFTX)
+						gamelink_input.SetGamepadAxis(0, event.caxis.value / 32767.f);
+					else if (event.caxis.axis == SDL_CONTROLLER_AXIS_LEFTY)
+						gamelink_input.SetGamepadAxis(1, event.caxis.value / 32767.f);
+					break;
+				case SDL_CONTROLLERBUTTONDOWN:
+				case SDL_CONTROLLERBUTTONUP:
+					if (event.cbutton.button == SDL_CONTROLLER_BUTTON_A)
+						gamelink_input.SetGamepadButton(0, event.type == SDL_CONTROLLERBUTTONDOWN);
+					else if (event.cbutton.button == SDL_CONTROLLER_BUTTON_B)
+						gamelink_input.SetGamepadButton(1, event.type == SDL_CONTROLLERBUTTONDOWN);
 					break;
 				}
 #pragma warning(pop)
             }
+            // Open gamepads as they're plugged in, SDL closes them when they go
+            if (event.type == SDL_CONTROLLERDEVICEADDED)
+                SDL_GameControllerOpen(event.cdevice.which);
             if (event.type == SDL_QUIT)
                 done = true;
             if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE && event.window.windowID == SDL_GetWindowID(window))
@@ -290,16 +405,14 @@ int main(int, char**)
         }
         // Sample on how to deal with keyboard events
         /*
-        if (keyboard.contains(SDLK_RETURN))
-        {
-            if (keyboard.at(SDLK_RETURN) == true)
-                printf("Return has been pressed.\n");
-            else
-                printf("Return has been released.\n");
-        }
+        if (gamelink_input.IsKeyDown(SDL_SCANCODE_RETURN))
+            printf("Return is pressed.\n");
         */
 
-        keyboard.clear();
+        // Input goes to AppleWin from its own thread at a fixed rate, whatever our frame rate.
+        // Nothing stays down once the video window loses focus.
+        if (!is_gamelink_focused)
+            gamelink_input.ReleaseAll();
 
         // Start the Dear ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
@@ -322,11 +435,143 @@ int main(int, char**)
             if (ImGui::Checkbox("GameLink Active", &activate_gamelink))
             {
 				if (!GameLink::IsActive() && activate_gamelink)
+				{
 					activate_gamelink = GameLink::Init();
+					gamelink_input.Reset();
+					if (activate_gamelink)
+						gamelink_input.Start(gamelink_input_rate);
+				}
                 else if (GameLink::IsActive() && !activate_gamelink)
+                {
+                    gamelink_input.Stop();
+                    latency_tracer.Stop();
+                    frame_capture.Stop();
+                    pc_profiler.Stop();
 					GameLink::Destroy();
+					peek_set = -1;	// Destroy() drops the peek sets
+                }
                 activate_gamelink = GameLink::IsActive();
             }
+            if (ImGui::GetTime() - stats_sample_time >= 1.0)
+            {
+                auto _now = GameLink::GetStats();
+                stats_per_sec.messages = _now.messages - stats_last.messages;
+                stats_per_sec.message_bytes = _now.message_bytes - stats_last.message_bytes;
+                stats_per_sec.sdhr_publishes = _now.sdhr_publishes - stats_last.sdhr_publishes;
+                stats_per_sec.handshakes_saved = _now.handshakes_saved - stats_last.handshakes_saved;
+                stats_per_sec.sdhr_fragments = _now.sdhr_fragments - stats_last.sdhr_fragments;
+                stats_last = _now;
+                stats_sample_time = ImGui::GetTime();
+            }
+            if (ImGui::CollapsingHeader("Statistics"))
+            {
+                ImGui::Text("Messages to host: %llu/s (%llu bytes/s)",
+                    (unsigned long long)stats_per_sec.messages, (unsigned long long)stats_per_sec.message_bytes);
+                ImGui::Text("SDHR publishes: %llu/s", (unsigned long long)stats_per_sec.sdhr_publishes);
+                ImGui::Text("Handshakes saved: %llu/s", (unsigned long long)stats_per_sec.handshakes_saved);
+                ImGui::Text("SDHR fragments: %llu/s", (unsigned long long)stats_per_sec.sdhr_fragments);
+                // Totals: publishes come in bursts
+                auto _batcher = SDHRCommandBatcher::GetStats();
+                ImGui::Text("SDHR commands: %llu (%llu bytes)",
+                    (unsigned long long)_batcher.commands, (unsigned long long)_batcher.bytes_published);
+                ImGui::Text("SDHR bytes copied per byte sent: %.2f",
+                    _batcher.bytes_published ? (double)_batcher.bytes_copied / _batcher.bytes_published : 0.0);
+                ImGui::Text("SDHR batcher allocations: %llu (%u for the last batch, arena %zu KB)",
+                    (unsigned long long)_batcher.allocations, batcher.GetLastPublishAllocations(), batcher.GetArenaCapacity() / 1024);
+                auto _total = GameLink::GetStats();
+                ImGui::Text("Frames read: %llu (%llu retries, %llu under the mutex)",
+                    (unsigned long long)_total.frame_reads, (unsigned long long)_total.frame_retries,
+                    (unsigned long long)_total.frame_lock_fallbacks);
+                auto _input = gamelink_input.GetStats();
+                ImGui::Text("Key events: %llu, input updates: %llu (%llu words, %llu retried)",
+                    (unsigned long long)_input.key_events, (unsigned long long)_total.input_updates,
+                    (unsigned long long)_total.keyb_words, (unsigned long long)_input.busy);
+                ImGui::Text("Mouse events: %llu, gamepad events: %llu, mouse updates: %llu",
+                    (unsigned long long)_input.mouse_events, (unsigned long long)_input.gamepad_events,
+                    (unsigned long long)_total.mouse_updates);
+                ImGui::Text("Input to frame: %.1f ms (avg %.1f, max %.1f)",
+                    _input.latency_ms_last, _input.latency_ms_avg, _input.latency_ms_max);
+            }
+            if (ImGui::CollapsingHeader("Wait Policy"))
+            {
+                ImGui::Text("Host drain notification: %s", GameLink::IsDrainEventDriven() ? "event" : "polling");
+                if (GameLink::GetCommandRingSlots() > 0)
+                    ImGui::Text("Commands: ring of %u slots", GameLink::GetCommandRingSlots());
+                else
+                    ImGui::Text("Commands: single buffer");
+                int _spin = wait_policy.spin_count;
+                int _slice = wait_policy.block_slice_ms;
+                int _timeout = wait_policy.timeout_ms;
+                ImGui::PushItemWidth(120.f);
+                bool _changed = ImGui::InputInt("Spin count##wp", &_spin, 100, 1000);
+                _changed |= ImGui::InputInt("Block slice (ms)##wp", &_slice);
+                _changed |= ImGui::InputInt("Timeout (ms)##wp", &_timeout, 100, 1000);
+                ImGui::PopItemWidth();
+                if (_changed)
+                {
+                    wait_policy.spin_count = std::max(0, _spin);
+                    wait_policy.block_slice_ms = std::max(1, _slice);
+                    wait_policy.timeout_ms = std::max(1, _timeout);
+                    GameLink::SetWaitPolicy(wait_policy);
+                    ini["GameLink"]["Wait_spin_count"] = std::to_string(wait_policy.spin_count);
+                    ini["GameLink"]["Wait_block_slice_ms"] = std::to_string(wait_policy.block_slice_ms);
+                    ini["GameLink"]["Wait_timeout_ms"] = std::to_string(wait_policy.timeout_ms);
+                    file.write(ini);
+                }
+            }
+            if (ImGui::CollapsingHeader("Input"))
+            {
+                ImGui::Text("Mouse: %s", gamelink_video_info.wantsMouse ? "wanted by the host" : "not wanted by the host");
+                ImGui::PushItemWidth(120.f);
+                if (ImGui::SliderFloat("Gamepad speed##in", &gamepad_speed, 50.f, 2000.f, "%.0f/s"))
+                {
+                    gamelink_input.SetGamepadSpeed(gamepad_speed);
+                    ini["Input"]["Gamepad_speed"] = std::to_string((int)gamepad_speed);
+                    file.write(ini);
+                }
+                ImGui::PopItemWidth();
+            }
+            if (ImGui::CollapsingHeader("Peek"))
+            {
+                ImGui::InputText("Addresses (hex)##pk", &peek_addresses);
+                if (ImGui::Button("Read##pk") && GameLink::IsActive())
+                {
+                    if (peek_set < 0 || GameLink::UnregisterPeekSet(peek_set))
+                    {
+                        peek_set = -1;
+                        v_peek_addresses.clear();
+                        const char* p = peek_addresses.c_str();
+                        while (*p)
+                        {
+                            char* end;
+                            UINT addr = (UINT)strtoul(p + (*p == '$'), &end, 16);
+                            if (end == p + (*p == '$'))
+                            {
+                                ++p;	// separator
+                                continue;
+                            }
+                            v_peek_addresses.push_back(addr);
+                            p = end;
+                        }
+                        if (!v_peek_addresses.empty())
+                            peek_set = GameLink::RegisterPeekSet(v_peek_addresses);
+                        v_peek_values.assign(v_peek_addresses.size(), 0);
+                        ini["Peek"]["Peek_addresses"] = peek_addresses;
+                        file.write(ini);
+                    }
+                }
+                ImGui::SameLine();
+                ImGui::Text("%u slots used", GameLink::GetPeekSlotsUsed());
+                if (peek_set < 0)
+                    ImGui::TextUnformatted(v_peek_addresses.empty() ? "No addresses" : "Couldn't register these addresses");
+                else if (!GameLink::IsPeekSetReady(peek_set))
+                    ImGui::Text("Waiting for the host");
+                else if (GameLink::ReadPeekSet(peek_set, v_peek_values))
+                {
+                    for (size_t i = 0; i < v_peek_values.size(); ++i)
+                        ImGui::Text("$%04X: $%02X (%u)", v_peek_addresses[i], v_peek_values[i], v_peek_values[i]);
+                }
+            }
 
 			if (!activate_gamelink)
 				ImGui::BeginDisabled();
@@ -361,7 +606,6 @@ int main(int, char**)
                 //    f.put(brit_lookup()[britannia_tiles[i]]);
                 //}
                 //f.close();
-                auto batcher = SDHRCommandBatcher();
 
 				std::filesystem::path asset_path = "Assets/Tiles_Ultima5.png";
 				std::string asset_name = std::filesystem::absolute(asset_path).string();
@@ -369,8 +613,7 @@ int main(int, char**)
                 asset_cmd.asset_index = 0;
                 asset_cmd.filename_length = asset_name.length();
                 asset_cmd.filename = asset_name.c_str();
-                auto assetc = SDHRCommand_DefineImageAssetFilename(&asset_cmd);
-                batcher.AddCommand(&assetc);
+                batcher.AddCommand(&asset_cmd);
 
 				std::filesystem::path tilepath = "Assets/britannia.dat";
                 std::string tilefile = std::filesystem::absolute(tilepath).string();
@@ -379,8 +622,7 @@ int main(int, char**)
                 upload_tiles.dest_addr_high = 0;
                 upload_tiles.filename_length = tilefile.length();
                 upload_tiles.filename = tilefile.c_str();
-                auto upload_tiles_cmd = SDHRCommand_UploadDataFilename(&upload_tiles);
-                batcher.AddCommand(&upload_tiles_cmd);
+                batcher.AddCommand(&upload_tiles);
 
                 std::vector<uint16_t> set1_addresses;
                 std::vector<uint16_t> set2_addresses;
@@ -398,8 +640,7 @@ int main(int, char**)
                 set1.xdim = 16;
                 set1.ydim = 16;
                 set1.data = (uint8_t*)set1_addresses.data();
-                auto set1_cmd = SDHRCommand_DefineTilesetImmediate(&set1);
-                batcher.AddCommand(&set1_cmd);
+                batcher.AddCommand(&set1);
 
                 DefineTilesetImmediateCmd set2;
                 set2.asset_index = 0;
@@ -408,8 +649,7 @@ int main(int, char**)
                 set2.xdim = 16;
                 set2.ydim = 16;
                 set2.data = (uint8_t*)set2_addresses.data();
-                auto set2_cmd = SDHRCommand_DefineTilesetImmediate(&set2);
-                batcher.AddCommand(&set2_cmd);
+                batcher.AddCommand(&set2);
 
                 DefineWindowCmd w;
                 w.window_index = 0;
@@ -424,8 +664,7 @@ int main(int, char**)
                 w.tile_ydim = set1.ydim;
                 w.tile_xcount = 256;
                 w.tile_ycount = 256;
-                auto w_cmd = SDHRCommand_DefineWindow(&w);
-                batcher.AddCommand(&w_cmd);
+                batcher.AddCommand(&w);
 
                 DefineWindowCmd w2;
                 w2.window_index = 1;
@@ -440,8 +679,7 @@ int main(int, char**)
                 w2.tile_ydim = set2.ydim;
                 w2.tile_xcount = 1;
                 w2.tile_ycount = 1;
-                auto w2_cmd = SDHRCommand_DefineWindow(&w2);
-                batcher.AddCommand(&w2_cmd);
+                batcher.AddCommand(&w2);
 
                 UpdateWindowSetUploadCmd set_tiles;
                 set_tiles.window_index = 0;
@@ -451,8 +689,7 @@ int main(int, char**)
                 set_tiles.tile_ycount = w.tile_ycount;
                 set_tiles.upload_addr_med = 0;
                 set_tiles.upload_addr_high = 0;
-                auto set_tiles_cmd = SDHRCommand_UpdateWindowSetUpload(&set_tiles);
-                batcher.AddCommand(&set_tiles_cmd);
+                batcher.AddCommand(&set_tiles);
 
                 std::array<uint8_t, 2> avatar_tile = { 1, 28 };
                 UpdateWindowSetBothCmd set_tiles2;
@@ -462,20 +699,17 @@ int main(int, char**)
                 set_tiles2.tile_xcount = 1;
                 set_tiles2.tile_ycount = 1;
                 set_tiles2.data = avatar_tile.data();
-                auto set_tiles2_cmd = SDHRCommand_UpdateWindowSetBoth(&set_tiles2);
-                batcher.AddCommand(&set_tiles2_cmd);
+                batcher.AddCommand(&set_tiles2);
 
                 UpdateWindowEnableCmd w_enable;
                 w_enable.window_index = 0;
                 w_enable.enabled = true;
-                auto w_enable_cmd = SDHRCommand_UpdateWindowEnable(&w_enable);
-                batcher.AddCommand(&w_enable_cmd);
+                batcher.AddCommand(&w_enable);
 
                 UpdateWindowEnableCmd w_enable2;
                 w_enable2.window_index = 1;
                 w_enable2.enabled = true;
-                auto w_enable2_cmd = SDHRCommand_UpdateWindowEnable(&w_enable2);
-                batcher.AddCommand(&w_enable2_cmd);
+                batcher.AddCommand(&w_enable2);
 
                 batcher.Publish();
             }
@@ -509,53 +743,84 @@ int main(int, char**)
 			//	batcher.Publish();
 			//}
 
+            // The view follows the game while the RAM bindings drive it
+            if (activate_bindings)
+                ImGui::BeginDisabled();
             if (ImGui::Button("North"))
             {
                 for (auto i = 0; i < 8; ++i) {
-                    auto batcher = SDHRCommandBatcher();
                     tile_posy -= 2;
                     scWP.tile_ybegin = tile_posy;
-                    auto c1 = SDHRCommand_UpdateWindowAdjustWindowView(&scWP);
-                    batcher.AddCommand(&c1);
+                    batcher.AddCommand(&scWP);
                     batcher.Publish();
                 }
             }
             if (ImGui::Button("South"))
             {
                 for (auto i = 0; i < 8; ++i) {
-                    auto batcher = SDHRCommandBatcher();
                     tile_posy += 2;
                     scWP.tile_ybegin = tile_posy;
-                    auto c1 = SDHRCommand_UpdateWindowAdjustWindowView(&scWP);
-                    batcher.AddCommand(&c1);
+                    batcher.AddCommand(&scWP);
                     batcher.Publish();
                 }
             }
             if (ImGui::Button("East"))
             {
                 for (auto i = 0; i < 8; ++i) {
-                    auto batcher = SDHRCommandBatcher();
                     tile_posx += 2;
                     scWP.tile_xbegin = tile_posx;
-                    auto c1 = SDHRCommand_UpdateWindowAdjustWindowView(&scWP);
-                    batcher.AddCommand(&c1);
+                    batcher.AddCommand(&scWP);
                     batcher.Publish();
                 }
             }
             if (ImGui::Button("West"))
             {
                 for (auto i = 0; i < 8; ++i) {
-                    auto batcher = SDHRCommandBatcher();
                     tile_posx -= 2;
                     scWP.tile_xbegin = tile_posx;
-                    auto c1 = SDHRCommand_UpdateWindowAdjustWindowView(&scWP);
-                    batcher.AddCommand(&c1);
+                    batcher.AddCommand(&scWP);
                     batcher.Publish();
                 }
             }
+            if (activate_bindings)
+                ImGui::EndDisabled();
 
 			if (ImGui::Button("Reset"))
+			{
 				GameLink::SDHR_reset();
+				ram_bindings.Reset();
+			}
+
+			ImGui::SeparatorText("RAM Bindings");
+			ImGui::InputText("Bindings file", &bindings_filename);
+			ImGui::SameLine();
+			if (ImGui::Button("Load##bindings"))
+			{
+				ram_bindings.Load(bindings_filename);
+				ini["Bindings"]["Bindings_filename"] = bindings_filename;
+				file.write(ini);
+			}
+			if (ram_bindings.GetBindings().empty())
+				ImGui::BeginDisabled();
+			if (ImGui::Checkbox("Drive SDHR from RAM bindings", &activate_bindings) && activate_bindings)
+				ram_bindings.Reset();
+			if (ram_bindings.GetBindings().empty())
+				ImGui::EndDisabled();
+			for (auto const& binding : ram_bindings.GetBindings())
+			{
+				if (binding.action == RamBindings::Action::WindowEnable)
+					ImGui::BulletText("%s: %s %d = %lld", binding.name.c_str(), RamBindings::GetActionName(binding.action),
+						binding.window_index, (long long)binding.last_x);
+				else
+					ImGui::BulletText("%s: %s %d = (%lld, %lld)", binding.name.c_str(), RamBindings::GetActionName(binding.action),
+						binding.window_index, (long long)binding.last_x, (long long)binding.last_y);
+			}
+			{
+				auto _bstats = ram_bindings.GetStats();
+				ImGui::Text("Frames evaluated: %llu, batches: %llu, commands: %llu, failed: %llu",
+					(unsigned long long)_bstats.frames_evaluated, (unsigned long long)_bstats.batches_published,
+					(unsigned long long)_bstats.commands_published, (unsigned long long)_bstats.publish_failures);
+			}
 
 			if (!activate_gamelink)
 				ImGui::EndDisabled();
@@ -582,6 +847,9 @@ int main(int, char**)
 			}
 
 			ImGui::Checkbox("Demo Window", &show_demo_window);      // Edit bools storing our window open/close state
+			ImGui::Checkbox("6502 Profiler", &show_profiler_window);
+			ImGui::Checkbox("RAM History", &show_ram_history_window);
+			ImGui::Checkbox("SDHR Latency", &show_latency_window);
 
 
             if (ImGui::Button("Button"))                            // Buttons return true when clicked (most widgets return true when edited/activated)
@@ -628,7 +896,6 @@ int main(int, char**)
 					ini["Data"]["Data_dest_addr_high"] = data_dest_addr_high;
 					ini["Data"]["Data_filename"] = data_filename;
 					file.write(ini);
-					auto batcher = SDHRCommandBatcher();
                     UploadDataFilenameCmd _udc;
                     _udc.dest_addr_med = (uint8_t)data_dest_addr_med;
 					_udc.dest_addr_high = (uint8_t)data_dest_addr_high;
@@ -665,7 +932,6 @@ int main(int, char**)
 					ini["Image"]["Image0_asset_index"] = image0_asset_index;
 					ini["Image"]["Image0_filename"] = image0_filename;
 					file.write(ini);
-					auto batcher = SDHRCommandBatcher();
 					DefineImageAssetFilenameCmd _udc;
 					_udc.asset_index = (uint8_t)image0_asset_index;
 					_udc.filename_length = (uint8_t)image0_filename.length();
@@ -702,7 +968,6 @@ int main(int, char**)
 					ini["Image"]["Image1_asset_index"] = image1_asset_index;
 					ini["Image"]["Image1_filename"] = image1_filename;
 					file.write(ini);
-					auto batcher = SDHRCommandBatcher();
 					DefineImageAssetFilenameCmd _udc;
 					_udc.asset_index = (uint8_t)image0_asset_index;
 					_udc.filename_length = (uint8_t)image1_filename.length();
@@ -735,7 +1000,6 @@ int main(int, char**)
 					ini["Tileset"]["Tileset0_xdim"] = tileset0_xdim;
 					ini["Tileset"]["Tileset0_ydim"] = tileset0_ydim;
 					file.write(ini);
-					auto batcher = SDHRCommandBatcher();
                     DefineTilesetImmediateCmd _udc;
 					_udc.tileset_index = (uint8_t)tileset0_index;
 					_udc.num_entries = (uint8_t)tileset0_num_entries;   // 256 becomes 0
@@ -778,7 +1042,6 @@ int main(int, char**)
 					ini["Tileset"]["Tileset0_xdim"] = tileset1_xdim;
 					ini["Tileset"]["Tileset0_ydim"] = tileset1_ydim;
 					file.write(ini);
-					auto batcher = SDHRCommandBatcher();
 					DefineTilesetImmediateCmd _udc;
 					_udc.tileset_index = (uint8_t)tileset1_index;
 					_udc.num_entries = (uint8_t)tileset1_num_entries;   // 256 becomes 0
@@ -830,7 +1093,6 @@ int main(int, char**)
 					ini["Window"]["Window0_tile_xcount"] = window0_tile_xcount;
 					ini["Window"]["Window0_tile_ycount"] = window0_tile_ycount;
 					file.write(ini);
-					auto batcher = SDHRCommandBatcher();
                     DefineWindowCmd _udc;
 					_udc.window_index = window0_index;
 					_udc.black_or_wrap = window0_black_or_wrap;
@@ -888,7 +1150,6 @@ int main(int, char**)
 					ini["Window"]["Window1_tile_xcount"] = window1_tile_xcount;
 					ini["Window"]["Window1_tile_ycount"] = window1_tile_ycount;
 					file.write(ini);
-					auto batcher = SDHRCommandBatcher();
 					DefineWindowCmd _udc;
 					_udc.window_index = window1_index;
 					_udc.black_or_wrap = window1_black_or_wrap;
@@ -934,7 +1195,6 @@ int main(int, char**)
 				}
 				if (_bState > 0)
 				{
-					auto batcher = SDHRCommandBatcher();
 					UpdateWindowEnableCmd w_enable;
 					w_enable.window_index = _vWindowIndex;
 					w_enable.enabled = _bState - 1;
@@ -961,7 +1221,6 @@ int main(int, char**)
 				ImGui::SliderInt("High Byte##uwsu", &_uwsu_addr_high, 0, 255);
 				if (ImGui::Button("Update##uwsu"))
 				{
-					auto batcher = SDHRCommandBatcher();
 					UpdateWindowSetUploadCmd _wcmd;
 					_wcmd.window_index = _vWindowIndex;
 					_wcmd.tile_xbegin = _uwsu_tile_xbegin;
@@ -995,7 +1254,6 @@ int main(int, char**)
 				ImGui::InputInt4("Data##uwst", _uwst_data);
 				if (ImGui::Button("Update##uwst"))
 				{
-					auto batcher = SDHRCommandBatcher();
 					UpdateWindowSingleTilesetCmd _wcmd;
 					_wcmd.window_index = _vWindowIndex;
 					_wcmd.tile_xbegin = _uwst_tile_xbegin;
@@ -1034,7 +1292,6 @@ int main(int, char**)
 				ImGui::InputInt4("Index##uwsb", _uwsb_data);
 				if (ImGui::Button("Update##uwsb"))
 				{
-					auto batcher = SDHRCommandBatcher();
 					UpdateWindowSetBothCmd _wcmd;
 					_wcmd.window_index = _vWindowIndex;
 					_wcmd.tile_xbegin = _uwsb_tile_xbegin;
@@ -1061,7 +1318,6 @@ int main(int, char**)
 				ImGui::SliderInt("Shift X##uwshift", &_uwshift_y, -127, 127);
 				if (ImGui::Button("Shift Tiles##uwshift"))
 				{
-					auto batcher = SDHRCommandBatcher();
 					UpdateWindowShiftTilesCmd _wcmd;
 					_wcmd.window_index = _vWindowIndex;
 					_wcmd.x_dir = _uwshift_x;
@@ -1081,7 +1337,6 @@ int main(int, char**)
 				ImGui::PopItemWidth();
 				if (ImGui::Button("Set Window Position##uwsetwin"))
 				{
-					auto batcher = SDHRCommandBatcher();
 					UpdateWindowSetWindowPositionCmd _wcmd;
 					_wcmd.window_index = _vWindowIndex;
 					_wcmd.screen_xbegin = _uwsetwin_x;
@@ -1101,7 +1356,6 @@ int main(int, char**)
 				ImGui::PopItemWidth();
 				if (ImGui::Button("Adjust Window View##uwadjview"))
 				{
-					auto batcher = SDHRCommandBatcher();
 					UpdateWindowAdjustWindowViewCmd _wcmd;
 					_wcmd.window_index = _vWindowIndex;
 					_wcmd.tile_xbegin = _uwadjview_x;
@@ -1128,21 +1382,237 @@ int main(int, char**)
 
 		// 4. Show gamelink in a window
 
+        // RAM bindings: at most one batch per AppleWin frame, and only if a bound value changed
+        if (activate_bindings && activate_gamelink && activate_sdhr)
+            ram_bindings.Update();
+
+        // The capture thread only runs while there's a video window to feed
+        if (show_gamelink_video_window && activate_gamelink)
+            frame_capture.Start();
+        else
+            frame_capture.Stop();
+
         if (show_gamelink_video_window && activate_gamelink)
         {
-            // Load video
-            auto fbI = GameLink::GetFrameBufferInfo();
-            bool ret = ImageHelper::LoadTextureFromMemory(fbI.frameBuffer, &gamelink_video_texture, fbI.width, fbI.height, true);
+            // Load video: the newest frame captured, without waiting for one.
+            // Only upload it if frame.seq moved since the frame in the texture.
+            auto frame = frame_capture.GetLatestFrame();
+            if (frame && (gamelink_video_texture.GetTexture() == 0 || frame->info.seq != gamelink_video_info.seq))
+            {
+                bool ret = gamelink_video_texture.Update(frame->pixels.data(), frame->info.width, frame->info.height, true);
+                gamelink_video_texture.SetPixelAspectRatio(frame->info.parX, frame->info.parY);
+                gamelink_video_info = frame->info;
+                ++gamelink_frames_uploaded;
+            }
+            else
+                ++gamelink_frames_skipped;
+            auto& fbI = gamelink_video_info;
             ImVec2 vpos = ImVec2(300.f, 300.f);
             ImGui::SetNextWindowPos(vpos, ImGuiCond_FirstUseEver);
             ImGui::Begin("AppleWin Video", &show_gamelink_video_window);
             ImGui::Text("size = %d x %d", fbI.width, fbI.height);
-            ImGui::Image((void*)(intptr_t)gamelink_video_texture, ImVec2(fbI.width, fbI.height), ImVec2(0, 1), ImVec2(1, 0));
+            ImGui::Text("frames uploaded = %llu, skipped = %llu, texture allocations = %llu (%s)",
+                (unsigned long long)gamelink_frames_uploaded, (unsigned long long)gamelink_frames_skipped,
+                (unsigned long long)gamelink_video_texture.GetAllocationCount(),
+                gamelink_video_texture.IsUsingPixelBuffers() ? "PBO" : "synchronous");
+            if (ImGui::GetTime() - gamelink_upload_sample_time >= 1.0)
+            {
+                uint64_t _submitted = gamelink_video_texture.GetPixelsSubmitted() - gamelink_pixels_submitted;
+                uint64_t _uploaded = gamelink_video_texture.GetPixelsUploaded() - gamelink_pixels_uploaded;
+                gamelink_upload_fraction = _submitted ? (double)_uploaded / _submitted : 0.0;
+                gamelink_pixels_submitted = gamelink_video_texture.GetPixelsSubmitted();
+                gamelink_pixels_uploaded = gamelink_video_texture.GetPixelsUploaded();
+                gamelink_upload_sample_time = ImGui::GetTime();
+            }
+            ImGui::Text("pixels uploaded = %.1f%% of the new frames", gamelink_upload_fraction * 100.0);
+            ImGui::Image((void*)(intptr_t)gamelink_video_texture.GetTexture(),
+                ImVec2(gamelink_video_texture.GetDisplayWidth(), gamelink_video_texture.GetDisplayHeight()), ImVec2(0, 1), ImVec2(1, 0));
+            is_gamelink_hovered = ImGui::IsItemHovered();
             is_gamelink_focused = ImGui::IsWindowFocused(ImGuiFocusedFlags_ChildWindows);
             ImGui::End();
         }
         else
+        {
             is_gamelink_focused = false;
+            is_gamelink_hovered = false;
+        }
+
+        // 5. Show the 6502 profiler
+        pc_profiler.Update();
+        if (show_profiler_window)
+        {
+            ImGui::SetNextWindowPos(ImVec2(700.f, 100.f), ImGuiCond_FirstUseEver);
+            ImGui::Begin("6502 Profiler", &show_profiler_window);
+            if (!activate_gamelink)
+                ImGui::BeginDisabled();
+            if (pc_profiler.IsRunning())
+            {
+                if (ImGui::Button("Stop##profiler"))
+                    pc_profiler.Stop();
+            }
+            else if (ImGui::Button("Start##profiler"))
+                pc_profiler.Start(pc_profiler_rate);
+            if (!activate_gamelink)
+                ImGui::EndDisabled();
+            ImGui::SameLine();
+            if (ImGui::Button("Clear##profiler"))
+                pc_profiler.Clear();
+            ImGui::SameLine();
+            ImGui::PushItemWidth(120.f);
+            if (pc_profiler.IsRunning())
+                ImGui::BeginDisabled();
+            if (ImGui::InputInt("Samples/s##profiler", &pc_profiler_rate, 1000, 10000))
+                pc_profiler_rate = std::clamp(pc_profiler_rate, 1, 100000);
+            if (pc_profiler.IsRunning())
+                ImGui::EndDisabled();
+            ImGui::PopItemWidth();
+            const UINT64 _samples = pc_profiler.GetSampleCount();
+            ImGui::Text("Samples: %llu (%.0f/s, %llu dropped)", (unsigned long long)_samples,
+                pc_profiler.GetSampleRate(), (unsigned long long)pc_profiler.GetDroppedCount());
+            if (_samples > 0)
+            {
+                ImGui::SeparatorText("Top addresses");
+                if (ImGui::BeginTable("##profiler_addresses", 3, ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit))
+                {
+                    for (auto const& _spot : pc_profiler.GetTopAddresses(20))
+                    {
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn(); ImGui::Text("$%04X", _spot.address);
+                        ImGui::TableNextColumn(); ImGui::Text("%llu", (unsigned long long)_spot.samples);
+                        ImGui::TableNextColumn(); ImGui::Text("%5.1f%%", 100.0 * _spot.samples / _samples);
+                    }
+                    ImGui::EndTable();
+                }
+                ImGui::SeparatorText("Hot pages");
+                for (auto const& _page : pc_profiler.GetHotPages(8))
+                {
+                    const float _fraction = (float)_page.samples / _samples;
+                    char _label[32];
+                    snprintf(_label, sizeof(_label), "$%04X-$%04X %.1f%%", _page.address, _page.address + 0xFF, 100.f * _fraction);
+                    ImGui::ProgressBar(_fraction, ImVec2(-1.f, 0.f), _label);
+                }
+            }
+            ImGui::End();
+        }
+
+        // 6. Show the SDHR latency
+        if (show_latency_window)
+        {
+            ImGui::SetNextWindowPos(ImVec2(700.f, 700.f), ImGuiCond_FirstUseEver);
+            ImGui::Begin("SDHR Latency", &show_latency_window);
+            if (!activate_gamelink)
+                ImGui::BeginDisabled();
+            if (latency_tracer.IsRunning())
+            {
+                if (ImGui::Button("Stop##latency"))
+                    latency_tracer.Stop();
+            }
+            else if (ImGui::Button("Start##latency"))
+                latency_tracer.Start();
+            if (!activate_gamelink)
+                ImGui::EndDisabled();
+            ImGui::SameLine();
+            if (ImGui::Button("Clear##latency"))
+                latency_tracer.Clear();
+            ImGui::Text("Batches: %llu traced, %zu in flight, %llu not shown in time",
+                (unsigned long long)latency_tracer.GetTracedCount(), latency_tracer.GetInFlightCount(),
+                (unsigned long long)latency_tracer.GetTimedOutCount());
+            ImGui::TextUnformatted("write: Publish() to handed over, drain: to taken by the host, frame: to the next frame");
+            if (ImGui::BeginTable("##latency", 6, ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit))
+            {
+                ImGui::TableSetupColumn("Command");
+                ImGui::TableSetupColumn("Phase");
+                ImGui::TableSetupColumn("Count");
+                ImGui::TableSetupColumn("p50 ms");
+                ImGui::TableSetupColumn("p99 ms");
+                ImGui::TableSetupColumn("max ms");
+                ImGui::TableHeadersRow();
+                for (auto const& _row : latency_tracer.GetSummary())
+                {
+                    ImGui::TableNextRow();
+                    ImGui::TableNextColumn();
+                    if (_row.phase == LatencyTracer::Phase::WRITE)
+                        ImGui::TextUnformatted(LatencyTracer::GetTypeName(_row.type));
+                    ImGui::TableNextColumn(); ImGui::TextUnformatted(LatencyTracer::GetPhaseName(_row.phase));
+                    ImGui::TableNextColumn(); ImGui::Text("%llu", (unsigned long long)_row.count);
+                    ImGui::TableNextColumn(); ImGui::Text("%.2f", _row.p50_ms);
+                    ImGui::TableNextColumn(); ImGui::Text("%.2f", _row.p99_ms);
+                    ImGui::TableNextColumn(); ImGui::Text("%.2f", _row.max_ms);
+                }
+                ImGui::EndTable();
+            }
+            ImGui::InputText("CSV file##latency", &latency_csv_filename);
+            ImGui::SameLine();
+            if (ImGui::Button("Export##latency"))
+                latency_tracer.ExportCSV(latency_csv_filename);
+            ImGui::End();
+        }
+
+        // 7. Show the RAM history
+        if (record_ram_history && activate_gamelink && ram_history.Update())
+            ram_history_diff_stale = true;
+        if (show_ram_history_window)
+        {
+            ImGui::SetNextWindowPos(ImVec2(700.f, 400.f), ImGuiCond_FirstUseEver);
+            ImGui::Begin("RAM History", &show_ram_history_window);
+            if (!activate_gamelink)
+                ImGui::BeginDisabled();
+            ImGui::Checkbox("Record", &record_ram_history);
+            if (!activate_gamelink)
+                ImGui::EndDisabled();
+            ImGui::SameLine();
+            if (ImGui::Button("Clear##ramhistory"))
+            {
+                ram_history.Clear();
+                ram_history_diff_stale = true;
+            }
+            ImGui::PushItemWidth(120.f);
+            int _interval = (int)ram_history.GetInterval();
+            if (ImGui::InputInt("Every N frames##ramhistory", &_interval))
+                ram_history.SetInterval((UINT)std::max(1, _interval));
+            int _budget_mb = (int)(ram_history.GetBudget() >> 20);
+            if (ImGui::InputInt("Budget (MB)##ramhistory", &_budget_mb, 16, 64))
+                ram_history.SetBudget((size_t)std::max(1, _budget_mb) << 20);
+            ImGui::PopItemWidth();
+            const size_t _count = ram_history.GetCount();
+            ImGui::Text("%zu snapshots, %.1f MB (%.1f MB raw)", _count,
+                ram_history.GetEncodedBytes() / 1048576.0, ram_history.GetRawBytes() / 1048576.0);
+            if (_count > 0)
+            {
+                ImGui::SeparatorText("Diff");
+                const int _last = (int)_count - 1;
+                ram_history_diff_stale |= ImGui::SliderInt("A##ramhistory", &ram_history_a, 0, _last);
+                ImGui::SameLine();
+                ImGui::Text("frame %llu", (unsigned long long)ram_history.GetInfo(std::min(ram_history_a, _last)).frame);
+                ram_history_diff_stale |= ImGui::SliderInt("B##ramhistory", &ram_history_b, 0, _last);
+                ImGui::SameLine();
+                ImGui::Text("frame %llu", (unsigned long long)ram_history.GetInfo(std::min(ram_history_b, _last)).frame);
+                if (ram_history_diff_stale)
+                {
+                    ram_history_a = std::clamp(ram_history_a, 0, _last);
+                    ram_history_b = std::clamp(ram_history_b, 0, _last);
+                    ram_history_differing = ram_history.Diff(ram_history_a, ram_history_b, ram_history_diffs, 256);
+                    ram_history_diff_stale = false;
+                }
+                ImGui::Text("%zu bytes differ", ram_history_differing);
+                if (ImGui::BeginTable("##ramhistory_diff", 3, ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollY | ImGuiTableFlags_SizingFixedFit, ImVec2(0.f, 300.f)))
+                {
+                    ImGui::TableSetupColumn("Address");
+                    ImGui::TableSetupColumn("A");
+                    ImGui::TableSetupColumn("B");
+                    ImGui::TableHeadersRow();
+                    for (auto const& _diff : ram_history_diffs)
+                    {
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn(); ImGui::Text("$%04X", _diff.address);
+                        ImGui::TableNextColumn(); ImGui::Text("%02X", _diff.before);
+                        ImGui::TableNextColumn(); ImGui::Text("%02X", _diff.after);
+                    }
+                    ImGui::EndTable();
+                }
+            }
+            ImGui::End();
+        }
 
 		ImGui::PopFont();
 
@@ -1153,16 +1623,19 @@ int main(int, char**)
         glClear(GL_COLOR_BUFFER_BIT);
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
         SDL_GL_SwapWindow(window);
-        if (show_gamelink_video_window && activate_gamelink)
-        {
-            glDeleteTextures(1, &gamelink_video_texture);
-        }
+        if (!(show_gamelink_video_window && activate_gamelink))
+            gamelink_video_texture.Release();
     }
 #ifdef __EMSCRIPTEN__
     EMSCRIPTEN_MAINLOOP_END;
 #endif
 
     // Cleanup
+    gamelink_input.Stop();
+    latency_tracer.Stop();
+    frame_capture.Stop();
+    pc_profiler.Stop();
+    gamelink_video_texture.Release();
     if (GameLink::IsActive())
         GameLink::Destroy();
     ImGui_ImplOpenGL3_Shutdown();
@@ -0,0 +1,414 @@
+// GameLinkServer: a stand-in for AppleWin's side of the GameLink protocol.
+//
+// Creates the shared memory map and mutex, drains whatever the helper writes to buf_tohost,
+// produces test frames bumping frame.seq at a fixed rate, and answers the peek table with a
+// simulated PC. This lets the helper be run, measured and profiled on machines without the
+// emulator (e.g. Linux).
+// The SDHR commands it receives are checked with SDHRStreamDecoder as AppleWin would parse them,
+// and can be saved with --capture for sdhr_inspect.
+//
+// Build with 'make gamelink_server'. Run it first, then start the helper and tick "GameLink Active".
+
+#include "../GameLinkProtocol.h"
+#include "../GameLinkTransport.h"
+#include "../SDHRDecoder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+
+using namespace GameLink;
+using Clock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+// Local Data
+//------------------------------------------------------------------------------
+
+static std::atomic<bool> g_quit = false;
+
+struct sServerConfig
+{
+	int fps = 60;
+	int seconds = 0;			// 0 = run until interrupted
+	UINT ram_size = 128 * 1024;	// Apple //e with an extended 80 column card
+	UINT16 width = 560;
+	UINT16 height = 384;
+	int poll_us = 100;			// how often buf_tohost is checked
+	UINT ring_slots = sSharedMMapCmdRing_R5::DEFAULT_SLOTS;	// 0 = no command ring
+	bool sdhr_publish = true;	// advertise FLAG_SDHR_PUBLISH
+	bool frame_seqlock = true;	// advertise FLAG_FRAME_SEQLOCK
+	bool quiet = false;
+	std::string capture_path;	// SDHR bytes received are appended there
+};
+
+struct sServerStats
+{
+	UINT64 frames = 0;
+	UINT64 commands = 0;		// any ':command' drained from buf_tohost
+	UINT64 sdhr_writes = 0;
+	UINT64 sdhr_processes = 0;
+	UINT64 sdhr_bytes = 0;
+	UINT64 ring_messages = 0;	// messages that came through the command ring
+	UINT64 sdhr_errors = 0;		// commands SDHRStreamDecoder rejected
+};
+
+// Definitions persist across batches, like in AppleWin
+static SDHRStreamDecoder g_decoder;
+static FILE* g_capture = nullptr;
+// Only the first ones are printed
+static const UINT64 SDHR_ERRORS_SHOWN = 10;
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+static void OnSignal(int)
+{
+	g_quit = true;
+}
+
+static void PrintUsage()
+{
+	printf("usage: gamelink_server [--fps N] [--seconds N] [--ram BYTES] [--size WIDTH HEIGHT] [--poll-us N] [--ring SLOTS] [--no-publish] [--no-seqlock] [--capture FILE] [--quiet]\n");
+}
+
+static bool ParseArgs(int argc, char** argv, sServerConfig& config)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool hasNext = (i + 1 < argc);
+		if (arg == "--fps" && hasNext)
+			config.fps = std::max(1, atoi(argv[++i]));
+		else if (arg == "--seconds" && hasNext)
+			config.seconds = atoi(argv[++i]);
+		else if (arg == "--ram" && hasNext)
+			config.ram_size = (UINT)strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--size" && (i + 2 < argc))
+		{
+			config.width = (UINT16)std::min(atoi(argv[++i]), (int)sSharedMMapFrame_R1::MAX_WIDTH);
+			config.height = (UINT16)std::min(atoi(argv[++i]), (int)sSharedMMapFrame_R1::MAX_HEIGHT);
+		}
+		else if (arg == "--poll-us" && hasNext)
+			config.poll_us = std::max(1, atoi(argv[++i]));
+		else if (arg == "--ring" && hasNext)
+			config.ring_slots = (UINT)atoi(argv[++i]);
+		else if (arg == "--no-publish")
+			config.sdhr_publish = false;
+		else if (arg == "--no-seqlock")
+			config.frame_seqlock = false;
+		else if (arg == "--quiet")
+			config.quiet = true;
+		else if (arg == "--capture" && hasNext)
+			config.capture_path = argv[++i];
+		else
+			return false;
+	}
+	return true;
+}
+
+// Checks the SDHR commands of a message (after its tag, without the byte left for the tag's null)
+static void ConsumeSDHR(const UINT8* data, size_t length, sServerStats& stats)
+{
+	if (g_capture != nullptr)
+		fwrite(data, 1, length, g_capture);
+	g_decoder.Feed(data, length);
+	sSDHRDecodedCommand cmd;
+	auto report = [&stats](SDHR_CMD id, SDHRDecodeError error, size_t offset) {
+		if (++stats.sdhr_errors <= SDHR_ERRORS_SHOWN)
+			fprintf(stderr, "SDHR error: %s at byte %zu of a message (%s)\n", SDHRStreamDecoder::GetErrorName(error),
+				offset, SDHRStreamDecoder::GetCommandName(id));
+	};
+	while (g_decoder.Next(&cmd))
+	{
+		if (cmd.error != SDHRDecodeError::NONE)
+			report(cmd.id, cmd.error, cmd.offset);
+	}
+	if (g_decoder.GetFramingError() != SDHRDecodeError::NONE)
+		report(SDHR_CMD::NONE, g_decoder.GetFramingError(), length);
+}
+
+// Accounts for one message from the client, as found in buf_tohost or a ring slot
+static void ConsumeMessage(const UINT8* data, UINT32 length, sServerStats& stats)
+{
+	const char* tag = reinterpret_cast<const char*>(data);
+	const std::string sdhrWrite = ":sdhr_write";
+	const std::string sdhrPublish = ":sdhr_publish";
+	++stats.commands;
+	if (strncmp(tag, sdhrWrite.c_str(), sdhrWrite.length()) == 0)
+	{
+		++stats.sdhr_writes;
+		stats.sdhr_bytes += length - sdhrWrite.length();
+		ConsumeSDHR(data + sdhrWrite.length(), length - sdhrWrite.length() - 1, stats);
+	}
+	else if (strncmp(tag, sdhrPublish.c_str(), sdhrPublish.length()) == 0)
+	{
+		// write and process in one message
+		++stats.sdhr_writes;
+		++stats.sdhr_processes;
+		stats.sdhr_bytes += length - sdhrPublish.length();
+		ConsumeSDHR(data + sdhrPublish.length(), length - sdhrPublish.length() - 1, stats);
+	}
+	else if (strcmp(tag, ":sdhr_process") == 0)
+	{
+		++stats.sdhr_processes;
+	}
+}
+
+// Consumes the pending buf_tohost message, if any. Must be called with the mutex held.
+// Returns true if there was one, and the client should be told.
+static bool DrainToHost(sSharedMemoryMap_R4* shm, sServerStats& stats)
+{
+	sSharedMMapBuffer_R1& buf = shm->buf_tohost;
+	if (buf.payload == 0)
+		return false;
+	ConsumeMessage(buf.data, buf.payload, stats);
+	buf.payload = 0;
+	return true;
+}
+
+// Consumes every published slot of the command ring. Lock-free, we're the only consumer.
+// Only once the client opted in by writing our version to client_version, as AppleWin would.
+// Returns true if there was any, and the client should be told.
+static bool DrainCmdRing(sSharedMMapCmdRing_R5* ring, sServerStats& stats)
+{
+	static bool isWarned = false;
+	if (ring == nullptr)
+		return false;
+	UINT32 tail = ring->tail.load(std::memory_order_relaxed);
+	const UINT32 head = ring->head.load(std::memory_order_acquire);
+	if (tail == head)
+		return false;
+	// Read after head: the client writes it before publishing its first message
+	if (ring->client_version != CMD_RING_VERSION)
+	{
+		if (!isWarned)
+			fprintf(stderr, "WARNING: %u messages in the command ring, but the client didn't opt in (client_version %u), left there\n",
+				head - tail, ring->client_version);
+		isWarned = true;
+		return false;
+	}
+	isWarned = false;
+	for (; tail != head; ++tail)
+	{
+		sSharedMMapRingSlot_R5& slot = ring->Slot(tail);
+		ConsumeMessage(slot.data, slot.payload, stats);
+		++stats.ring_messages;
+	}
+	ring->tail.store(tail, std::memory_order_release);
+	return true;
+}
+
+// A made-up 6502 program for the peek table's PC: mostly a main loop at $6000, a good part of the time
+// in the monitor's WAIT routine at $FCA8, and the rest scattered over $0800-$5FFF.
+static UINT16 SimulatedPC()
+{
+	static UINT32 rng = 12345;
+	static UINT16 step = 0;
+	rng = rng * 1103515245 + 12345;
+	const UINT32 r = (rng >> 16) & 0x7FFF;
+	++step;
+	if (r % 10 < 6)
+		return (UINT16)(0x6000 + (step % 0x40));
+	if (r % 10 < 9)
+		return (UINT16)(0xFCA8 + (step % 0x0C));
+	return (UINT16)(0x0800 + (r % 0x5800));
+}
+
+// Answers the peek table the way AppleWin does: RAM values, and the processor registers for the
+// special addresses. Refreshed on every poll, so the helper can sample it faster than the frame rate.
+static void UpdatePeek(sSharedMemoryMap_R4* shm, const sServerConfig& config)
+{
+	sSharedMMapPeek_R2& peek = shm->peek;
+	const UINT8* ram = reinterpret_cast<const UINT8*>(shm + 1);
+	const UINT16 pc = SimulatedPC();
+	const UINT count = std::min(peek.addr_count, (UINT)sSharedMMapPeek_R2::PEEK_LIMIT);
+	for (UINT i = 0; i < count; ++i)
+	{
+		const UINT addr = peek.addr[i];
+		if (addr == (UINT)sSharedMMapPeek_R2::PEEK_SPECIAL_PC_H)
+			peek.data[i] = (UINT8)(pc >> 8);
+		else if (addr == (UINT)sSharedMMapPeek_R2::PEEK_SPECIAL_PC_L)
+			peek.data[i] = (UINT8)(pc & 0xFF);
+		else if (addr < config.ram_size)
+			peek.data[i] = ram[addr];
+		else
+			peek.data[i] = 0;
+	}
+}
+
+// Writes a moving test pattern and bumps the sequence. Must be called with the mutex held.
+// With FLAG_FRAME_SEQLOCK seq is odd during the write, like AppleWin would do it.
+static void WriteTestFrame(sSharedMemoryMap_R4* shm, const sServerConfig& config)
+{
+	sSharedMMapFrame_R1& f = shm->frame;
+	volatile UINT16* p_seq = &f.seq;
+	const UINT16 frame = config.frame_seqlock ? (*p_seq / 2) : *p_seq;
+	if (config.frame_seqlock)
+	{
+		*p_seq = *p_seq + 1;
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+	f.width = config.width;
+	f.height = config.height;
+	f.image_fmt = 1;
+	f.par_x = 1;
+	f.par_y = 1;
+
+	// Vertical color bars with a horizontal band scrolling down one line per frame
+	UINT32* px = reinterpret_cast<UINT32*>(f.buffer);
+	UINT16 band = frame % config.height;
+	for (UINT16 y = 0; y < config.height; ++y)
+	{
+		for (UINT16 x = 0; x < config.width; ++x)
+		{
+			UINT32 bar = (x * 8) / config.width;
+			UINT32 argb = 0xFF000000
+				| ((bar & 1) ? 0x00FF0000 : 0)
+				| ((bar & 2) ? 0x0000FF00 : 0)
+				| ((bar & 4) ? 0x000000FF : 0);
+			if (y >= band && y < band + 8)
+				argb = 0xFFFFFFFF;
+			px[(size_t)y * config.width + x] = argb;
+		}
+	}
+	std::atomic_thread_fence(std::memory_order_release);
+	*p_seq = *p_seq + 1;
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+	sServerConfig config;
+	if (!ParseArgs(argc, argv, config))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	if (config.ring_slots & (config.ring_slots - 1))
+	{
+		fprintf(stderr, "ERROR: The command ring needs a power of 2 number of slots\n");
+		return 1;
+	}
+	size_t mapSize = MEMORY_MAP_CORE_SIZE + (size_t)config.ram_size;
+	if (config.ring_slots > 0)
+		mapSize = GetCmdRingOffset(config.ram_size) + GetCmdRingSize(config.ring_slots);
+
+	if (!config.capture_path.empty())
+	{
+		g_capture = fopen(config.capture_path.c_str(), "wb");
+		if (g_capture == nullptr)
+		{
+			fprintf(stderr, "ERROR: Can't write the SDHR capture to %s\n", config.capture_path.c_str());
+			return 1;
+		}
+	}
+
+	Transport* transport = CreateTransport();
+	if (!transport->Create(mapSize))
+	{
+		fprintf(stderr, "ERROR: Couldn't create the GameLink shared memory and mutex\n");
+		delete transport;
+		return 1;
+	}
+
+	auto shm = reinterpret_cast<sSharedMemoryMap_R4*>(transport->GetMapPointer());
+	new (shm) sSharedMemoryMap_R4();
+	shm->version = PROTOCOL_VER;
+	shm->flags = FLAG_WANT_KEYB;
+	if (config.sdhr_publish)
+		shm->flags |= FLAG_SDHR_PUBLISH;
+	if (config.frame_seqlock)
+		shm->flags |= FLAG_FRAME_SEQLOCK;
+	snprintf(shm->system, SYSTEM_MAXLEN, "%s", SYSTEM_NAME);
+	snprintf(shm->program, PROGRAM_MAXLEN, "%s", "GameLinkServer test pattern");
+	shm->ram_size = config.ram_size;
+
+	sSharedMMapCmdRing_R5* ring = nullptr;
+	if (config.ring_slots > 0)
+	{
+		ring = new (transport->GetMapPointer() + GetCmdRingOffset(config.ram_size)) sSharedMMapCmdRing_R5();
+		ring->version = CMD_RING_VERSION;
+		ring->slot_count = config.ring_slots;
+		shm->flags |= FLAG_CMD_RING;
+	}
+
+	signal(SIGINT, OnSignal);
+	signal(SIGTERM, OnSignal);
+	printf("GameLink server up: %d fps, %ux%u frames, %u bytes of RAM, %u ring slots\n",
+		config.fps, config.width, config.height, config.ram_size, config.ring_slots);
+
+	sServerStats stats;
+	sServerStats lastStats;
+	const auto framePeriod = std::chrono::nanoseconds(1000000000LL / config.fps);
+	const auto tStart = Clock::now();
+	auto tNextFrame = tStart;
+	auto tNextReport = tStart + std::chrono::seconds(1);
+
+	while (!g_quit)
+	{
+		auto now = Clock::now();
+		if (config.seconds > 0 && now - tStart >= std::chrono::seconds(config.seconds))
+			break;
+
+		bool drainedRing = DrainCmdRing(ring, stats);
+		if (transport->Lock(100) == LockResult::ACQUIRED)
+		{
+			bool drained = DrainToHost(shm, stats) || drainedRing;
+			UpdatePeek(shm, config);
+			if (now >= tNextFrame)
+			{
+				WriteTestFrame(shm, config);
+				++stats.frames;
+				tNextFrame += framePeriod;
+			}
+			transport->Unlock();
+			if (drained)
+				transport->SignalDrainedEvent();
+		}
+		else if (drainedRing)
+		{
+			transport->SignalDrainedEvent();
+		}
+
+		if (!config.quiet && now >= tNextReport)
+		{
+			printf("frames %llu | commands %llu (%llu via ring) | sdhr writes %llu, processes %llu, %llu bytes\n",
+				(unsigned long long)(stats.frames - lastStats.frames),
+				(unsigned long long)(stats.commands - lastStats.commands),
+				(unsigned long long)(stats.ring_messages - lastStats.ring_messages),
+				(unsigned long long)(stats.sdhr_writes - lastStats.sdhr_writes),
+				(unsigned long long)(stats.sdhr_processes - lastStats.sdhr_processes),
+				(unsigned long long)(stats.sdhr_bytes - lastStats.sdhr_bytes));
+			fflush(stdout);
+			lastStats = stats;
+			tNextReport += std::chrono::seconds(1);
+		}
+
+		std::this_thread::sleep_for(std::chrono::microseconds(config.poll_us));
+	}
+
+	printf("Totals: frames %llu | commands %llu (%llu via ring) | sdhr writes %llu, processes %llu, %llu bytes\n",
+		(unsigned long long)stats.frames, (unsigned long long)stats.commands, (unsigned long long)stats.ring_messages,
+		(unsigned long long)stats.sdhr_writes, (unsigned long long)stats.sdhr_processes,
+		(unsigned long long)stats.sdhr_bytes);
+	const SDHRStreamDecoder::sStats decoded = g_decoder.GetStats();
+	printf("SDHR: %llu commands in %llu batches, %llu invalid\n", (unsigned long long)decoded.commands,
+		(unsigned long long)decoded.batches, (unsigned long long)stats.sdhr_errors);
+	if (g_capture != nullptr)
+		fclose(g_capture);
+	transport->Close();
+	delete transport;
+	return 0;
+}
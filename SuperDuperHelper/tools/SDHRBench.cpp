@@ -0,0 +1,252 @@
+// SDHRBench: measures how fast SDHR commands are encoded, in commands and MB per second.
+//
+// Each case encodes the same command over and over for a while:
+// - legacy: the byte-by-byte push_back() loops the SDHRCommand_* classes used to have
+// - object: the SDHRCommand_* classes, a vector per command
+// - direct: SDHREncode() into a buffer, as generated from the command descriptors
+// All encodings are checked to be identical first.
+// Then SDHRStreamDecoder validates a stream of typical batches over and over, in GB per second.
+//
+// Build with 'make sdhr_bench' (optimized, doesn't need SDL, GL or a GameLink server).
+
+#include "../SDHRCommand.h"
+#include "../SDHRDecoder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+// Local Data
+//------------------------------------------------------------------------------
+
+static double g_seconds_per_case = 0.5;
+
+struct sBenchCase
+{
+	const char* name;
+	// Encodes the command once, returns the encoded bytes
+	std::function<size_t()> encode;
+	std::function<size_t()> encode_legacy;
+	std::function<size_t()> encode_direct;
+	std::function<bool()> check;
+};
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+// The encoding the SDHRCommand_* constructors had: one push_back() per byte, without reserving
+static std::vector<uint8_t> LegacyEncode(SDHR_CMD id, const void* fields, size_t fields_length, const void* data, size_t data_length)
+{
+	std::vector<uint8_t> v_data;
+	v_data.push_back((uint8_t)id);
+	const uint8_t* p = (const uint8_t*)fields;
+	for (size_t i = 0; i < fields_length; i++) { v_data.push_back(p[i]); };
+	p = (const uint8_t*)data;
+	for (size_t i = 0; i < data_length; i++) { v_data.push_back(p[i]); };
+	return v_data;
+}
+
+// Runs encode for g_seconds_per_case, returns the commands and bytes per second
+static void Measure(const std::function<size_t()>& encode, double* commandsPerSec, double* bytesPerSec)
+{
+	UINT64 commands = 0;
+	UINT64 bytes = 0;
+	const auto tStart = Clock::now();
+	double elapsed = 0.0;
+	do
+	{
+		// Check the time every so often only
+		for (int i = 0; i < 16; ++i)
+		{
+			bytes += encode();
+			++commands;
+		}
+		elapsed = std::chrono::duration<double>(Clock::now() - tStart).count();
+	} while (elapsed < g_seconds_per_case);
+	*commandsPerSec = commands / elapsed;
+	*bytesPerSec = bytes / elapsed;
+}
+
+template <typename TCommand, typename TCmd>
+static sBenchCase MakeCase(const char* name, TCmd* cmd, SDHR_CMD id, size_t fields_length, const void* data, size_t data_length)
+{
+	sBenchCase bench;
+	bench.name = name;
+	bench.encode = [cmd]() {
+		TCommand command(cmd);
+		return command.v_data.size();
+	};
+	bench.encode_legacy = [=]() {
+		return LegacyEncode(id, cmd, fields_length, data, data_length).size();
+	};
+	auto buffer = std::make_shared<std::vector<uint8_t>>(SDHRWireSize(*cmd));
+	bench.encode_direct = [cmd, buffer]() {
+		return SDHREncode(*cmd, buffer->data());
+	};
+	bench.check = [=]() {
+		TCommand command(cmd);
+		std::vector<uint8_t> v_direct(SDHRWireSize(*cmd));
+		SDHREncode(*cmd, v_direct.data());
+		const std::vector<uint8_t> v_legacy = LegacyEncode(id, cmd, fields_length, data, data_length);
+		uint16_t size;
+		memcpy(&size, v_direct.data(), 2);
+		// A full map is larger than the size header allows, the batcher splits it before sending
+		const bool isSizeOk = (v_direct.size() - 3 > UINT16_MAX) || (size + 3u == v_direct.size());
+		return command.v_data == v_legacy && isSizeOk
+			&& std::equal(v_legacy.begin(), v_legacy.end(), v_direct.begin() + 2);
+	};
+	return bench;
+}
+
+// About 8MB of batches as a scrolling tile game sends them: a 128x128 tile update, a 64x48 screen of
+// single tileset tiles and a few window commands each, after the definitions they refer to.
+// Tilesets 0 and 1 have 256 entries, tileset 2 only 200.
+static std::vector<uint8_t> MakeDecoderStream(const uint8_t* tiles)
+{
+	static const char assetName[] = "Assets/Tiles_Ultima5.png";
+	static uint16_t entries[256 * 2];
+	std::vector<uint8_t> v_stream;
+	SDHRAppend(v_stream, DefineImageAssetFilenameCmd{ 0, (uint8_t)(sizeof(assetName) - 1), assetName });
+	SDHRAppend(v_stream, DefineTilesetImmediateCmd{ 0, 0, 16, 16, 0, (uint8_t*)entries });
+	SDHRAppend(v_stream, DefineTilesetImmediateCmd{ 1, 0, 16, 16, 0, (uint8_t*)entries });
+	SDHRAppend(v_stream, DefineTilesetImmediateCmd{ 2, 200, 16, 16, 0, (uint8_t*)entries });
+	SDHRAppend(v_stream, DefineWindowCmd{ 0, false, 640, 360, 0, 0, 0, 0, 16, 16, 256, 256 });
+	SDHRAppend(v_stream, DefineWindowCmd{ 1, true, 640, 360, 0, 0, 0, 0, 8, 8, 64, 48 });
+	for (int batch = 0; v_stream.size() < 8 * 1024 * 1024; ++batch)
+	{
+		SDHRAppend(v_stream, UpdateWindowSetBothCmd{ 0, (batch % 2) * 128, 0, 128, 128, (uint8_t*)tiles });
+		SDHRAppend(v_stream, UpdateWindowSingleTilesetCmd{ 1, 0, 0, 64, 48, 1, (uint8_t*)tiles });
+		SDHRAppend(v_stream, UpdateWindowAdjustWindowViewCmd{ 0, batch, batch });
+		SDHRAppend(v_stream, UpdateWindowSetWindowPositionCmd{ 1, 0, batch % 8 });
+		SDHRAppend(v_stream, UpdateWindowEnableCmd{ 1, true });
+		SDHRAppendReady(v_stream);
+	}
+	return v_stream;
+}
+
+// Validates the stream for g_seconds_per_case, returns the bytes per second
+static double MeasureDecoder(const std::vector<uint8_t>& v_stream, bool checkDefinitions)
+{
+	SDHRStreamDecoder decoder;
+	decoder.SetCheckDefinitions(checkDefinitions);
+	UINT64 bytes = 0;
+	const auto tStart = Clock::now();
+	double elapsed = 0.0;
+	do
+	{
+		decoder.Feed(v_stream.data(), v_stream.size());
+		if (decoder.ValidateAll() != SDHRDecodeError::NONE)
+			return 0.0;
+		bytes += v_stream.size();
+		elapsed = std::chrono::duration<double>(Clock::now() - tStart).count();
+	} while (elapsed < g_seconds_per_case);
+	return bytes / elapsed;
+}
+
+static void PrintUsage()
+{
+	printf("Usage: sdhr_bench [--seconds S]\n");
+	printf("  --seconds S   time spent on each case and encoder (default 0.5)\n");
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--seconds" && i + 1 < argc)
+			g_seconds_per_case = atof(argv[++i]);
+		else
+		{
+			PrintUsage();
+			return (arg == "--help") ? 0 : 1;
+		}
+	}
+
+	// A full 256x256 map, a 64x48 screen of single tileset tiles, and small window commands
+	static uint8_t tiles[256 * 256 * 2];
+	for (size_t i = 0; i < sizeof(tiles); ++i)
+		tiles[i] = (uint8_t)(i * 7);
+	UpdateWindowSetBothCmd setBoth = { 0, 0, 0, 256, 256, tiles };
+	UpdateWindowSingleTilesetCmd singleTileset = { 1, 0, 0, 64, 48, 2, tiles };
+	DefineWindowCmd defineWindow = { 0, false, 640, 360, 0, 0, 0, 0, 16, 16, 256, 256 };
+	UpdateWindowSetWindowPositionCmd position = { 0, -12, 34 };
+
+	std::vector<sBenchCase> v_cases;
+	v_cases.push_back(MakeCase<SDHRCommand_UpdateWindowSetBoth>("UpdateWindowSetBoth 256x256", &setBoth,
+		SDHR_CMD::UPDATE_WINDOW_SET_BOTH, sizeof(setBoth) - sizeof(uint8_t*), tiles, (size_t)256 * 256 * 2));
+	v_cases.push_back(MakeCase<SDHRCommand_UpdateWindowSingleTileset>("UpdateWindowSingleTileset 64x48", &singleTileset,
+		SDHR_CMD::UPDATE_WINDOW_SINGLE_TILESET, sizeof(singleTileset) - sizeof(uint8_t*), tiles, (size_t)64 * 48));
+	v_cases.push_back(MakeCase<SDHRCommand_DefineWindow>("DefineWindow", &defineWindow,
+		SDHR_CMD::DEFINE_WINDOW, sizeof(defineWindow), nullptr, 0));
+	v_cases.push_back(MakeCase<SDHRCommand_UpdateWindowSetWindowPosition>("UpdateWindowSetWindowPosition", &position,
+		SDHR_CMD::UPDATE_WINDOW_SET_WINDOW_POSITION, sizeof(position), nullptr, 0));
+
+	printf("%-34s %-8s %14s %10s\n", "Command", "Encoder", "commands/s", "MB/s");
+	for (auto const& bench : v_cases)
+	{
+		if (!bench.check())
+		{
+			fprintf(stderr, "%s: the encodings differ!\n", bench.name);
+			return 1;
+		}
+		double commandsPerSec, bytesPerSec;
+		Measure(bench.encode_legacy, &commandsPerSec, &bytesPerSec);
+		printf("%-34s %-8s %14.0f %10.1f\n", bench.name, "legacy", commandsPerSec, bytesPerSec / 1e6);
+		const double legacyCommandsPerSec = commandsPerSec;
+		Measure(bench.encode, &commandsPerSec, &bytesPerSec);
+		printf("%-34s %-8s %14.0f %10.1f  (x%.1f)\n", bench.name, "object", commandsPerSec, bytesPerSec / 1e6,
+			commandsPerSec / legacyCommandsPerSec);
+		Measure(bench.encode_direct, &commandsPerSec, &bytesPerSec);
+		printf("%-34s %-8s %14.0f %10.1f  (x%.1f)\n", bench.name, "direct", commandsPerSec, bytesPerSec / 1e6,
+			commandsPerSec / legacyCommandsPerSec);
+	}
+
+	// Tile bytes that are valid records of the tilesets above. With only the full tilesets 0 and 1 the
+	// decoder checks them all at once; records of tileset 2 (200 entries) are checked one by one.
+	static uint8_t partial_tiles[sizeof(tiles)];
+	for (size_t i = 0; i < sizeof(tiles); i += 2)
+	{
+		partial_tiles[i] = (uint8_t)((i / 2) % 3);
+		partial_tiles[i + 1] = (uint8_t)(tiles[i + 1] % 200);
+		tiles[i] &= 1;
+	}
+	struct sDecoderCase
+	{
+		const char* name;
+		std::vector<uint8_t> v_stream;
+		bool checkDefinitions;
+	};
+	const sDecoderCase decoderCases[] = {
+		{ "Validate, full tilesets", MakeDecoderStream(tiles), true },
+		{ "Validate, partial tileset", MakeDecoderStream(partial_tiles), true },
+		// Only the sizes, ids and index ranges: no tile record is read
+		{ "Framing only, no definitions", MakeDecoderStream(partial_tiles), false },
+	};
+	printf("\n%-34s %-8s %10s\n", "Decoder", "Stream", "GB/s");
+	for (auto const& decoderCase : decoderCases)
+	{
+		const double bytesPerSec = MeasureDecoder(decoderCase.v_stream, decoderCase.checkDefinitions);
+		if (bytesPerSec == 0.0)
+		{
+			fprintf(stderr, "The decoder stream isn't valid!\n");
+			return 1;
+		}
+		printf("%-34s %6.1fMB %10.2f\n", decoderCase.name, decoderCase.v_stream.size() / 1e6, bytesPerSec / 1e9);
+	}
+	return 0;
+}
@@ -0,0 +1,347 @@
+// SDHRInspect: decodes and checks SDHR command streams offline, and fuzzes the decoder.
+//
+//   sdhr_inspect FILE [--no-definitions] [--quiet]
+//     Lists the commands of a capture (e.g. 'gamelink_server --capture FILE') with their errors.
+//     --no-definitions doesn't check windows, tilesets and assets against their definitions,
+//     for captures that start midway. Exits with 1 if any command is invalid.
+//   sdhr_inspect --fuzz ITERATIONS [--seed N]
+//     Decodes that many random mutations of a valid stream, checking every decoded command lies
+//     within the stream. Built with the address and undefined behavior sanitizers, which catch the rest.
+//
+// Build with 'make sdhr_inspect'. With clang and -DSDHR_LIBFUZZER -fsanitize=fuzzer this file is a
+// libFuzzer target instead.
+
+#include "../SDHRDecoder.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+// Decodes one stream from scratch, checking the decoder only hands out what's in it.
+// Returns false (after printing why) if it didn't.
+static bool FuzzOne(const uint8_t* data, size_t size, UINT64* errors)
+{
+	SDHRStreamDecoder decoder;
+	decoder.Feed(data, size);
+	sSDHRDecodedCommand cmd;
+	size_t end = 0;
+	while (decoder.Next(&cmd))
+	{
+		if (cmd.offset != end || cmd.body != data + cmd.offset + 2 || cmd.length == 0 || cmd.offset + 2 + cmd.length > size)
+		{
+			fprintf(stderr, "Command at %zu (%zu bytes) isn't where it should, after %zu\n", cmd.offset, cmd.length, end);
+			return false;
+		}
+		end = cmd.offset + 2 + cmd.length;
+		// Reading a view must stay within the body whatever the check said
+		SDHRCommandView<UpdateWindowSetBothCmd> view;
+		if (cmd.As(&view) && view.Tail() + view.TailLength() > data + end)
+		{
+			fprintf(stderr, "Tile data of the command at %zu runs past it\n", cmd.offset);
+			return false;
+		}
+		if (errors != nullptr)
+			++errors[(size_t)cmd.error];
+	}
+	if (decoder.GetFramingError() == SDHRDecodeError::NONE && end != size)
+	{
+		fprintf(stderr, "Stopped at %zu of %zu bytes without an error\n", end, size);
+		return false;
+	}
+	if (errors != nullptr && decoder.GetFramingError() != SDHRDecodeError::NONE)
+		++errors[(size_t)decoder.GetFramingError()];
+	return true;
+}
+
+// The rest is the command line tool
+#ifndef SDHR_LIBFUZZER
+
+// The fields that matter of a valid command, on one line
+static std::string Describe(const sSDHRDecodedCommand& cmd)
+{
+	char line[160] = "";
+	switch (cmd.id)
+	{
+	case SDHR_CMD::DEFINE_IMAGE_ASSET_FILENAME:
+	{
+		SDHRCommandView<DefineImageAssetFilenameCmd> view;
+		if (cmd.As(&view))
+			snprintf(line, sizeof(line), "asset %u: %.*s", view.Fields().asset_index,
+				(int)view.TailLength(), (const char*)view.Tail());
+		break;
+	}
+	case SDHR_CMD::UPLOAD_DATA_FILENAME:
+	{
+		SDHRCommandView<UploadDataFilenameCmd> view;
+		if (cmd.As(&view))
+			snprintf(line, sizeof(line), "to $%02X%02X00: %.*s", view.Fields().dest_addr_high, view.Fields().dest_addr_med,
+				(int)view.TailLength(), (const char*)view.Tail());
+		break;
+	}
+	case SDHR_CMD::DEFINE_TILESET_IMMEDIATE:
+	{
+		SDHRCommandView<DefineTilesetImmediateCmd> view;
+		if (cmd.As(&view))
+			snprintf(line, sizeof(line), "tileset %u: %u entries of %ux%u from asset %u", view.Fields().tileset_index,
+				view.Fields().num_entries ? view.Fields().num_entries : 256, view.Fields().xdim, view.Fields().ydim,
+				view.Fields().asset_index);
+		break;
+	}
+	case SDHR_CMD::DEFINE_WINDOW:
+	{
+		SDHRCommandView<DefineWindowCmd> view;
+		if (cmd.As(&view))
+		{
+			const DefineWindowCmd& c = view.Fields();
+			snprintf(line, sizeof(line), "window %d: %llux%llu at %lld,%lld, %llux%llu tiles of %llux%llu%s", c.window_index,
+				(unsigned long long)c.screen_xcount, (unsigned long long)c.screen_ycount, (long long)c.screen_xbegin,
+				(long long)c.screen_ybegin, (unsigned long long)c.tile_xcount, (unsigned long long)c.tile_ycount,
+				(unsigned long long)c.tile_xdim, (unsigned long long)c.tile_ydim, view.IsSet(&DefineWindowCmd::black_or_wrap) ? ", wraps" : "");
+		}
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SET_BOTH:
+	{
+		SDHRCommandView<UpdateWindowSetBothCmd> view;
+		if (cmd.As(&view))
+			snprintf(line, sizeof(line), "window %d: %llux%llu tiles at %lld,%lld", view.Fields().window_index,
+				(unsigned long long)view.Fields().tile_xcount, (unsigned long long)view.Fields().tile_ycount,
+				(long long)view.Fields().tile_xbegin, (long long)view.Fields().tile_ybegin);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SINGLE_TILESET:
+	{
+		SDHRCommandView<UpdateWindowSingleTilesetCmd> view;
+		if (cmd.As(&view))
+			snprintf(line, sizeof(line), "window %d: %llux%llu tiles at %lld,%lld of tileset %u", view.Fields().window_index,
+				(unsigned long long)view.Fields().tile_xcount, (unsigned long long)view.Fields().tile_ycount,
+				(long long)view.Fields().tile_xbegin, (long long)view.Fields().tile_ybegin, view.Fields().tileset_index);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_SET_WINDOW_POSITION:
+	{
+		SDHRCommandView<UpdateWindowSetWindowPositionCmd> view;
+		if (cmd.As(&view))
+			snprintf(line, sizeof(line), "window %d: at %lld,%lld", view.Fields().window_index,
+				(long long)view.Fields().screen_xbegin, (long long)view.Fields().screen_ybegin);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_ADJUST_WINDOW_VIEW:
+	{
+		SDHRCommandView<UpdateWindowAdjustWindowViewCmd> view;
+		if (cmd.As(&view))
+			snprintf(line, sizeof(line), "window %d: view at %lld,%lld", view.Fields().window_index,
+				(long long)view.Fields().tile_xbegin, (long long)view.Fields().tile_ybegin);
+		break;
+	}
+	case SDHR_CMD::UPDATE_WINDOW_ENABLE:
+	{
+		SDHRCommandView<UpdateWindowEnableCmd> view;
+		if (cmd.As(&view))
+			snprintf(line, sizeof(line), "window %d: %s", view.Fields().window_index, view.IsSet(&UpdateWindowEnableCmd::enabled) ? "on" : "off");
+		break;
+	}
+	default:
+		break;
+	}
+	return line;
+}
+
+static int Inspect(const std::string& path, bool checkDefinitions, bool quiet)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+	{
+		fprintf(stderr, "Can't read %s\n", path.c_str());
+		return 2;
+	}
+	const std::vector<uint8_t> v_stream((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	SDHRStreamDecoder decoder;
+	decoder.SetCheckDefinitions(checkDefinitions);
+	decoder.Feed(v_stream.data(), v_stream.size());
+	UINT64 errors[(size_t)SDHRDecodeError::COUNT] = {};
+	sSDHRDecodedCommand cmd;
+	while (decoder.Next(&cmd))
+	{
+		++errors[(size_t)cmd.error];
+		if (quiet && cmd.error == SDHRDecodeError::NONE)
+			continue;
+		printf("%8zu  %-30s %6zu  %s%s%s\n", cmd.offset, SDHRStreamDecoder::GetCommandName(cmd.id), cmd.length,
+			(cmd.error != SDHRDecodeError::NONE) ? "ERROR: " : "",
+			(cmd.error != SDHRDecodeError::NONE) ? SDHRStreamDecoder::GetErrorName(cmd.error) : "",
+			(cmd.error == SDHRDecodeError::NONE) ? Describe(cmd).c_str() : "");
+	}
+	if (decoder.GetFramingError() != SDHRDecodeError::NONE)
+	{
+		++errors[(size_t)decoder.GetFramingError()];
+		printf("ERROR: %s, the last %zu bytes can't be read\n", SDHRStreamDecoder::GetErrorName(decoder.GetFramingError()),
+			v_stream.size() - (size_t)decoder.GetStats().bytes);
+	}
+
+	const SDHRStreamDecoder::sStats stats = decoder.GetStats();
+	printf("%llu commands in %llu batches, %llu bytes, %llu invalid\n", (unsigned long long)stats.commands,
+		(unsigned long long)stats.batches, (unsigned long long)stats.bytes, (unsigned long long)stats.errors);
+	for (size_t e = 1; e < (size_t)SDHRDecodeError::COUNT; ++e)
+	{
+		if (errors[e] > 0)
+			printf("  %-26s %llu\n", SDHRStreamDecoder::GetErrorName((SDHRDecodeError)e), (unsigned long long)errors[e]);
+	}
+	return (stats.errors > 0) ? 1 : 0;
+}
+
+// A batch like main.cpp's "Define Structs": the Britannia map and the avatar on top of it
+static std::vector<uint8_t> MakeValidStream()
+{
+	static const char assetName[] = "Assets/Tiles_Ultima5.png";
+	static uint16_t entries[256 * 2];
+	static uint8_t tiles[64 * 64 * 2];
+	static uint8_t singles[16 * 16];
+	for (int i = 0; i < 256; ++i)
+	{
+		entries[i * 2] = (uint16_t)(i % 32);
+		entries[i * 2 + 1] = (uint16_t)(i / 32);
+	}
+	for (size_t i = 0; i < sizeof(tiles); i += 2)
+	{
+		tiles[i] = (uint8_t)((i / 2) % 2);
+		tiles[i + 1] = (uint8_t)(i * 13);
+	}
+	for (size_t i = 0; i < sizeof(singles); ++i)
+		singles[i] = (uint8_t)i;
+
+	std::vector<uint8_t> v_stream;
+	SDHRAppend(v_stream, DefineImageAssetFilenameCmd{ 0, (uint8_t)(sizeof(assetName) - 1), assetName });
+	SDHRAppend(v_stream, DefineTilesetImmediateCmd{ 0, 0, 16, 16, 0, (uint8_t*)entries });
+	SDHRAppend(v_stream, DefineTilesetImmediateCmd{ 1, 0, 16, 16, 0, (uint8_t*)entries });
+	SDHRAppend(v_stream, DefineWindowCmd{ 0, false, 336, 336, 0, 0, 0, 0, 16, 16, 256, 256 });
+	SDHRAppend(v_stream, DefineWindowCmd{ 1, true, 16, 16, 160, 160, 0, 0, 16, 16, 1, 1 });
+	SDHRAppend(v_stream, UpdateWindowSetBothCmd{ 0, 0, 0, 64, 64, tiles });
+	SDHRAppend(v_stream, UpdateWindowSingleTilesetCmd{ 0, 64, 64, 16, 16, 1, singles });
+	SDHRAppend(v_stream, UpdateWindowSetUploadCmd{ 0, 128, 128, 128, 128, 0, 0 });
+	SDHRAppend(v_stream, UpdateWindowShiftTilesCmd{ 0, 1, -1 });
+	SDHRAppend(v_stream, UpdateWindowSetWindowPositionCmd{ 1, 160, 160 });
+	SDHRAppend(v_stream, UpdateWindowAdjustWindowViewCmd{ 0, 1024, 2048 });
+	SDHRAppend(v_stream, UpdateWindowEnableCmd{ 0, true });
+	SDHRAppend(v_stream, UpdateWindowEnableCmd{ 1, true });
+	SDHRAppendReady(v_stream);
+	return v_stream;
+}
+
+static int Fuzz(UINT64 iterations, UINT32 seed)
+{
+	const std::vector<uint8_t> v_valid = MakeValidStream();
+	SDHRStreamDecoder decoder;
+	decoder.Feed(v_valid.data(), v_valid.size());
+	size_t errorOffset = 0;
+	const SDHRDecodeError error = decoder.ValidateAll(&errorOffset);
+	if (error != SDHRDecodeError::NONE)
+	{
+		fprintf(stderr, "The valid stream isn't: %s at byte %zu\n", SDHRStreamDecoder::GetErrorName(error), errorOffset);
+		return 1;
+	}
+
+	std::mt19937 rng(seed);
+	auto random = [&rng](size_t n) { return (size_t)(rng() % n); };
+	static const uint8_t interesting[] = { 0x00, 0x01, 0x7F, 0x80, 0xFE, 0xFF };
+	UINT64 errors[(size_t)SDHRDecodeError::COUNT] = {};
+	std::vector<uint8_t> v_mutant;
+	for (UINT64 i = 0; i < iterations; ++i)
+	{
+		v_mutant = v_valid;
+		const size_t mutations = 1 + random(4);
+		for (size_t m = 0; m < mutations && !v_mutant.empty(); ++m)
+		{
+			const size_t at = random(v_mutant.size());
+			switch (random(5))
+			{
+			case 0: v_mutant[at] ^= (uint8_t)(1 << random(8)); break;
+			case 1: v_mutant[at] = interesting[random(sizeof(interesting))]; break;
+			case 2: v_mutant[at] = (uint8_t)rng(); break;
+			case 3: v_mutant.resize(at); break;
+			case 4: v_mutant.insert(v_mutant.begin() + at, random(8) + 1, (uint8_t)rng()); break;
+			}
+		}
+		// Exactly sized, so the sanitizer sees any read past the end
+		std::unique_ptr<uint8_t[]> p_copy(new uint8_t[std::max<size_t>(v_mutant.size(), 1)]);
+		memcpy(p_copy.get(), v_mutant.data(), v_mutant.size());
+		if (!FuzzOne(p_copy.get(), v_mutant.size(), errors))
+		{
+			fprintf(stderr, "Failed at iteration %llu (seed %u)\n", (unsigned long long)i, seed);
+			return 1;
+		}
+	}
+	printf("%llu mutations of a %zu byte stream decoded, seed %u. Results:\n", (unsigned long long)iterations,
+		v_valid.size(), seed);
+	for (size_t e = 0; e < (size_t)SDHRDecodeError::COUNT; ++e)
+		printf("  %-26s %llu\n", SDHRStreamDecoder::GetErrorName((SDHRDecodeError)e), (unsigned long long)errors[e]);
+	return 0;
+}
+
+static void PrintUsage()
+{
+	printf("Usage: sdhr_inspect FILE [--no-definitions] [--quiet]\n");
+	printf("       sdhr_inspect --fuzz ITERATIONS [--seed N]\n");
+}
+
+#endif // SDHR_LIBFUZZER
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+#ifdef SDHR_LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	if (!FuzzOne(data, size, nullptr))
+		abort();
+	return 0;
+}
+#else
+int main(int argc, char* argv[])
+{
+	std::string path;
+	bool checkDefinitions = true;
+	bool quiet = false;
+	UINT64 iterations = 0;
+	UINT32 seed = 1;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--fuzz" && i + 1 < argc)
+			iterations = strtoull(argv[++i], nullptr, 0);
+		else if (arg == "--seed" && i + 1 < argc)
+			seed = (UINT32)strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--no-definitions")
+			checkDefinitions = false;
+		else if (arg == "--quiet")
+			quiet = true;
+		else if (arg[0] != '-' && path.empty())
+			path = arg;
+		else
+		{
+			PrintUsage();
+			return (arg == "--help") ? 0 : 2;
+		}
+	}
+	if (iterations > 0)
+		return Fuzz(iterations, seed);
+	if (path.empty())
+	{
+		PrintUsage();
+		return 2;
+	}
+	return Inspect(path, checkDefinitions, quiet);
+}
+#endif
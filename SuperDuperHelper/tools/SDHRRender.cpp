@@ -0,0 +1,374 @@
+// SDHRRender: renders SDHR command streams on the CPU with SDHRCompositor, without AppleWin or a GPU.
+// Run it from SuperDuperHelper/, where the Assets are.
+//
+//   sdhr_render [--out DIR] [--golden FILE] [--update-golden]
+//     Renders the Britannia scenes below and compares each frame's hash with the golden file
+//     (tools/sdhr_golden.txt). Exits with 1 if any frame differs, and with --out writes those
+//     frames (all of them with --update-golden) as DIR/<scene>.ppm to look at.
+//   sdhr_render --capture FILE --out IMAGE.ppm [--size WIDTH HEIGHT]
+//     Renders the state at the end of a capture (e.g. 'gamelink_server --capture FILE').
+//   sdhr_render --bench SECONDS [--size WIDTH HEIGHT]
+//     Scrolls the map across a window as large as the frame, one view update per frame, and
+//     reports the frames per second.
+//
+// Build with 'make sdhr_render'.
+
+#include "../SDHRCompositor.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+// Local data
+//------------------------------------------------------------------------------
+
+static const UINT FRAME_WIDTH = 560;
+static const UINT FRAME_HEIGHT = 384;
+
+static std::string g_assets_dir = "Assets";
+
+// How the base scene, main.cpp's "Define Structs", is set up
+struct sSceneSetup
+{
+	bool black_or_wrap = false;
+	bool isAssetUploaded = false;	// uploaded and decoded from memory instead of loaded from its file
+	uint64_t tile_dim = 16;			// of window 0, its tilesets are 16x16
+	uint64_t screen_xcount = 336;
+	uint64_t screen_ycount = 336;
+};
+
+/**
+ * @brief One golden frame: the base scene with the given setup, the view of window 0 moved
+ * to view_x, view_y and then the extra commands, if any
+*/
+struct sScene
+{
+	const char* name;
+	sSceneSetup setup;
+	int64_t view_x;
+	int64_t view_y;
+	void (*AppendExtra)(std::vector<uint8_t>& v_stream);
+};
+
+static const sScene g_scenes[] = {
+	{ "iolo_hut", {}, 560, 832, nullptr },
+	{ "north_west_black", {}, -100, -60, nullptr },
+	{ "south_east_black", {}, 4096 - 200, 4096 - 150, nullptr },
+	{ "south_east_wrap", { .black_or_wrap = true }, 4096 - 200, 4096 - 150, nullptr },
+	{ "shifted", {}, 560, 832, [](std::vector<uint8_t>& v_stream) {
+		SDHRAppend(v_stream, UpdateWindowShiftTilesCmd{ 0, 1, -1 });
+	} },
+	{ "moved", {}, 560, 832, [](std::vector<uint8_t>& v_stream) {
+		SDHRAppend(v_stream, UpdateWindowSetWindowPositionCmd{ 0, 300, 100 });
+	} },
+	{ "single_tileset", {}, 560, 832, [](std::vector<uint8_t>& v_stream) {
+		// A block of the second tileset's tiles in the middle of the view
+		static uint8_t indexes[6 * 4];
+		for (size_t i = 0; i < sizeof(indexes); ++i)
+			indexes[i] = (uint8_t)(i * 3);
+		SDHRAppend(v_stream, UpdateWindowSingleTilesetCmd{ 0, 37, 54, 6, 4, 1, indexes });
+	} },
+	{ "uploaded_asset", { .isAssetUploaded = true }, 560, 832, nullptr },
+	{ "zoomed", { .tile_dim = 32 }, 560 * 2, 832 * 2, nullptr },
+};
+
+//------------------------------------------------------------------------------
+// Local methods
+//------------------------------------------------------------------------------
+
+static std::vector<uint8_t> ReadFile(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		return std::vector<uint8_t>();
+	return std::vector<uint8_t>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+// The Britannia map in window 0 and the avatar in window 1, both enabled
+static void AppendBaseScene(std::vector<uint8_t>& v_stream, const sSceneSetup& setup)
+{
+	static const UINT8 PNG_ADDR_HIGH = 0x02;	// past britannia.dat at 0, 128KB
+	const std::string assetName = g_assets_dir + "/Tiles_Ultima5.png";
+	const std::string mapName = g_assets_dir + "/britannia.dat";
+	static uint16_t set1_entries[256 * 2];
+	static uint16_t set2_entries[256 * 2];
+	for (int i = 0; i < 256; ++i)
+	{
+		set1_entries[i * 2] = set2_entries[i * 2] = (uint16_t)(i % 32);
+		set1_entries[i * 2 + 1] = (uint16_t)(i / 32);
+		set2_entries[i * 2 + 1] = (uint16_t)(8 + i / 32);
+	}
+	static uint8_t avatar_tile[2] = { 1, 28 };
+
+	if (setup.isAssetUploaded)
+	{
+		const size_t pngSize = ReadFile(assetName).size();
+		SDHRAppend(v_stream, UploadDataFilenameCmd{ 0, PNG_ADDR_HIGH, (uint8_t)assetName.length(), assetName.c_str() });
+		SDHRAppend(v_stream, DefineImageAssetCmd{ 0, 0, PNG_ADDR_HIGH, (uint16_t)((pngSize + 255) / 256) });
+	}
+	else
+		SDHRAppend(v_stream, DefineImageAssetFilenameCmd{ 0, (uint8_t)assetName.length(), assetName.c_str() });
+	SDHRAppend(v_stream, UploadDataFilenameCmd{ 0, 0, (uint8_t)mapName.length(), mapName.c_str() });
+	SDHRAppend(v_stream, DefineTilesetImmediateCmd{ 0, 0, 16, 16, 0, (uint8_t*)set1_entries });
+	SDHRAppend(v_stream, DefineTilesetImmediateCmd{ 1, 0, 16, 16, 0, (uint8_t*)set2_entries });
+	SDHRAppend(v_stream, DefineWindowCmd{ 0, setup.black_or_wrap, setup.screen_xcount, setup.screen_ycount, 0, 0,
+		0, 0, setup.tile_dim, setup.tile_dim, 256, 256 });
+	SDHRAppend(v_stream, DefineWindowCmd{ 1, false, 16, 16, 160, 160, 0, 0, 16, 16, 1, 1 });
+	SDHRAppend(v_stream, UpdateWindowSetUploadCmd{ 0, 0, 0, 256, 256, 0, 0 });
+	SDHRAppend(v_stream, UpdateWindowSetBothCmd{ 1, 0, 0, 1, 1, avatar_tile });
+	SDHRAppend(v_stream, UpdateWindowEnableCmd{ 0, true });
+	SDHRAppend(v_stream, UpdateWindowEnableCmd{ 1, true });
+}
+
+// FNV-1a over the frame's bytes, 0xAARRGGBB little endian whatever the platform
+static uint64_t HashFrame(const std::vector<UINT32>& v_frame)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (const UINT32 pixel : v_frame)
+	{
+		for (UINT shift = 0; shift < 32; shift += 8)
+		{
+			hash ^= (pixel >> shift) & 0xFF;
+			hash *= 0x100000001b3ULL;
+		}
+	}
+	return hash;
+}
+
+static bool WritePPM(const std::string& path, const std::vector<UINT32>& v_frame, UINT width, UINT height)
+{
+	FILE* f = fopen(path.c_str(), "wb");
+	if (f == nullptr)
+	{
+		fprintf(stderr, "Can't write %s\n", path.c_str());
+		return false;
+	}
+	fprintf(f, "P6\n%u %u\n255\n", width, height);
+	std::vector<uint8_t> v_row(width * 3);
+	for (UINT y = 0; y < height; ++y)
+	{
+		for (UINT x = 0; x < width; ++x)
+		{
+			const UINT32 pixel = v_frame[(size_t)y * width + x];
+			v_row[x * 3] = (uint8_t)(pixel >> 16);
+			v_row[x * 3 + 1] = (uint8_t)(pixel >> 8);
+			v_row[x * 3 + 2] = (uint8_t)pixel;
+		}
+		fwrite(v_row.data(), 1, v_row.size(), f);
+	}
+	const bool isWritten = (ferror(f) == 0);
+	fclose(f);
+	return isWritten;
+}
+
+// Renders one scene from scratch. Returns false if any of its commands was rejected or couldn't load.
+static bool RenderScene(const sScene& scene, std::vector<UINT32>& v_frame)
+{
+	std::vector<uint8_t> v_stream;
+	AppendBaseScene(v_stream, scene.setup);
+	SDHRAppend(v_stream, UpdateWindowAdjustWindowViewCmd{ 0, scene.view_x, scene.view_y });
+	if (scene.AppendExtra != nullptr)
+		scene.AppendExtra(v_stream);
+	SDHRAppendReady(v_stream);
+
+	SDHRCompositor compositor;
+	const bool isApplied = compositor.Apply(v_stream);
+	v_frame.resize((size_t)FRAME_WIDTH * FRAME_HEIGHT);
+	compositor.Render(v_frame.data(), FRAME_WIDTH, FRAME_HEIGHT);
+	return isApplied && compositor.GetStats().load_failures == 0;
+}
+
+static int CheckGolden(const std::string& goldenPath, const std::string& outDir, bool isUpdating)
+{
+	// "scene width height hash" lines, # for comments
+	std::vector<std::string> v_lines;
+	{
+		std::ifstream in(goldenPath);
+		for (std::string line; std::getline(in, line);)
+			v_lines.push_back(line);
+		if (!in.eof() && !isUpdating)
+		{
+			fprintf(stderr, "Can't read %s\n", goldenPath.c_str());
+			return 2;
+		}
+	}
+
+	std::string updated = "# sdhr_render golden frames: scene width height FNV-1a 64 of the 0xAARRGGBB pixels\n";
+	UINT failures = 0;
+	for (const sScene& scene : g_scenes)
+	{
+		std::vector<UINT32> v_frame;
+		if (!RenderScene(scene, v_frame))
+		{
+			fprintf(stderr, "%s: commands were rejected, run from SuperDuperHelper/ or pass --assets\n", scene.name);
+			++failures;
+			continue;
+		}
+		const uint64_t hash = HashFrame(v_frame);
+		char entry[128];
+		snprintf(entry, sizeof(entry), "%s %u %u %016llx", scene.name, FRAME_WIDTH, FRAME_HEIGHT, (unsigned long long)hash);
+		updated += std::string(entry) + "\n";
+
+		std::string expected;
+		const std::string prefix = std::string(scene.name) + " ";
+		for (auto const& line : v_lines)
+		{
+			if (line.compare(0, prefix.length(), prefix) == 0)
+				expected = line;
+		}
+		const bool isMatching = (expected == entry);
+		if (!isUpdating)
+		{
+			printf("%-20s %016llx  %s\n", scene.name, (unsigned long long)hash,
+				isMatching ? "ok" : (expected.empty() ? "MISSING" : "DIFFERENT"));
+			if (!isMatching)
+				++failures;
+		}
+		if (!outDir.empty() && (isUpdating || !isMatching))
+			WritePPM(outDir + "/" + scene.name + ".ppm", v_frame, FRAME_WIDTH, FRAME_HEIGHT);
+	}
+
+	if (isUpdating)
+	{
+		std::ofstream out(goldenPath, std::ios::trunc);
+		out << updated;
+		if (!out)
+		{
+			fprintf(stderr, "Can't write %s\n", goldenPath.c_str());
+			return 2;
+		}
+		printf("Wrote %zu frames to %s\n", std::size(g_scenes), goldenPath.c_str());
+	}
+	else
+		printf("%u of %zu frames differ\n", failures, std::size(g_scenes));
+	return (failures > 0) ? 1 : 0;
+}
+
+static int RenderCapture(const std::string& path, const std::string& outPath, UINT width, UINT height)
+{
+	const std::vector<uint8_t> v_stream = ReadFile(path);
+	if (v_stream.empty())
+	{
+		fprintf(stderr, "Can't read %s\n", path.c_str());
+		return 2;
+	}
+	SDHRCompositor compositor;
+	compositor.Apply(v_stream);
+	std::vector<UINT32> v_frame((size_t)width * height);
+	compositor.Render(v_frame.data(), width, height);
+	const SDHRCompositor::sStats stats = compositor.GetStats();
+	printf("%llu commands applied, %llu rejected, %llu loads failed%s\n", (unsigned long long)stats.commands,
+		(unsigned long long)stats.rejected, (unsigned long long)stats.load_failures,
+		compositor.HasEnabledWindow() ? "" : ", no window enabled");
+	return WritePPM(outPath, v_frame, width, height) ? 0 : 2;
+}
+
+static int Bench(double seconds, UINT width, UINT height)
+{
+	sSceneSetup setup;
+	setup.black_or_wrap = true;
+	setup.screen_xcount = width;
+	setup.screen_ycount = height;
+	std::vector<uint8_t> v_stream;
+	AppendBaseScene(v_stream, setup);
+	SDHRAppendReady(v_stream);
+	SDHRCompositor compositor;
+	if (!compositor.Apply(v_stream) || compositor.GetStats().load_failures > 0)
+	{
+		fprintf(stderr, "The scene's commands were rejected, run from SuperDuperHelper/ or pass --assets\n");
+		return 2;
+	}
+
+	// Diagonally, not on tile boundaries, so every row and column has partial tiles
+	std::vector<UINT32> v_frame((size_t)width * height);
+	UINT64 frames = 0;
+	double elapsed = 0;
+	const Clock::time_point tStart = Clock::now();
+	while (elapsed < seconds)
+	{
+		v_stream.clear();
+		SDHRAppend(v_stream, UpdateWindowAdjustWindowViewCmd{ 0, (int64_t)(frames * 3), (int64_t)(frames * 2) });
+		SDHRAppendReady(v_stream);
+		compositor.Apply(v_stream);
+		compositor.Render(v_frame.data(), width, height);
+		++frames;
+		elapsed = std::chrono::duration<double>(Clock::now() - tStart).count();
+	}
+	printf("%ux%u: %llu frames in %.2f s, %.1f fps, %.3f ms per frame, %.1f Mpixels/s\n", width, height,
+		(unsigned long long)frames, elapsed, frames / elapsed, elapsed * 1000.0 / frames,
+		(double)frames * width * height / elapsed / 1e6);
+	return 0;
+}
+
+static void PrintUsage()
+{
+	printf("Usage: sdhr_render [--out DIR] [--golden FILE] [--update-golden] [--assets DIR]\n");
+	printf("       sdhr_render --capture FILE --out IMAGE.ppm [--size WIDTH HEIGHT]\n");
+	printf("       sdhr_render --bench SECONDS [--size WIDTH HEIGHT] [--assets DIR]\n");
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+	std::string capturePath;
+	std::string outPath;
+	std::string goldenPath = "tools/sdhr_golden.txt";
+	bool isUpdating = false;
+	double benchSeconds = 0;
+	UINT width = FRAME_WIDTH;
+	UINT height = FRAME_HEIGHT;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--out" && i + 1 < argc)
+			outPath = argv[++i];
+		else if (arg == "--golden" && i + 1 < argc)
+			goldenPath = argv[++i];
+		else if (arg == "--update-golden")
+			isUpdating = true;
+		else if (arg == "--assets" && i + 1 < argc)
+			g_assets_dir = argv[++i];
+		else if (arg == "--capture" && i + 1 < argc)
+			capturePath = argv[++i];
+		else if (arg == "--bench" && i + 1 < argc)
+			benchSeconds = strtod(argv[++i], nullptr);
+		else if (arg == "--size" && i + 2 < argc)
+		{
+			width = (UINT)strtoul(argv[++i], nullptr, 0);
+			height = (UINT)strtoul(argv[++i], nullptr, 0);
+		}
+		else
+		{
+			PrintUsage();
+			return (arg == "--help") ? 0 : 2;
+		}
+	}
+	if (width == 0 || height == 0 || width > 8192 || height > 8192)
+	{
+		fprintf(stderr, "The frame must be 1x1 to 8192x8192\n");
+		return 2;
+	}
+	if (benchSeconds > 0)
+		return Bench(benchSeconds, width, height);
+	if (!capturePath.empty())
+	{
+		if (outPath.empty())
+		{
+			PrintUsage();
+			return 2;
+		}
+		return RenderCapture(capturePath, outPath, width, height);
+	}
+	return CheckGolden(goldenPath, outPath, isUpdating);
+}